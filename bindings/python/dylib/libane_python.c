@@ -55,3 +55,9 @@ int pyane_read(struct ane_nn *nn, void *x0, void *x1, void *x2, void *x3,
 	}
 	return 0;
 }
+
+int pyane_send_image(struct ane_nn *nn, uint32_t idx, void *hwc, uint32_t H,
+		     uint32_t W, uint32_t C, float scale, float bias)
+{
+	return __ane_send_image(nn, idx, hwc, H, W, C, scale, bias);
+}
@@ -18,6 +18,7 @@ class _Driver:
 		self.lib.pyane_exec.argtypes = [c_void_p]
 		self.lib.pyane_send.argtypes = [c_void_p] + [c_void_p] * 0x20
 		self.lib.pyane_read.argtypes = [c_void_p] + [c_void_p] * 0x20
+		self.lib.pyane_send_image.argtypes = [c_void_p, ctypes.c_uint32, c_void_p, ctypes.c_uint32, ctypes.c_uint32, ctypes.c_uint32, ctypes.c_float, ctypes.c_float]
 		self.handles = {}
 		atexit.register(self.cleanup)
 
@@ -46,6 +47,16 @@ class model:
 		assert(len(inarrs) == self.src_count)
 		assert(all(((arr.dtype == np.float16) and (arr.shape == self.src_nchw[idx][:4])) for idx,arr in enumerate(inarrs)))
 		self.driver.lib.pyane_send(self.handle, *[arr.tobytes(order='C') for arr in inarrs], *self.inputs_pad)
+		return self.run()
+
+	def predict_image(self, img, scale=2/255, bias=-1.0):  # (H, W, C) uint8 -> input 0 as img * scale + bias
+		assert(self.src_count == 1)
+		img = np.ascontiguousarray(img, dtype=np.uint8)
+		(H, W, C) = img.shape
+		if (self.driver.lib.pyane_send_image(self.handle, 0, img.ctypes.data, H, W, C, scale, bias) != 0): raise ValueError("image does not match input")
+		return self.run()
+
+	def run(self):
 		self.driver.lib.pyane_exec(self.handle)
 		self.driver.lib.pyane_read(self.handle, *self.outputs, *self.outputs_pad)
 		return [np.frombuffer(self.outputs[idx], dtype=np.float16).reshape(*self.dst_nchw[idx][:4]) for idx in range(self.dst_count)]
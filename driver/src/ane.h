@@ -29,6 +29,13 @@ struct ane_device {
 
 	struct mutex iommu_lock;
 	struct mutex engine_lock;
+
+	/* Requests retire in submission order on one ordered queue */
+	struct workqueue_struct *wq;
+	struct mutex queue_lock;
+	spinlock_t fence_lock;
+	u64 fence_context;
+	u64 fence_seqno;
 };
 
 struct ane_request {
@@ -1,6 +1,8 @@
 // SPDX-License-Identifier: GPL-2.0-only OR MIT
 /* Copyright 2022 Eileen Yoon <eyn@gmx.com> */
 
+#include <linux/dma-fence.h>
+#include <linux/file.h>
 #include <linux/interrupt.h>
 #include <linux/iommu.h>
 #include <linux/module.h>
@@ -8,6 +10,10 @@
 #include <linux/platform_device.h>
 #include <linux/pm_domain.h>
 #include <linux/pm_runtime.h>
+#include <linux/slab.h>
+#include <linux/sync_file.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
 
 #include <drm/drm_accel.h>
 #include <drm/drm_drv.h>
@@ -144,7 +150,20 @@ static const struct vm_operations_struct drm_gem_ane_vm_ops = {
 	.fault = ane_gem_vm_fault,
 };
 
+/* Runs on the last reference, which may be held by a queued request */
+static void ane_gem_free(struct drm_gem_object *gem)
+{
+	struct ane_device *ane = gem->dev->dev_private;
+	struct ane_bo *bo = to_bo(gem);
+
+	ane_iommu_unmap_pages(ane, bo);
+	drm_gem_put_pages(gem, bo->pages, true, true);
+	drm_gem_object_release(gem);
+	kfree(bo);
+}
+
 static const struct drm_gem_object_funcs ane_gem_object_funcs = {
+	.free = ane_gem_free,
 	.vm_ops = &drm_gem_ane_vm_ops,
 };
 
@@ -197,15 +216,11 @@ static int ane_bo_init(struct drm_device *drm, void *data,
 	if (err < 0)
 		goto put;
 
+	/* On failure the put below frees the bo through ane_gem_free() */
 	err = drm_gem_handle_create(file, gem, &args->handle);
 	drm_gem_object_put(gem); /* handle holds it now */
-	if (err < 0)
-		goto unmap;
-
-	return 0;
+	return err;
 
-unmap:
-	ane_iommu_unmap_pages(ane, bo);
 put:
 	drm_gem_put_pages(&bo->base, bo->pages, false, false);
 release:
@@ -218,52 +233,180 @@ free:
 static int ane_bo_free(struct drm_device *drm, void *data,
 		       struct drm_file *file)
 {
-	struct ane_device *ane = drm->dev_private;
 	struct drm_ane_bo_free *args = data;
-	struct ane_bo *bo = bo_lookup(file, args->handle);
-	if (args->pad || !bo)
+	if (args->pad)
+		return -EINVAL;
+	/* Requests still in flight keep their own references */
+	return drm_gem_handle_delete(file, args->handle);
+}
+
+/*
+ * One or more queued requests, run back to back. The job owns a reference on
+ * every bo they name until it retires, and is freed with its fence.
+ */
+struct ane_job {
+	struct work_struct work;
+	struct dma_fence fence;
+	struct ane_device *ane;
+	struct drm_gem_object **gems;
+	u32 gem_count;
+	u32 req_count;
+	struct ane_request reqs[];
+};
+
+#define to_job(fence) (container_of(fence, struct ane_job, fence))
+
+static const char *ane_fence_get_driver_name(struct dma_fence *fence)
+{
+	return "ane";
+}
+
+static const char *ane_fence_get_timeline_name(struct dma_fence *fence)
+{
+	return "engine";
+}
+
+static void ane_fence_release(struct dma_fence *fence)
+{
+	kfree_rcu(to_job(fence), fence.rcu);
+}
+
+static const struct dma_fence_ops ane_fence_ops = {
+	.get_driver_name = ane_fence_get_driver_name,
+	.get_timeline_name = ane_fence_get_timeline_name,
+	.release = ane_fence_release,
+};
+
+static void ane_job_put_bos(struct ane_job *job)
+{
+	for (u32 i = 0; i < job->gem_count; i++)
+		drm_gem_object_put(job->gems[i]);
+	kvfree(job->gems);
+	job->gems = NULL;
+	job->gem_count = 0;
+}
+
+static void ane_job_work(struct work_struct *work);
+
+static struct ane_job *ane_job_alloc(struct ane_device *ane, u32 count)
+{
+	struct ane_job *job = kzalloc(struct_size(job, reqs, count), GFP_KERNEL);
+	if (!job)
+		return NULL;
+
+	job->gems = kvcalloc(count * (ANE_MAX_TILE_COUNT + 1),
+			     sizeof(*job->gems), GFP_KERNEL);
+	if (!job->gems) {
+		kfree(job);
+		return NULL;
+	}
+
+	job->ane = ane;
+	INIT_WORK(&job->work, ane_job_work);
+	return job;
+}
+
+/* Only for jobs that were never queued */
+static void ane_job_free(struct ane_job *job)
+{
+	ane_job_put_bos(job);
+	kfree(job);
+}
+
+static struct ane_bo *ane_job_lookup(struct ane_job *job, struct drm_file *file,
+				     u32 handle)
+{
+	struct ane_bo *bo = bo_lookup(file, handle);
+	if (bo)
+		job->gems[job->gem_count++] = &bo->base;
+	return bo;
+}
+
+/*
+ * Resolves a channel at offset into a bo, which may hold the channels of many
+ * requests. At least reserve bytes must follow offset.
+ */
+static int ane_job_iova(struct ane_device *ane, struct ane_job *job,
+			struct drm_file *file, u32 handle, u64 offset,
+			u64 reserve, u64 *iova)
+{
+	struct ane_bo *bo = ane_job_lookup(job, file, handle);
+	if (!bo || !bo->iova || !IS_ALIGNED(offset, ANE_CMD_GRAN) ||
+	    offset >= bo->base.size || reserve >= bo->base.size - offset)
+		return -EINVAL;
+
+	*iova = bo->iova + offset;
+	if (ane->hw->id <= DRM_ANE_ID_H13 && upper_32_bits(*iova))
 		return -EINVAL;
-	drm_gem_handle_delete(file, args->handle);
-	ane_iommu_unmap_pages(ane, bo);
-	drm_gem_put_pages(&bo->base, bo->pages, true, true);
-	drm_gem_object_release(&bo->base);
-	kfree(bo);
 	return 0;
 }
 
-static int ane_submit(struct drm_device *drm, void *data, struct drm_file *file)
+/* A batch stops at its first failing request */
+static void ane_job_work(struct work_struct *work)
 {
-	struct ane_device *ane = drm->dev_private;
-	struct drm_ane_submit *args = data;
-	struct ane_bo *bo;
-	int err;
+	struct ane_job *job = container_of(work, struct ane_job, work);
+	struct ane_device *ane = job->ane;
+	int err, pm;
 
-	printk(KERN_ERR "[ane] %s:%s():%d\n", __FILE__, __func__, __LINE__);
-	struct ane_request req;
-	memset(&req, 0, sizeof(req));
+	/*
+	 * The only power reference a submission holds. On failure it is already
+	 * dropped; -EACCES means runtime PM is disabled and the engine is up.
+	 */
+	pm = pm_runtime_resume_and_get(ane->dev);
+	if (pm < 0 && pm != -EACCES) {
+		err = pm;
+		goto signal;
+	}
+
+	mutex_lock(&ane->engine_lock);
+
+	for (u32 i = 0; i < job->req_count; i++) {
+		err = ane->hw->tm_enqueue(ane, &job->reqs[i]);
+		if (err < 0)
+			break;
+
+		err = ane->hw->tm_execute(ane, &job->reqs[i]);
+		if (err < 0)
+			break;
+	}
+
+	mutex_unlock(&ane->engine_lock);
+	if (!pm) {
+		pm_runtime_mark_last_busy(ane->dev);
+		pm_runtime_put_autosuspend(ane->dev);
+	}
+signal:
+	if (err < 0)
+		dma_fence_set_error(&job->fence, err);
+	dma_fence_signal(&job->fence);
+	ane_job_put_bos(job);
+	dma_fence_put(&job->fence);
+}
+
+/* Validates args and resolves the bos; nothing touches the engine yet */
+static int ane_job_add(struct ane_device *ane, struct ane_job *job,
+		       struct drm_file *file, const struct drm_ane_submit *args)
+{
+	struct ane_request *req = &job->reqs[job->req_count];
 
-	if (args->pad || !args->tsk_size || !args->td_count || !args->td_size ||
+	if (args->pad || args->pad1 || !args->tsk_size || !args->td_count || !args->td_size ||
 	    !args->handles[CMD_BUF_BDX] || args->handles[KRN_BUF_BDX] ||
 	    !args->btsp_handle) {
 		return -EINVAL;
 	}
 
-	req.qid = 4;
-	req.nid = ANE_FIFO_NID;
-	req.td_size = args->td_size;
-	req.td_count = args->td_count;
+	req->qid = 4;
+	req->nid = ANE_FIFO_NID;
+	req->td_size = args->td_size;
+	req->td_count = args->td_count;
 
 	for (int bdx = 0; bdx < ane->hw->bar_count; bdx++) {
-		if (args->handles[bdx]) {
-			bo = bo_lookup(file, args->handles[bdx]);
-			if (!bo || !bo->iova ||
-			    ((bdx == CMD_BUF_BDX) &&
-			     (args->tsk_size >= (bo->npages << ane->shift))))
-				return -EINVAL;
-			if (ane->hw->id <= DRM_ANE_ID_H13 && upper_32_bits(bo->iova))
-				return -EINVAL;
-			req.bar[bdx] = bo->iova;
-		}
+		if (args->handles[bdx] &&
+		    ane_job_iova(ane, job, file, args->handles[bdx],
+				 args->offsets[bdx],
+				 bdx == CMD_BUF_BDX ? args->tsk_size : 0,
+				 &req->bar[bdx]) < 0)
+			return -EINVAL;
 	}
 
 	/*
@@ -271,29 +414,178 @@ static int ane_submit(struct drm_device *drm, void *data, struct drm_file *file)
 	 * access. Since this isn't page aligned, we represent the two as one
 	 * buffer and calculate the delimiter (where the weights would start).
 	 */
-	req.bar[KRN_BUF_BDX] =
-		req.bar[CMD_BUF_BDX] + round_up(args->tsk_size, ANE_CMD_GRAN);
+	req->bar[KRN_BUF_BDX] =
+		req->bar[CMD_BUF_BDX] + round_up(args->tsk_size, ANE_CMD_GRAN);
 
-	bo = bo_lookup(file, args->btsp_handle);
-	if (!bo)
+	if (ane_job_iova(ane, job, file, args->btsp_handle, args->btsp_offset,
+			 0, &req->btsp_iova) < 0)
+		return -EINVAL;
+
+	job->req_count++;
+	return 0;
+}
+
+/*
+ * Queues job behind every earlier submission. Returns a reference to its
+ * fence, and a sync_file wrapping it when sync is not NULL. Frees the job on
+ * failure.
+ */
+static int ane_job_queue(struct ane_device *ane, struct ane_job *job,
+			 struct sync_file **sync)
+{
+	mutex_lock(&ane->queue_lock);
+
+	/* Seqnos must follow the order requests retire in */
+	dma_fence_init(&job->fence, &ane_fence_ops, &ane->fence_lock,
+		       ane->fence_context, ++ane->fence_seqno);
+
+	if (sync) {
+		*sync = sync_file_create(&job->fence);
+		if (!*sync) {
+			mutex_unlock(&ane->queue_lock);
+			ane_job_put_bos(job);
+			dma_fence_put(&job->fence);
+			return -ENOMEM;
+		}
+	}
+
+	/* The worker drops the initial reference once the job retires */
+	dma_fence_get(&job->fence);
+	queue_work(ane->wq, &job->work);
+
+	mutex_unlock(&ane->queue_lock);
+	return 0;
+}
+
+/*
+ * Queues a fully built job. Waits for it if fence_fd is NULL, otherwise
+ * stores a sync_file fd for it there.
+ */
+static int ane_job_submit(struct ane_device *ane, struct ane_job *job,
+			  s32 *fence_fd)
+{
+	struct sync_file *sync;
+	long err;
+	int fd;
+
+	if (!fence_fd) {
+		err = ane_job_queue(ane, job, NULL);
+		if (err < 0)
+			return err;
+
+		/*
+		 * If interrupted, the job still runs and cleans up after
+		 * itself. The ioctl must not be restarted, or the job would be
+		 * queued again behind the copy that is already running.
+		 */
+		err = dma_fence_wait(&job->fence, true);
+		if (err == -ERESTARTSYS)
+			err = -EINTR;
+		else if (!err)
+			err = min(dma_fence_get_status(&job->fence), 0);
+
+		dma_fence_put(&job->fence);
+		return err;
+	}
+
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0) {
+		ane_job_free(job);
+		return fd;
+	}
+
+	err = ane_job_queue(ane, job, &sync);
+	if (err < 0) {
+		put_unused_fd(fd);
+		return err;
+	}
+
+	/* The sync_file holds its own reference */
+	dma_fence_put(&job->fence);
+
+	fd_install(fd, sync->file);
+	*fence_fd = fd;
+	return 0;
+}
+
+static int ane_submit(struct drm_device *drm, void *data, struct drm_file *file)
+{
+	struct ane_device *ane = drm->dev_private;
+	struct drm_ane_submit *args = data;
+	struct ane_job *job;
+	int err;
+
+	printk(KERN_ERR "[ane] %s:%s():%d\n", __FILE__, __func__, __LINE__);
+	job = ane_job_alloc(ane, 1);
+	if (!job)
+		return -ENOMEM;
+
+	err = ane_job_add(ane, job, file, args);
+	if (err < 0) {
+		ane_job_free(job);
+		return err;
+	}
+
+	return ane_job_submit(ane, job, NULL);
+}
+
+static int ane_submit_async(struct drm_device *drm, void *data,
+			    struct drm_file *file)
+{
+	struct ane_device *ane = drm->dev_private;
+	struct drm_ane_submit_async *args = data;
+	struct ane_job *job;
+	int err;
+
+	if (args->pad)
 		return -EINVAL;
-	if (ane->hw->id <= DRM_ANE_ID_H13 && upper_32_bits(bo->iova))
+
+	job = ane_job_alloc(ane, 1);
+	if (!job)
+		return -ENOMEM;
+
+	err = ane_job_add(ane, job, file, &args->submit);
+	if (err < 0) {
+		ane_job_free(job);
+		return err;
+	}
+
+	return ane_job_submit(ane, job, &args->fence_fd);
+}
+
+static int ane_submit_batch(struct drm_device *drm, void *data,
+			    struct drm_file *file)
+{
+	struct ane_device *ane = drm->dev_private;
+	struct drm_ane_submit_batch *args = data;
+	struct drm_ane_submit __user *submits = u64_to_user_ptr(args->submits);
+	struct drm_ane_submit submit;
+	struct ane_job *job;
+	int err;
+
+	if (args->pad || (args->flags & ~ANE_BATCH_FENCE) || !args->count ||
+	    args->count > DRM_ANE_MAX_BATCH)
 		return -EINVAL;
-	req.btsp_iova = bo->iova;
 
-	mutex_lock(&ane->engine_lock);
+	job = ane_job_alloc(ane, args->count);
+	if (!job)
+		return -ENOMEM;
 
-	err = ane->hw->tm_enqueue(ane, &req);
-	if (err < 0)
-		goto unlock;
+	for (u32 i = 0; i < args->count; i++) {
+		if (copy_from_user(&submit, &submits[i], sizeof(submit))) {
+			ane_job_free(job);
+			return -EFAULT;
+		}
 
-	err = ane->hw->tm_execute(ane, &req);
-	if (err < 0)
-		goto unlock;
+		err = ane_job_add(ane, job, file, &submit);
+		if (err < 0) {
+			ane_job_free(job);
+			return err;
+		}
+	}
 
-unlock:
-	mutex_unlock(&ane->engine_lock);
-	return err;
+	return ane_job_submit(ane, job,
+			      args->flags & ANE_BATCH_FENCE ? &args->fence_fd : NULL);
 }
 
 static const struct drm_ioctl_desc ane_drm_ioctls[] = {
@@ -301,6 +593,8 @@ static const struct drm_ioctl_desc ane_drm_ioctls[] = {
 	DRM_IOCTL_DEF_DRV(ANE_BO_INIT, ane_bo_init, 0),
 	DRM_IOCTL_DEF_DRV(ANE_BO_FREE, ane_bo_free, 0),
 	DRM_IOCTL_DEF_DRV(ANE_SUBMIT, ane_submit, 0),
+	DRM_IOCTL_DEF_DRV(ANE_SUBMIT_ASYNC, ane_submit_async, 0),
+	DRM_IOCTL_DEF_DRV(ANE_SUBMIT_BATCH, ane_submit_batch, 0),
 };
 
 static int ane_drm_open(struct drm_device *drm, struct drm_file *file)
@@ -331,6 +625,19 @@ static void ane_drm_postclose(struct drm_device *drm, struct drm_file *file)
 	pm_runtime_put_autosuspend(ane->dev);
 }
 
+/* Submissions only queue jobs; the job worker powers the engine for them */
+static bool ane_ioctl_is_submit(unsigned int cmd)
+{
+	switch (DRM_IOCTL_NR(cmd)) {
+	case DRM_COMMAND_BASE + DRM_ANE_SUBMIT:
+	case DRM_COMMAND_BASE + DRM_ANE_SUBMIT_ASYNC:
+	case DRM_COMMAND_BASE + DRM_ANE_SUBMIT_BATCH:
+		return true;
+	default:
+		return false;
+	}
+}
+
 static long ane_drm_unlocked_ioctl(struct file *file, unsigned int cmd,
 				   unsigned long arg)
 {
@@ -339,6 +646,9 @@ static long ane_drm_unlocked_ioctl(struct file *file, unsigned int cmd,
 	struct ane_device *ane = drm->dev_private;
 	long err;
 	printk(KERN_ERR "[ane] %s:%s():%d\n", __FILE__, __func__, __LINE__);
+	if (ane_ioctl_is_submit(cmd))
+		return drm_ioctl(file, cmd, arg);
+
 	err = pm_runtime_resume_and_get(ane->dev);
 	if (err < 0 && err != -EACCES) {
 		pm_runtime_put_autosuspend(ane->dev);
@@ -542,10 +852,19 @@ static int ane_platform_probe(struct platform_device *pdev)
 
 	mutex_init(&ane->iommu_lock);
 	mutex_init(&ane->engine_lock);
+	mutex_init(&ane->queue_lock);
+	spin_lock_init(&ane->fence_lock);
+	ane->fence_context = dma_fence_context_alloc(1);
+
+	ane->wq = alloc_ordered_workqueue("ane", 0);
+	if (!ane->wq) {
+		err = -ENOMEM;
+		goto detach_genpd;
+	}
 
 	err = ane_iommu_domain_init(ane);
 	if (err < 0)
-		goto detach_genpd;
+		goto destroy_wq;
 
 	ane->hw->tm_enable(ane);
 
@@ -572,6 +891,8 @@ disable_pm:
 	pm_runtime_disable(dev);
 	pm_runtime_dont_use_autosuspend(dev);
 	ane_iommu_domain_free(ane);
+destroy_wq:
+	destroy_workqueue(ane->wq);
 detach_genpd:
 	ane_detach_genpd(ane);
 	return err;
@@ -582,6 +903,7 @@ static void ane_platform_remove(struct platform_device *pdev)
 	printk(KERN_ERR "[ane] %s:%s():%d\n", __FILE__, __func__, __LINE__);
 	struct ane_device *ane = platform_get_drvdata(pdev);
 	drm_dev_unregister(&ane->drm);
+	destroy_workqueue(ane->wq); /* drains queued requests */
 	pm_runtime_disable(ane->dev);
 	pm_runtime_dont_use_autosuspend(ane->dev);
 	ane_iommu_domain_free(ane);
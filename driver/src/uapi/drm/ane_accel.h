@@ -16,6 +16,11 @@ extern "C" {
 #define DRM_ANE_BO_INIT  0x2
 #define DRM_ANE_BO_FREE  0x3
 #define DRM_ANE_SUBMIT	 0x4
+#define DRM_ANE_SUBMIT_ASYNC 0x5
+#define DRM_ANE_SUBMIT_BATCH 0x6
+
+#define DRM_ANE_MAX_BATCH   16
+#define ANE_BATCH_FENCE	    0x1
 
 enum drm_ane_id {
     DRM_ANE_ID_M9   = 0,
@@ -50,6 +55,42 @@ struct drm_ane_submit {
 	__u32 handles[ANE_MAX_TILE_COUNT];
 	__u32 btsp_handle;
 	__u32 pad;
+	__u32 pad1;
+	/* Byte offsets into the bos above, for channels packed into one bo */
+	__u64 offsets[ANE_MAX_TILE_COUNT];
+	__u64 btsp_offset;
+};
+
+/*
+ * DRM_IOCTL_ANE_SUBMIT queues the request and blocks until it retires. It
+ * fails with EINTR if a signal arrives first; the request has been queued and
+ * still runs, so resubmitting it runs the model twice.
+ */
+
+/*
+ * Queues the request and returns at once. fence_fd receives a sync_file that
+ * signals when the request retires; its status is the request's error.
+ */
+struct drm_ane_submit_async {
+	struct drm_ane_submit submit;
+	__s32 fence_fd;
+	__u32 pad;
+};
+
+/*
+ * Queues count requests back to back, run under one engine lock and one
+ * power-up of the engine; nothing is queued if any of them is invalid. Blocks
+ * until the last one retires, unless ANE_BATCH_FENCE is set: then fence_fd
+ * receives a sync_file for the whole batch, failed if any request failed.
+ * A blocking batch interrupted by a signal fails with EINTR, as
+ * DRM_IOCTL_ANE_SUBMIT does, with every request already queued.
+ */
+struct drm_ane_submit_batch {
+	__u64 submits; /* user pointer to struct drm_ane_submit[count] */
+	__u32 count;
+	__u32 flags;
+	__s32 fence_fd;
+	__u32 pad;
 };
 
 #define DRM_IOCTL_ANE_INFO \
@@ -60,6 +101,10 @@ struct drm_ane_submit {
 	DRM_IOWR(DRM_COMMAND_BASE + DRM_ANE_BO_FREE, struct drm_ane_bo_free)
 #define DRM_IOCTL_ANE_SUBMIT \
 	DRM_IOWR(DRM_COMMAND_BASE + DRM_ANE_SUBMIT, struct drm_ane_submit)
+#define DRM_IOCTL_ANE_SUBMIT_ASYNC \
+	DRM_IOWR(DRM_COMMAND_BASE + DRM_ANE_SUBMIT_ASYNC, struct drm_ane_submit_async)
+#define DRM_IOCTL_ANE_SUBMIT_BATCH \
+	DRM_IOWR(DRM_COMMAND_BASE + DRM_ANE_SUBMIT_BATCH, struct drm_ane_submit_batch)
 
 #if defined(__cplusplus)
 }
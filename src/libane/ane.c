@@ -5,16 +5,27 @@
 #include <drm.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/sync_file.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <ane_accel.h>
 #include "ane.h"
+#include "ane_backend.h"
+#include "ane_cache.h"
+#include "ane_f16.h"
+#include "ane_td.h"
+#include "ane_tile.h"
 #include "hwx.h"
 
 #ifndef LIBANE_CONFIG_NO_ERR
@@ -26,20 +37,21 @@
 	} while (0)
 #endif
 
-#define TILE_SHIFT	   0xEUL
-#define TILE_SIZE	   0x4000UL
-
-#define tile_shift(x)	   (((uint64_t)(x)) << TILE_SHIFT)
-#define tile_align(x)	   ((((uint64_t)(x)) + TILE_SIZE - 1) & -TILE_SIZE)
 #define tile_size(nn, bdx) (tile_shift(ane_model(nn)->tiles[bdx]))
 
-#define src_bdx(nn, idx)   (4 + ane_dst_count(nn) + idx)
-#define dst_bdx(nn, idx)   (4 + idx)
+#define src_bdx(nn, idx)   (ane_model(nn)->src_plans[idx].bdx)
+#define dst_bdx(nn, idx)   (ane_model(nn)->dst_plans[idx].bdx)
+
+/* ane.h needs only <stdint.h>, so it cannot take the limit from the uapi */
+#ifndef LIBANE_CONFIG_NO_STATIC_ASSERT
+_Static_assert(ANE_MAX_BATCH == DRM_ANE_MAX_BATCH, "batch limit differs from the driver's");
+#endif
 
 #define MAX_ANE_DEVICES	   2
-#define MAX_NODE_LEN	   30
 #define MAX_NODE_COUNT	   64
 
+#define ANE_BACKEND_ENV	   "LIBANE_BACKEND"
+
 // size 0x25C
 struct ane_request_h14 {
 	uint32_t unk0;
@@ -105,38 +117,39 @@ static inline void set_nid(void *td, int nid)
 	memcpy(td, &hdr0, sizeof(uint32_t));
 }
 
-static inline void set_btsp_and_command(struct ane_nn *nn)
+static void ane_model_plan(struct ane_model *model, uint32_t td_version,
+			   const void *tds, uint64_t size);
+
+static inline int set_btsp_and_command(struct ane_nn *nn)
 {
-	const struct ane_model *model = ane_model(nn);
-	if (!model->hwx) {
-		return;
-	}
+	struct ane_model *model = ane_model(nn);
 
 	void *btsp = nn->btsp_chan.map;
 	size_t btsp_size = nn->btsp_chan.size;
 	if (!btsp || btsp_size == 0) {
-		return;
+		return 0;
 	}
 
 	memset(btsp, 0, btsp_size);
 
-	const struct hwx_section *text = hwx_get_tsk_section(model->hwx);
-	if (text) {
-		uint64_t copy = model->td_size;
-		if (copy == 0 || copy > text->size) {
-			copy = text->size;
-		}
-		if (copy > btsp_size) {
-			copy = btsp_size;
-		}
-		if (copy > 0) {
-			if (hwx_section_read(model->hwx, text, 0, btsp, (size_t)copy) != 0) {
-				memset(btsp, 0, (size_t)copy);
-			}
+	uint64_t copy = model->btsp_size;
+	if (copy > btsp_size) {
+		copy = btsp_size;
+	}
+	if (model->btsp) {
+		memcpy(btsp, model->btsp, (size_t)copy);
+	} else if (model->hwx && copy > 0) {
+		/* Streamed models are read straight into the channel */
+		const struct hwx_section *tsk = hwx_get_tsk_section(model->hwx);
+		if (hwx_section_read(model->hwx, tsk, 0, btsp, (size_t)copy) != 0) {
+			ane_err("failed to read bootstrap TD\n");
+			return -EIO;
 		}
+		ane_model_plan(model, hwx_td_version(model->hwx), btsp, copy);
 	}
 
 	set_nid(btsp, ANE_FIFO_NID);
+	return 0;
 }
 
 static inline int bo_init(struct ane_nn *nn, struct ane_bo *bo)
@@ -149,7 +162,7 @@ static inline int bo_init(struct ane_nn *nn, struct ane_bo *bo)
 	}
 
 	bo->handle = args.handle;
-	bo->offset = args.offset;
+	bo->mmap_offset = args.offset;
 
 	return 0;
 }
@@ -161,13 +174,13 @@ static inline void bo_free(struct ane_nn *nn, struct ane_bo *bo)
 		ioctl(nn->fd, DRM_IOCTL_ANE_BO_FREE, &args);
 	}
 	bo->handle = 0;
-	bo->offset = 0;
+	bo->mmap_offset = 0;
 }
 
 static inline int bo_mmap(struct ane_nn *nn, struct ane_bo *bo)
 {
 	bo->map = mmap(0, bo->size, PROT_READ | PROT_WRITE, MAP_SHARED, nn->fd,
-		       bo->offset);
+		       bo->mmap_offset);
 
 	if (bo->map == MAP_FAILED) {
 		bo->map = NULL;
@@ -187,13 +200,10 @@ static inline void bo_munmap(struct ane_nn *nn, struct ane_bo *bo)
 	bo->map = NULL;
 }
 
-static inline int ane_bo_init(struct ane_nn *nn, struct ane_bo *bo)
+static int drm_bo_init(struct ane_nn *nn, struct ane_bo *bo)
 {
 	int err;
 
-	if (!bo->size)
-		return -EINVAL;
-
 	err = bo_init(nn, bo);
 	if (err < 0) {
 		return err;
@@ -208,48 +218,146 @@ static inline int ane_bo_init(struct ane_nn *nn, struct ane_bo *bo)
 	return 0;
 }
 
-static inline void ane_bo_free(struct ane_nn *nn, struct ane_bo *bo)
+static void drm_bo_free(struct ane_nn *nn, struct ane_bo *bo)
 {
 	bo_munmap(nn, bo);
 	bo_free(nn, bo);
 }
 
+static inline int ane_bo_init(struct ane_nn *nn, struct ane_bo *bo)
+{
+	if (!bo->size)
+		return -EINVAL;
+
+	return nn->backend->bo_init(nn, bo);
+}
+
+static inline void ane_bo_free(struct ane_nn *nn, struct ane_bo *bo)
+{
+	nn->backend->bo_free(nn, bo);
+}
+
+/*
+ * Channels are ranges of one arena bo per model: one allocation, one mapping
+ * and one IOMMU map instead of one per channel. Offsets stay TILE_SIZE
+ * aligned, like separate bos would be.
+ */
+static inline void ane_bo_carve(struct ane_bo *arena, struct ane_bo *bo,
+				uint64_t offset)
+{
+	bo->map = (uint8_t *)arena->map + offset;
+	bo->handle = arena->handle;
+	bo->parent = arena;
+	bo->offset = offset;
+}
+
+/*
+ * What clones of a model share: the arena of the model first cloned, whose
+ * shared channels and bootstrap channel they all use, and the resolved model
+ * with its hwx_file and cache entry. Freed with the last nn holding it.
+ */
+struct ane_shared {
+	atomic_uint refs;
+	struct ane_nn *owner; /* nn whose arena bo is, until it is freed */
+	struct ane_bo bo;
+	struct ane_model model;
+};
+
+/* Clones have only I/O channels in their arena */
+static inline int ane_is_clone(const struct ane_nn *nn)
+{
+	return nn->shared && nn->shared->owner != nn;
+}
+
 static inline void ane_chan_free(struct ane_nn *nn)
 {
-	ane_bo_free(nn, &nn->btsp_chan);
+	/* The arena of an owner goes with the shared state */
+	if (!nn->shared || ane_is_clone(nn)) {
+		ane_bo_free(nn, &nn->arena);
+	}
 
-	for (int bdx = 0; bdx < ANE_MAX_TILE_COUNT; bdx++) {
-		ane_bo_free(nn, &nn->chans[bdx]);
+	memset(&nn->btsp_chan, 0, sizeof(nn->btsp_chan));
+	memset(nn->chans, 0, sizeof(nn->chans));
+}
+
+/* Inputs and outputs get one copy per slot; other channels are shared */
+static inline int ane_chan_is_io(const struct ane_model *model, const uint32_t bdx)
+{
+	for (uint32_t i = 0; i < model->src_count; i++) {
+		if (model->src_plans[i].bdx == bdx) {
+			return 1;
+		}
+	}
+	for (uint32_t i = 0; i < model->dst_count; i++) {
+		if (model->dst_plans[i].bdx == bdx) {
+			return 1;
+		}
 	}
+	return 0;
 }
 
-static inline int ane_chan_init(struct ane_nn *nn)
+/*
+ * Arena layout: shared channels, the bootstrap channel, then slot 0 of the
+ * I/O channels and further slots back to back; clones start at slot 0. Sizes
+ * the channels and, with carve, points them at the arena. Returns the bytes
+ * up to the end of slot 0.
+ */
+static uint64_t ane_chan_layout(struct ane_nn *nn, uint64_t *slot_size, int carve)
 {
 	const struct ane_model *model = ane_model(nn);
-	struct ane_bo *bo;
-	int err;
+	uint64_t offset = 0;
 
-	for (int bdx = 0; bdx < ANE_MAX_TILE_COUNT; bdx++) {
-		if (model->tiles[bdx]) {
-			bo = &nn->chans[bdx];
-			bo->size = tile_size(nn, bdx);
-			err = ane_bo_init(nn, bo);
-			if (err < 0)
-				goto error;
+	for (int io = ane_is_clone(nn); io < 2; io++) {
+		const uint64_t start = offset;
+		for (int bdx = 0; bdx < ANE_MAX_TILE_COUNT; bdx++) {
+			if (!model->tiles[bdx] || ane_chan_is_io(model, bdx) != io) {
+				continue;
+			}
+			nn->chans[bdx].size = tile_size(nn, bdx);
+			if (carve) {
+				ane_bo_carve(&nn->arena, &nn->chans[bdx], offset);
+			}
+			offset += tile_align(nn->chans[bdx].size);
+		}
+
+		if (!io) {
+			nn->btsp_chan.size = tile_align(model->td_size);
+			if (carve) {
+				ane_bo_carve(&nn->arena, &nn->btsp_chan, offset);
+			}
+			offset += nn->btsp_chan.size;
+		} else {
+			*slot_size = offset - start;
 		}
 	}
 
-	bo = &nn->btsp_chan;
+	return offset;
+}
+
+static inline int ane_chan_init(struct ane_nn *nn)
+{
+	const struct ane_model *model = ane_model(nn);
+	struct ane_bo *arena = &nn->arena;
+	uint64_t slot_size;
+	int err;
+
 	if (!model->td_size) {
 		ane_err("td_size is zero; refusing to init bootstrap channel\n");
 		return -EINVAL;
 	}
-	bo->size = tile_align(model->td_size);
-	err = ane_bo_init(nn, bo);
+
+	nn->slot_count = 1;
+	nn->slot = 0;
+	arena->size = ane_chan_layout(nn, &slot_size, 0);
+	err = ane_bo_init(nn, arena);
 	if (err < 0)
 		goto error;
 
-	set_btsp_and_command(nn);
+	ane_chan_layout(nn, &nn->slot_size, 1);
+
+	err = set_btsp_and_command(nn);
+	if (err < 0)
+		goto error;
 
 	return 0;
 
@@ -259,38 +367,113 @@ error:
 	return err;
 }
 
-static inline int is_ane_device(int fd)
+/* Offset of the copy of an I/O channel in slot, from its current one */
+static inline uint64_t ane_slot_offset(const struct ane_nn *nn, const struct ane_bo *bo,
+				       const uint32_t slot)
 {
-	drm_version_t version = {};
-	int err = ioctl(fd, DRM_IOCTL_VERSION, &version);
-	if (err < 0) {
-		ane_err("failed to get drm version with %d", err);
+	return bo->offset - nn->slot * nn->slot_size + slot * nn->slot_size;
+}
+
+int ane_select_slot(struct ane_nn *nn, uint32_t slot)
+{
+	if (slot >= nn->slot_count) {
+		return -EINVAL;
+	}
+
+	for (int bdx = 0; bdx < ANE_MAX_TILE_COUNT; bdx++) {
+		if (nn->model.tiles[bdx] && ane_chan_is_io(ane_model(nn), bdx)) {
+			ane_bo_carve(&nn->arena, &nn->chans[bdx],
+				     ane_slot_offset(nn, &nn->chans[bdx], slot));
+		}
+	}
+	nn->slot = slot;
+
+	return 0;
+}
+
+/*
+ * Once its clones are all freed, the owner takes its arena back, and with it
+ * the model, which it holds a copy of: both are as they were before cloning.
+ */
+static void ane_shared_leave(struct ane_nn *nn)
+{
+	const struct ane_model *model = ane_model(nn);
+
+	for (int bdx = 0; bdx < ANE_MAX_TILE_COUNT; bdx++) {
+		if (model->tiles[bdx] && !ane_chan_is_io(model, bdx)) {
+			nn->chans[bdx].parent = &nn->arena;
+		}
+	}
+	nn->btsp_chan.parent = &nn->arena;
+	free(nn->shared);
+	nn->shared = NULL;
+}
+
+int ane_set_slots(struct ane_nn *nn, uint32_t count)
+{
+	if (!count || count > ANE_MAX_SLOTS) {
 		return -EINVAL;
 	}
 
-	if (!version.name_len) {
+	if (nn->shared && !ane_is_clone(nn)) {
+		/* Clones point into this arena */
+		if (atomic_load(&nn->shared->refs) > 1) {
+			return -EBUSY;
+		}
+		ane_shared_leave(nn);
+	}
+
+	/* Shared channels and slot 0 keep their place in the new arena */
+	const uint64_t prefix = nn->arena.size - (nn->slot_count - 1) * nn->slot_size;
+	struct ane_bo arena = { .size = prefix + (count - 1) * nn->slot_size };
+	int err = ane_bo_init(nn, &arena);
+	if (err < 0) {
+		return err;
+	}
+
+	memcpy(arena.map, nn->arena.map, prefix);
+	ane_bo_free(nn, &nn->arena);
+	nn->arena = arena;
+
+	nn->slot_count = count;
+	nn->slot = 0;
+	ane_chan_layout(nn, &nn->slot_size, 1);
+
+	return 0;
+}
+
+int ane_set_tile_flags(struct ane_nn *nn, uint32_t flags)
+{
+	if (flags & ~ANE_TILE_NO_PAD) {
 		return -EINVAL;
 	}
 
-	version.name = (char *)ane_malloc(version.name_len + 1);
-	version.date_len = 0;
-	version.desc_len = 0;
+	nn->tile_flags = flags;
+	return 0;
+}
+
+static inline int is_ane_device(int fd)
+{
+	/* Names longer than the buffer are truncated, and are not "ane" anyway */
+	char name[8];
+	drm_version_t version = {};
+	version.name = name;
+	version.name_len = sizeof(name) - 1;
 
-	err = ioctl(fd, DRM_IOCTL_VERSION, &version);
+	int err = ioctl(fd, DRM_IOCTL_VERSION, &version);
 	if (err < 0) {
 		ane_err("failed to get drm version with %d", err);
-		free(version.name);
 		return -EINVAL;
 	}
 
 	/* Results might not be null-terminated strings */
-	version.name[version.name_len] = '\0';
-	if (strcmp(version.name, "ane") != 0) {
-		free(version.name);
+	if (version.name_len >= sizeof(name)) {
+		return -EINVAL;
+	}
+	name[version.name_len] = '\0';
+	if (strcmp(name, "ane") != 0) {
 		return -EINVAL;
 	}
-
-	free(version.name);
 
 	return 0;
 }
@@ -310,36 +493,46 @@ static inline int open_fd(const char *node)
 	return fd;
 }
 
-static inline int device_open(int dev_id)
-{
-	int fd;
-	char node[MAX_NODE_LEN];
-	int found = 0;
-
-	if (dev_id < 0 || dev_id >= MAX_ANE_DEVICES) {
-		ane_err("invalid dev_id; 0 <= dev_id <= %d\n",
-			MAX_ANE_DEVICES - 1);
-		return -EINVAL;
-	}
+/*
+ * Accel nodes are enumerated once per process: each is opened only to tell
+ * whether it is an ANE and which one, and closed again.
+ */
+static struct ane_device drm_devices[MAX_ANE_DEVICES];
+static int drm_device_count;
+static pthread_once_t drm_devices_once = PTHREAD_ONCE_INIT;
 
-	for (int i = 0; i < MAX_NODE_COUNT; i++) {
-		snprintf(node, MAX_NODE_LEN, "/dev/accel/accel%d", i);
+static void drm_enumerate(void)
+{
+	for (int i = 0; i < MAX_NODE_COUNT && drm_device_count < MAX_ANE_DEVICES; i++) {
+		struct ane_device *device = &drm_devices[drm_device_count];
+		snprintf(device->node, sizeof(device->node), "/dev/accel/accel%d", i);
 
-		fd = open_fd(node);
+		int fd = open_fd(device->node);
 		if (fd < 0) {
 			continue;
 		}
 
-		if (dev_id == found) {
-			return fd;
+		struct drm_ane_info info = {};
+		if (ioctl(fd, DRM_IOCTL_ANE_INFO, &info) < 0) {
+			ane_err("DRM_IOCTL_ANE_INFO failed on %s\n", device->node);
+			close(fd);
+			continue;
 		}
-
-		found++;
 		close(fd);
+
+		device->dev_id = drm_device_count++;
+		device->chip_id = info.id;
 	}
+}
 
-	ane_err("failed to find device with dev_id %d\n", dev_id);
-	return -ENODEV;
+static const struct ane_device *drm_device(int dev_id)
+{
+	pthread_once(&drm_devices_once, drm_enumerate);
+
+	if (dev_id < 0 || dev_id >= drm_device_count) {
+		return NULL;
+	}
+	return &drm_devices[dev_id];
 }
 
 static inline void device_close(int fd)
@@ -349,147 +542,1064 @@ static inline void device_close(int fd)
 	}
 }
 
-static inline int ane_device_open(struct ane_nn *nn, int dev_id)
+/*
+ * Models on the same node share one fd, so that their bo handles live in one
+ * drm_file and a batch can name the bos of several models.
+ */
+struct drm_node {
+	char node[ANE_NODE_LEN];
+	int fd;
+	uint32_t refs;
+};
+
+static struct drm_node drm_nodes[MAX_ANE_DEVICES];
+static pthread_mutex_t drm_nodes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int drm_open(struct ane_nn *nn, int dev_id, const char *node)
 {
-	int fd = device_open(dev_id);
+	int fd = -1;
+
+	if (!node) {
+		const struct ane_device *device = drm_device(dev_id);
+		if (!device) {
+			ane_err("failed to find device with dev_id %d\n", dev_id);
+			return -ENODEV;
+		}
+		node = device->node;
+	}
+
+	pthread_mutex_lock(&drm_nodes_lock);
+
+	struct drm_node *shared = NULL;
+	for (int i = 0; i < MAX_ANE_DEVICES; i++) {
+		if (drm_nodes[i].refs && strcmp(drm_nodes[i].node, node) == 0) {
+			shared = &drm_nodes[i];
+			break;
+		}
+		if (!drm_nodes[i].refs && !shared) {
+			shared = &drm_nodes[i];
+		}
+	}
+
+	if (shared && shared->refs) {
+		fd = shared->fd;
+	} else {
+		fd = open_fd(node);
+	}
 	if (fd < 0) {
+		pthread_mutex_unlock(&drm_nodes_lock);
 		return -EINVAL;
 	}
 
+	/* Out of slots, the fd is simply not shared */
+	if (shared) {
+		if (!shared->refs) {
+			snprintf(shared->node, sizeof(shared->node), "%s", node);
+			shared->fd = fd;
+		}
+		shared->refs++;
+	}
+
+	pthread_mutex_unlock(&drm_nodes_lock);
+
 	nn->fd = fd;
 
 	return 0;
 }
 
-static inline void ane_device_close(struct ane_nn *nn)
+static void drm_close(struct ane_nn *nn)
 {
-	device_close(nn->fd);
+	pthread_mutex_lock(&drm_nodes_lock);
+
+	int shared = 0;
+	for (int i = 0; i < MAX_ANE_DEVICES; i++) {
+		if (drm_nodes[i].refs && drm_nodes[i].fd == nn->fd) {
+			shared = --drm_nodes[i].refs != 0;
+			break;
+		}
+	}
+	if (!shared) {
+		device_close(nn->fd);
+	}
+
+	pthread_mutex_unlock(&drm_nodes_lock);
 	nn->fd = 0;
 }
 
-static inline int ane_model_init(struct ane_nn *nn, const char *path)
+static int drm_attach(struct ane_nn *nn, const struct ane_nn *from)
 {
-	struct ane_model *model = ane_model(nn);
-	memset(model, 0, sizeof(*model));
-
-	struct hwx_file *hwx = hwx_open(path);
-	if (!hwx) {
-		ane_err("failed to load HWX at %s\n", path);
-		return -EINVAL;
-	}
-
-	model->hwx = hwx;
+	pthread_mutex_lock(&drm_nodes_lock);
 
-	const struct hwx_thread_state *cursor = NULL;
-	const struct hwx_thread_state *seg_state = NULL;
-	while ((cursor = hwx_thread_state_next(hwx, HWX_ANE_SEG_STATE, cursor)) != NULL) {
-		if (cursor->data && cursor->byte_size >= sizeof(struct hwx_ane_seg_state)) {
-			seg_state = cursor;
+	int fd = -1;
+	for (int i = 0; i < MAX_ANE_DEVICES; i++) {
+		if (drm_nodes[i].refs && drm_nodes[i].fd == from->fd) {
+			drm_nodes[i].refs++;
+			fd = from->fd;
 			break;
 		}
 	}
 
-	if (!seg_state) {
-		ane_err("HWX missing SEG_STATE thread state\n");
-		hwx_close(hwx);
-		model->hwx = NULL;
-		return -EINVAL;
+	/* An unshared fd is duplicated; either way the drm_file is the same */
+	if (fd < 0) {
+		fd = fcntl(from->fd, F_DUPFD_CLOEXEC, 0);
 	}
 
-	struct hwx_ane_seg_state seg_meta;
-	memset(&seg_meta, 0, sizeof(seg_meta));
-	memcpy(&seg_meta, seg_state->data, sizeof(seg_meta));
-	model->td_size = (uint64_t)seg_meta.seg_words * 4u;
-	model->td_count = seg_meta.td_count;
-	model->size = model->td_size;
-	if (!model->td_size) {
-		ane_err("SEG_STATE reported zero-sized segment\n");
-		goto err;
+	pthread_mutex_unlock(&drm_nodes_lock);
+	if (fd < 0) {
+		return -errno;
 	}
 
-	const struct hwx_section *tsk_section = hwx_get_tsk_section(hwx);
-	const struct hwx_section *krn_section = hwx_get_krn_section(hwx);
-	if (!tsk_section || !krn_section) {
-		ane_err("missing tsk or krn section\n");
-		goto err;
-	}
-	model->tsk_size = tsk_section->size;
-	model->krn_size = krn_section->size;
+	nn->fd = fd;
 	return 0;
-
-err:
-	hwx_close(hwx);
-	model->hwx = NULL;
-	return -EINVAL;
 }
 
-static inline void ane_model_free(struct ane_nn *nn)
+/*
+ * libane does not allocate the command channel yet, the TSK with the kernel
+ * behind it, whose handle the driver requires in every request. Until it does,
+ * requests are not sent: they retire at once without running, and fences are
+ * born signaled. LIBANE_CONFIG_DRM_SUBMIT sends them anyway.
+ */
+static int drm_submit_stub(int *fence_fd)
 {
-	struct ane_model *model = ane_model(nn);
-	if (model->hwx) {
-		hwx_close(model->hwx);
-		model->hwx = NULL;
+	if (fence_fd) {
+		*fence_fd = eventfd(1, EFD_CLOEXEC);
+		if (*fence_fd < 0) {
+			return -errno;
+		}
 	}
+	return 0;
 }
 
-struct ane_nn *__ane_init(const char *path, int dev_id)
+static int drm_submit(struct ane_nn *nn, const struct drm_ane_submit *args,
+		      int *fence_fd)
 {
-	struct ane_nn *nn = ane_zmalloc(sizeof(struct ane_nn));
-	if (!nn) {
-		return NULL;
+#ifndef LIBANE_CONFIG_DRM_SUBMIT
+	(void)nn;
+	(void)args;
+	return drm_submit_stub(fence_fd);
+#endif
+
+	if (!fence_fd) {
+		if (ioctl(nn->fd, DRM_IOCTL_ANE_SUBMIT, args) < 0) {
+			int err = -errno;
+			ane_err("DRM_IOCTL_ANE_SUBMIT failed with %d\n", err);
+			return err;
+		}
+		return 0;
 	}
 
-	if (ane_model_init(nn, path) < 0) {
-		ane_err("failed to load HWX from %s\n", path);
-		free(nn);
-		return NULL;
+	struct drm_ane_submit_async async = { .submit = *args, .fence_fd = -1 };
+	if (ioctl(nn->fd, DRM_IOCTL_ANE_SUBMIT_ASYNC, &async) < 0) {
+		int err = -errno;
+		ane_err("DRM_IOCTL_ANE_SUBMIT_ASYNC failed with %d\n", err);
+		return err;
 	}
 
-	if (ane_device_open(nn, dev_id) < 0) {
-		ane_err("failed to open device with dev_id %d\n", dev_id);
-		ane_model_free(nn);
-		free(nn);
-		return NULL;
+	*fence_fd = async.fence_fd;
+	return 0;
+}
+
+static int drm_submit_batch(struct ane_nn *const *nns, const struct drm_ane_submit *args,
+			    uint32_t count, int *fence_fd)
+{
+	for (uint32_t i = 0; i < count; i++) {
+		if (nns[i]->fd != nns[0]->fd) {
+			return -EXDEV;
+		}
 	}
 
-	if (ane_chan_init(nn) < 0) {
-		ane_err("failed to init memory-mapped chans\n");
-		ane_device_close(nn);
-		ane_model_free(nn);
-		free(nn);
-		return NULL;
+#ifndef LIBANE_CONFIG_DRM_SUBMIT
+	(void)args;
+	return drm_submit_stub(fence_fd);
+#endif
+
+	struct drm_ane_submit_batch batch = {
+		.submits = (uint64_t)(uintptr_t)args,
+		.count = count,
+		.flags = fence_fd ? ANE_BATCH_FENCE : 0,
+		.fence_fd = -1,
+	};
+	if (ioctl(nns[0]->fd, DRM_IOCTL_ANE_SUBMIT_BATCH, &batch) < 0) {
+		int err = -errno;
+		ane_err("DRM_IOCTL_ANE_SUBMIT_BATCH failed with %d\n", err);
+		return err;
 	}
 
-	return nn;
+	if (fence_fd) {
+		*fence_fd = batch.fence_fd;
+	}
+	return 0;
 }
 
-void __ane_free(struct ane_nn *nn)
+const struct ane_backend ane_drm_backend = {
+	.name = "drm",
+	.device = drm_device,
+	.open = drm_open,
+	.close = drm_close,
+	.attach = drm_attach,
+	.bo_init = drm_bo_init,
+	.bo_free = drm_bo_free,
+	.submit = drm_submit,
+	.submit_batch = drm_submit_batch,
+};
+
+static const struct ane_backend *default_backend;
+
+int ane_set_backend(enum ane_backend_id id)
 {
-	ane_chan_free(nn);
-	ane_device_close(nn);
-	ane_model_free(nn);
-	free(nn);
+	switch (id) {
+	case ANE_BACKEND_DRM:
+		default_backend = &ane_drm_backend;
+		return 0;
+	case ANE_BACKEND_MOCK:
+		default_backend = &ane_mock_backend;
+		return 0;
+	}
+	return -EINVAL;
 }
 
-int ane_exec(struct ane_nn *nn)
+static const struct ane_backend *ane_backend(void)
 {
-	const struct ane_model *model = ane_model(nn);
-
-	struct drm_ane_submit args;
-	memset(&args, 0, sizeof(args));
+	if (default_backend) {
+		return default_backend;
+	}
 
-	args.tsk_size = model->tsk_size;
-	args.td_count = model->td_count;
-	args.td_size = model->td_size;
+	const char *name = getenv(ANE_BACKEND_ENV);
+	if (name && strcmp(name, ane_mock_backend.name) == 0) {
+		return &ane_mock_backend;
+	}
+	return &ane_drm_backend;
+}
+
+static inline int ane_device_open(struct ane_nn *nn, int dev_id, const char *node)
+{
+	nn->backend = ane_backend();
+	return nn->backend->open(nn, dev_id, node);
+}
+
+static inline void ane_device_close(struct ane_nn *nn)
+{
+	nn->backend->close(nn);
+}
+
+/*
+ * Transfer plans. Each input and output is a __FVMLIB segment; its channel is
+ * the BAR whose base address is the segment. Plans start out as a dense copy
+ * of the section and are refined from the tile DMA of the TDs, so sends and
+ * reads only walk a copy list. Elements are fp16.
+ */
+static int ane_plan_init(struct ane_model *model, struct ane_plan *plan,
+			 const uint64_t N, const uint64_t C, const uint64_t H,
+			 const uint64_t W, const uint64_t P, const uint64_t R)
+{
+	const uint64_t row = W * sizeof(uint16_t);
+	const uint64_t extent = N * C * P;
+
+	if (!N || !C || !H || !W || R < row || P < (H - 1) * R + row ||
+	    extent > tile_shift(model->tiles[plan->bdx]) || extent > UINT32_MAX) {
+		return -EINVAL;
+	}
+
+	struct ane_copy copy = {
+		.size = (uint32_t)row,
+		.rows = (uint32_t)H,
+		.planes = (uint32_t)C,
+		.data_row = (uint32_t)row,
+		.data_plane = (uint32_t)(H * row),
+		.tile_row = (uint32_t)R,
+		.tile_plane = (uint32_t)P,
+	};
+
+	/* Rows that are back to back on both sides collapse into one, then planes */
+	if (H == 1 || R == row) {
+		copy.size = (uint32_t)(H * row);
+		copy.rows = 1;
+		copy.data_row = copy.tile_row = copy.size;
+	}
+	if (copy.rows == 1 && (C == 1 || P == copy.size)) {
+		copy.size = (uint32_t)(C * copy.size);
+		copy.planes = 1;
+		copy.data_plane = copy.tile_plane = copy.size;
+	}
+
+	uint64_t batches = N;
+	if (copy.rows == 1 && copy.planes == 1 && copy.size == C * P) {
+		copy.size = (uint32_t)(N * copy.size);
+		batches = 1;
+	}
+	if (batches > ANE_PLAN_COPIES) {
+		return -EINVAL;
+	}
+
+	plan->copy_count = (uint32_t)batches;
+	for (uint64_t n = 0; n < batches; n++) {
+		plan->copies[n] = copy;
+		plan->copies[n].data_offset = (uint32_t)(n * C * H * row);
+		plan->copies[n].tile_offset = (uint32_t)(n * C * P);
+	}
+	plan->size = N * C * H * row;
+	plan->clear = plan->size == extent ? 0 : extent;
+
+	uint64_t *nchw = model->nchw[plan->bdx];
+	nchw[0] = N;
+	nchw[1] = C;
+	nchw[2] = H;
+	nchw[3] = W;
+	nchw[4] = P;
+	nchw[5] = R;
+	return 0;
+}
+
+static int ane_plan_dense(struct ane_model *model, struct ane_plan *plan, uint64_t size)
+{
+	return ane_plan_init(model, plan, 1, 1, 1, size / sizeof(uint16_t), size, size);
+}
+
+static int ane_model_io_init(struct ane_model *model, const struct hwx_file *hwx,
+			     const uint64_t *base_addr)
+{
+	const struct hwx_segment *segments = hwx_segments(hwx);
+
+	for (uint32_t i = 0; i < hwx_segment_count(hwx); i++) {
+		const struct hwx_segment *segment = &segments[i];
+		if (strcmp(segment->name, "__FVMLIB") != 0 || !segment->section_count) {
+			continue;
+		}
+
+		int bdx = 0;
+		while (bdx < TILE_COUNT && base_addr[bdx] != segment->vmaddr) {
+			bdx++;
+		}
+		if (bdx == TILE_COUNT) {
+			ane_err("no channel for __FVMLIB at 0x%lx\n", segment->vmaddr);
+			return -EINVAL;
+		}
+
+		/* Outputs are the only segments the engine writes */
+		const int output = segment->initprot & 0x2;
+		uint32_t *count = output ? &model->dst_count : &model->src_count;
+		if (*count >= ANE_IO_COUNT) {
+			ane_err("too many tensors; max is %d\n", ANE_IO_COUNT);
+			return -EINVAL;
+		}
+
+		struct ane_plan *plan = output ? &model->dst_plans[*count] : &model->src_plans[*count];
+		(*count)++;
+		plan->bdx = (uint32_t)bdx;
+		model->tiles[bdx] = (uint32_t)(tile_align(segment->vmsize) >> TILE_SHIFT);
+		if (ane_plan_dense(model, plan, segment->sections[0].size) < 0) {
+			ane_err("bad __FVMLIB section at 0x%lx\n", segment->vmaddr);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * TDs do not say which BAR their tile DMA uses, so a DMA is matched to a plan
+ * by size alone. That is only sound when exactly one plan fits; plans that
+ * could be confused with another stay dense.
+ */
+static void ane_plan_match(struct ane_model *model, struct ane_plan *plans,
+			   uint32_t count, uint32_t *matched, const struct ane_td_dma *dma)
+{
+	if (!dma->C) {
+		return;
+	}
+
+	uint32_t found = count;
+	for (uint32_t i = 0; i < count; i++) {
+		if (plans[i].size != (uint64_t)dma->C * dma->plane_stride) {
+			continue;
+		}
+		if (found != count) {
+			return;
+		}
+		found = i;
+	}
+
+	if (found == count || (*matched & (1u << found))) {
+		return;
+	}
+	if (ane_plan_init(model, &plans[found], 1, dma->C, dma->H, dma->W,
+			  dma->plane_stride, dma->row_stride) == 0) {
+		*matched |= 1u << found;
+	}
+}
+
+/*
+ * Inputs no tile DMA reads feed the kernel DMA: one plane per output channel
+ * holding Cin elements, as for the dynamic weights of a matmul. As above, only
+ * a sole candidate is refined.
+ */
+static void ane_plan_match_kernel(struct ane_model *model, uint32_t *matched,
+				  const struct ane_td_dma *src, const struct ane_td_dma *dst)
+{
+	if (!src->C || !dst->C) {
+		return;
+	}
+
+	uint32_t found = model->src_count;
+	for (uint32_t i = 0; i < model->src_count; i++) {
+		const struct ane_plan *plan = &model->src_plans[i];
+		if ((*matched & (1u << i)) || plan->size % dst->C) {
+			continue;
+		}
+		const uint64_t P = plan->size / dst->C;
+		if (P % 64 || P < src->C * sizeof(uint16_t)) {
+			continue;
+		}
+		if (found != model->src_count) {
+			return;
+		}
+		found = i;
+	}
+
+	if (found == model->src_count) {
+		return;
+	}
+	struct ane_plan *plan = &model->src_plans[found];
+	const uint64_t P = plan->size / dst->C;
+	if (ane_plan_init(model, plan, 1, dst->C, 1, src->C, P, P) == 0) {
+		*matched |= 1u << found;
+	}
+}
+
+static void ane_model_plan(struct ane_model *model, uint32_t td_version,
+			   const void *tds, uint64_t size)
+{
+	const size_t td_size = ane_td_size(td_version);
+	if (!td_size || !tds) {
+		return;
+	}
+
+	uint32_t src_matched = 0;
+	uint32_t dst_matched = 0;
+	struct ane_td_dma src, dst;
+	for (uint64_t offset = 0, td = 0; offset + td_size <= size && td < model->td_count;
+	     offset += td_size, td++) {
+		if (ane_td_tile_dma(td_version, (const uint8_t *)tds + offset, &src, &dst) < 0) {
+			return;
+		}
+		ane_plan_match(model, model->src_plans, model->src_count, &src_matched, &src);
+		ane_plan_match(model, model->dst_plans, model->dst_count, &dst_matched, &dst);
+		ane_plan_match_kernel(model, &src_matched, &src, &dst);
+	}
+}
+
+static int ane_model_init(struct ane_model *model, struct hwx_file *hwx)
+{
+	memset(model, 0, sizeof(*model));
+
+	model->hwx = hwx;
+
+	const struct hwx_thread_state *cursor = NULL;
+	const struct hwx_thread_state *seg_state = NULL;
+	while ((cursor = hwx_thread_state_next(hwx, HWX_ANE_SEG_STATE, cursor)) != NULL) {
+		if (cursor->data && cursor->byte_size >= sizeof(struct hwx_ane_seg_state)) {
+			seg_state = cursor;
+			break;
+		}
+	}
+
+	if (!seg_state) {
+		ane_err("HWX missing SEG_STATE thread state\n");
+		goto err;
+	}
+
+	struct hwx_ane_seg_state seg_meta;
+	memset(&seg_meta, 0, sizeof(seg_meta));
+	memcpy(&seg_meta, seg_state->data, sizeof(seg_meta));
+	model->td_size = (uint64_t)seg_meta.seg_words * 4u;
+	model->td_count = seg_meta.td_count;
+	model->size = model->td_size;
+	if (!model->td_size) {
+		ane_err("SEG_STATE reported zero-sized segment\n");
+		goto err;
+	}
+
+	const struct hwx_section *tsk_section = hwx_get_tsk_section(hwx);
+	const struct hwx_section *krn_section = hwx_get_krn_section(hwx);
+	if (!tsk_section || !krn_section) {
+		ane_err("missing tsk or krn section\n");
+		goto err;
+	}
+	model->tsk_size = tsk_section->size;
+	model->krn_size = krn_section->size;
+
+	/* The bootstrap TD is the head of the TSK, up to one segment. Streams
+	 * have no mapping; set_btsp_and_command() reads them instead. */
+	model->btsp = hwx_section_data(hwx, tsk_section);
+	model->btsp_size = model->td_size;
+	if (model->btsp_size > tsk_section->size) {
+		model->btsp_size = tsk_section->size;
+	}
+
+	if (ane_model_io_init(model, hwx, seg_meta.base_addr) < 0) {
+		goto err;
+	}
+	ane_model_plan(model, hwx_td_version(hwx), model->btsp, model->btsp_size);
+	return 0;
+
+err:
+	hwx_close(hwx);
+	model->hwx = NULL;
+	return -EINVAL;
+}
+
+static void ane_model_fini(struct ane_model *model)
+{
+	if (model->hwx) {
+		hwx_close(model->hwx);
+		model->hwx = NULL;
+	}
+
+	struct ane_cache_entry entry = { .map = model->cache, .size = model->cache_size };
+	ane_cache_release(&entry);
+	model->cache = NULL;
+	model->cache_size = 0;
+	model->btsp = NULL;
+}
+
+/*
+ * image may be NULL when only fd is known, which skips the cache. On a miss
+ * the HWX is parsed from fd if valid, else in place from image.
+ */
+static int ane_model_resolve(struct ane_model *model, const void *image,
+			     uint64_t size, int fd)
+{
+	uint64_t key = 0;
+	const int cached = image && ane_cache_enabled() &&
+			   ane_cache_key(image, size, &key) == 0;
+
+	if (cached) {
+		struct ane_cache_entry entry;
+		if (ane_cache_lookup(key, image, size, &entry) == 0) {
+			ane_cache_entry_model(&entry, model);
+			model->cache = entry.map;
+			model->cache_size = entry.size;
+			return 0;
+		}
+	}
+
+	struct hwx_file *hwx = fd < 0 ? hwx_open_memory(image, size) : hwx_open_fd(fd);
+	if (!hwx) {
+		return -EINVAL;
+	}
+
+	/* ane_model_init() takes ownership of hwx, even on failure */
+	int err = ane_model_init(model, hwx);
+	if (err < 0) {
+		return err;
+	}
+
+	/* Best effort; a read-only cache directory only costs warm starts */
+	if (cached) {
+		ane_cache_store(key, size, model);
+	}
+
+	return 0;
+}
+
+static int ane_model_resolve_fd(struct ane_model *model, int fd)
+{
+	void *image = NULL;
+	uint64_t size = 0;
+
+	/* Hashing needs the contents; skip mapping when there is no cache */
+	struct stat st;
+	if (ane_cache_enabled() && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+	    st.st_size > 0) {
+		image = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (image == MAP_FAILED) {
+			image = NULL;
+		} else {
+			size = (uint64_t)st.st_size;
+		}
+	}
+
+	int err = ane_model_resolve(model, image, size, fd);
+
+	if (image) {
+		munmap(image, size);
+	}
+
+	return err;
+}
+
+int ane_model_load(struct ane_model *model, const void *data, uint64_t size)
+{
+	if (!model || !data) {
+		return -EINVAL;
+	}
+
+	return ane_model_resolve(model, data, size, -1);
+}
+
+void ane_model_unload(struct ane_model *model)
+{
+	if (model) {
+		ane_model_fini(model);
+	}
+}
+
+static inline void ane_model_free(struct ane_nn *nn)
+{
+	ane_model_fini(ane_model(nn));
+}
+
+/*
+ * Takes over a model resolved into nn; frees nn on failure. node skips device
+ * discovery when the accel node for dev_id is already known.
+ */
+static struct ane_nn *ane_init_model(struct ane_nn *nn, int dev_id, const char *node)
+{
+	if (ane_device_open(nn, dev_id, node) < 0) {
+		ane_err("failed to open device with dev_id %d\n", dev_id);
+		ane_model_free(nn);
+		free(nn);
+		return NULL;
+	}
+
+	if (ane_chan_init(nn) < 0) {
+		ane_err("failed to init memory-mapped chans\n");
+		ane_device_close(nn);
+		ane_model_free(nn);
+		free(nn);
+		return NULL;
+	}
+
+	return nn;
+}
+
+static struct ane_nn *ane_init_path(const char *path, int dev_id, const char *node)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		ane_err("failed to open %s\n", path);
+		return NULL;
+	}
+
+	struct ane_nn *nn = ane_zmalloc(sizeof(struct ane_nn));
+	if (!nn) {
+		close(fd);
+		return NULL;
+	}
+
+	int err = ane_model_resolve_fd(ane_model(nn), fd);
+	close(fd);
+	if (err < 0) {
+		ane_err("failed to load HWX from %s\n", path);
+		free(nn);
+		return NULL;
+	}
+
+	return ane_init_model(nn, dev_id, node);
+}
+
+struct ane_nn *__ane_init(const char *path, int dev_id)
+{
+	return ane_init_path(path, dev_id, NULL);
+}
+
+int ane_device_count(void)
+{
+	int count = 0;
+	while (ane_backend()->device(count)) {
+		count++;
+	}
+	return count;
+}
+
+const struct ane_device *ane_device_get(int dev_id)
+{
+	return ane_backend()->device(dev_id);
+}
+
+struct ane_nn *ane_init_on(const struct ane_device *device, const char *path)
+{
+	if (!device) {
+		return NULL;
+	}
+	return ane_init_path(path, device->dev_id, device->node);
+}
+
+struct ane_init_many_ctx {
+	const char *const *paths;
+	struct ane_nn **nns;
+	uint32_t count;
+	int dev_id;
+	const char *node;
+	atomic_uint next;
+	atomic_int loaded;
+};
+
+static void *ane_init_many_worker(void *arg)
+{
+	struct ane_init_many_ctx *ctx = (struct ane_init_many_ctx *)arg;
+
+	/* Workers pull one model at a time, so parsing and file I/O of one
+	 * model overlap with BO setup of another */
+	uint32_t idx;
+	while ((idx = atomic_fetch_add(&ctx->next, 1)) < ctx->count) {
+		ctx->nns[idx] = ane_init_path(ctx->paths[idx], ctx->dev_id, ctx->node);
+		if (ctx->nns[idx]) {
+			atomic_fetch_add(&ctx->loaded, 1);
+		}
+	}
+
+	return NULL;
+}
+
+int __ane_init_many(const char *const *paths, uint32_t count,
+		    struct ane_nn **nns, int threads, int dev_id)
+{
+	if (count && (!paths || !nns)) {
+		return -EINVAL;
+	}
+
+	if (!count) {
+		return 0;
+	}
+	memset(nns, 0, count * sizeof(*nns));
+
+	const struct ane_device *device = ane_backend()->device(dev_id);
+	if (!device) {
+		return -ENODEV;
+	}
+
+	if (threads <= 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? (int)cpus : 1;
+	}
+	if ((uint32_t)threads > count) {
+		threads = (int)count;
+	}
+
+	struct ane_init_many_ctx ctx = {
+		.paths = paths,
+		.nns = nns,
+		.count = count,
+		.dev_id = dev_id,
+		.node = device->node,
+	};
+	atomic_init(&ctx.next, 0);
+	atomic_init(&ctx.loaded, 0);
+
+	/* The calling thread is one of the workers */
+	pthread_t *workers = NULL;
+	int spawned = 0;
+	if (threads > 1) {
+		workers = ane_malloc((threads - 1) * sizeof(*workers));
+	}
+	for (; workers && spawned < threads - 1; spawned++) {
+		if (pthread_create(&workers[spawned], NULL, ane_init_many_worker, &ctx)) {
+			break;
+		}
+	}
+
+	ane_init_many_worker(&ctx);
+
+	for (int i = 0; i < spawned; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	free(workers);
+
+	return atomic_load(&ctx.loaded);
+}
+
+struct ane_nn *__ane_init_memory(const void *data, uint64_t size, int dev_id)
+{
+	struct ane_nn *nn = ane_zmalloc(sizeof(struct ane_nn));
+	if (!nn) {
+		return NULL;
+	}
+
+	if (ane_model_load(ane_model(nn), data, size) < 0) {
+		ane_err("failed to load HWX from memory at %p\n", data);
+		free(nn);
+		return NULL;
+	}
+
+	return ane_init_model(nn, dev_id, NULL);
+}
+
+struct ane_nn *__ane_init_stream(int fd, int dev_id)
+{
+	struct hwx_file *hwx = hwx_open_stream(fd);
+	if (!hwx) {
+		ane_err("failed to load HWX from stream fd %d\n", fd);
+		return NULL;
+	}
+
+	struct ane_nn *nn = ane_zmalloc(sizeof(struct ane_nn));
+	if (!nn) {
+		hwx_close(hwx);
+		return NULL;
+	}
+
+	/* ane_model_init() takes ownership of hwx, even on failure */
+	if (ane_model_init(ane_model(nn), hwx) < 0) {
+		ane_err("failed to init model from stream fd %d\n", fd);
+		free(nn);
+		return NULL;
+	}
+
+	return ane_init_model(nn, dev_id, NULL);
+}
+
+struct ane_nn *__ane_init_fd(int fd, int dev_id)
+{
+	if (fd < 0) {
+		ane_err("failed to load HWX from fd %d\n", fd);
+		return NULL;
+	}
+
+	struct ane_nn *nn = ane_zmalloc(sizeof(struct ane_nn));
+	if (!nn) {
+		return NULL;
+	}
+
+	if (ane_model_resolve_fd(ane_model(nn), fd) < 0) {
+		ane_err("failed to load HWX from fd %d\n", fd);
+		free(nn);
+		return NULL;
+	}
+
+	return ane_init_model(nn, dev_id, NULL);
+}
+
+static void ane_shared_put(struct ane_nn *nn)
+{
+	struct ane_shared *shared = nn->shared;
+
+	nn->shared = NULL;
+	if (shared->owner == nn) {
+		shared->owner = NULL;
+	}
+	if (atomic_fetch_sub(&shared->refs, 1) != 1) {
+		return;
+	}
+
+	/* Every other nn is gone, so this one holds the only device reference */
+	ane_bo_free(nn, &shared->bo);
+	ane_model_fini(&shared->model);
+	free(shared);
+}
+
+/* nn is left as it was unless the clone is complete */
+struct ane_nn *ane_nn_clone(struct ane_nn *nn)
+{
+	const struct ane_model *model = ane_model(nn);
+	struct ane_shared *shared = nn->shared;
+
+	if (!shared) {
+		shared = ane_zmalloc(sizeof(*shared));
+		if (!shared) {
+			return NULL;
+		}
+		atomic_init(&shared->refs, 1);
+		shared->owner = nn;
+		shared->bo = nn->arena;
+		shared->model = nn->model;
+	}
+
+	struct ane_nn *clone = ane_zmalloc(sizeof(*clone));
+	if (!clone) {
+		goto err;
+	}
+
+	clone->model = nn->model;
+	clone->backend = nn->backend;
+	if (clone->backend->attach(clone, nn) < 0) {
+		ane_err("failed to attach clone to device\n");
+		free(clone);
+		goto err;
+	}
+
+	uint64_t slot_size;
+	clone->shared = shared;
+	clone->slot_count = 1;
+	clone->arena.size = ane_chan_layout(clone, &slot_size, 0);
+	if (ane_bo_init(clone, &clone->arena) < 0) {
+		ane_err("failed to init clone channels\n");
+		ane_device_close(clone);
+		free(clone);
+		goto err;
+	}
+	ane_chan_layout(clone, &clone->slot_size, 1);
+
+	if (!nn->shared) {
+		/* Shared channels outlive nn->arena */
+		for (int bdx = 0; bdx < ANE_MAX_TILE_COUNT; bdx++) {
+			if (model->tiles[bdx] && !ane_chan_is_io(model, bdx)) {
+				nn->chans[bdx].parent = &shared->bo;
+			}
+		}
+		nn->btsp_chan.parent = &shared->bo;
+		nn->shared = shared;
+	}
+
+	atomic_fetch_add(&shared->refs, 1);
+	clone->btsp_chan = nn->btsp_chan;
+	for (int bdx = 0; bdx < ANE_MAX_TILE_COUNT; bdx++) {
+		if (model->tiles[bdx] && !ane_chan_is_io(model, bdx)) {
+			clone->chans[bdx] = nn->chans[bdx];
+		}
+	}
+
+	return clone;
+
+err:
+	if (shared != nn->shared) {
+		free(shared);
+	}
+	return NULL;
+}
+
+void __ane_free(struct ane_nn *nn)
+{
+	ane_chan_free(nn);
+	if (nn->shared) {
+		ane_shared_put(nn);
+	} else {
+		ane_model_free(nn);
+	}
+	ane_device_close(nn);
+	free(nn);
+}
+
+static void ane_submit_init(struct ane_nn *nn, struct drm_ane_submit *args,
+			    const uint32_t slot)
+{
+	const struct ane_model *model = ane_model(nn);
+
+	memset(args, 0, sizeof(*args));
+
+	args->tsk_size = model->tsk_size;
+	args->td_count = model->td_count;
+	args->td_size = model->td_size;
 
 	for (int bdx = 0; bdx < ANE_MAX_TILE_COUNT; bdx++) {
 		if (true) { // model->tiles[bdx]
-			args.handles[bdx] = nn->chans[bdx].handle;
+			args->handles[bdx] = nn->chans[bdx].handle;
+			args->offsets[bdx] = nn->chans[bdx].offset;
+			if (model->tiles[bdx] && ane_chan_is_io(model, bdx)) {
+				args->offsets[bdx] = ane_slot_offset(nn, &nn->chans[bdx], slot);
+			}
 		}
 	}
-	args.btsp_handle = nn->btsp_chan.handle;
+	args->btsp_handle = nn->btsp_chan.handle;
+	args->btsp_offset = nn->btsp_chan.offset;
+}
+
+int ane_exec_slot(struct ane_nn *nn, uint32_t slot)
+{
+	if (slot >= nn->slot_count) {
+		return -EINVAL;
+	}
+
+	struct drm_ane_submit args;
+	ane_submit_init(nn, &args, slot);
 
-	return 0;//ioctl(nn->fd, DRM_IOCTL_ANE_SUBMIT, &args);
+	return nn->backend->submit(nn, &args, NULL);
+}
+
+int ane_exec_slot_async(struct ane_nn *nn, uint32_t slot, struct ane_fence *fence)
+{
+	fence->fd = -1;
+	if (slot >= nn->slot_count) {
+		return -EINVAL;
+	}
+
+	struct drm_ane_submit args;
+	ane_submit_init(nn, &args, slot);
+
+	return nn->backend->submit(nn, &args, &fence->fd);
+}
+
+static int ane_exec_batch_submit(struct ane_nn *const *nns, uint32_t count,
+				 int *fence_fd)
+{
+	if (!count || count > ANE_MAX_BATCH) {
+		return -EINVAL;
+	}
+
+	for (uint32_t i = 0; i < count; i++) {
+		if (nns[i]->backend != nns[0]->backend) {
+			return -EXDEV;
+		}
+	}
+
+	struct drm_ane_submit args[ANE_MAX_BATCH];
+	for (uint32_t i = 0; i < count; i++) {
+		ane_submit_init(nns[i], &args[i], nns[i]->slot);
+	}
+
+	return nns[0]->backend->submit_batch(nns, args, count, fence_fd);
+}
+
+int ane_exec_batch(struct ane_nn *const *nns, uint32_t count)
+{
+	return ane_exec_batch_submit(nns, count, NULL);
+}
+
+int ane_exec_batch_async(struct ane_nn *const *nns, uint32_t count,
+			 struct ane_fence *fence)
+{
+	fence->fd = -1;
+	return ane_exec_batch_submit(nns, count, &fence->fd);
+}
+
+int ane_exec(struct ane_nn *nn)
+{
+	return ane_exec_slot(nn, nn->slot);
+}
+
+int ane_exec_async(struct ane_nn *nn, struct ane_fence *fence)
+{
+	return ane_exec_slot_async(nn, nn->slot, fence);
+}
+
+int ane_fence_wait(struct ane_fence *fence, int timeout_ms)
+{
+	if (fence->fd < 0) {
+		return -EINVAL;
+	}
+
+	struct pollfd pfd = { .fd = fence->fd, .events = POLLIN };
+	int n;
+	do {
+		n = poll(&pfd, 1, timeout_ms);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0) {
+		return -errno;
+	}
+	if (n == 0) {
+		return -ETIMEDOUT;
+	}
+	if (pfd.revents & (POLLERR | POLLNVAL)) {
+		return -EIO;
+	}
+
+	/* A sync_file carries the error of the request; other fences never fail */
+	struct sync_file_info info;
+	memset(&info, 0, sizeof(info));
+	if (ioctl(fence->fd, SYNC_IOC_FILE_INFO, &info) == 0 && info.status < 0) {
+		return info.status;
+	}
+
+	return 0;
+}
+
+void ane_fence_close(struct ane_fence *fence)
+{
+	if (fence->fd >= 0) {
+		close(fence->fd);
+	}
+	fence->fd = -1;
 }
 
 #ifndef LIBANE_CONFIG_NO_INDEX_CHECK
@@ -533,90 +1643,116 @@ void __ane_read(struct ane_nn *nn, void *to, const uint32_t idx)
 	       tile_size(nn, dst_bdx(nn, idx)));
 }
 
-// clang-format off
-void ane_tile(void *data, void *tile, const uint64_t N, const uint64_t C,
-	      const uint64_t H, const uint64_t W, const uint64_t P,
-	      const uint64_t R)
+/*
+ * Copies run in channel order, so sends zero only the gaps between the rows
+ * they write, up to the plan's extent: every byte there is written once.
+ * Returns where the last row ended.
+ */
+static uint64_t ane_plan_pad(const struct ane_plan *plan, uint8_t *tile, uint64_t written,
+			     uint64_t dst, uint32_t flags)
 {
-	const uint64_t new_H = P / R;
-	const uint64_t new_W = R / sizeof(uint16_t);
-	const uint64_t stride = W * sizeof(uint16_t);
-
-	const uint64_t C0 = C * H * W;
-	const uint64_t C1 = C * new_H * new_W;
-	const uint64_t H0 = H * W;
-	const uint64_t H1 = new_H * new_W;
+	if (plan->clear && dst > written && !(flags & ANE_TILE_NO_PAD)) {
+		memset(tile + written, 0, dst - written);
+	}
+	return dst;
+}
 
-	if ((new_H == H) && (new_W == W)) {
-		memcpy(tile, data, N * C * P);
-		return;
+static void ane_plan_send(const struct ane_plan *plan, void *tile, const void *data,
+			  uint32_t flags)
+{
+	uint64_t written = 0;
+
+	for (uint32_t i = 0; i < plan->copy_count; i++) {
+		const struct ane_copy *copy = &plan->copies[i];
+		for (uint32_t p = 0; p < copy->planes; p++) {
+			const uint64_t dst = copy->tile_offset + (uint64_t)p * copy->tile_plane;
+			const uint8_t *src = (const uint8_t *)data + copy->data_offset + (uint64_t)p * copy->data_plane;
+			for (uint32_t r = 0; r < copy->rows; r++) {
+				const uint64_t row = dst + (uint64_t)r * copy->tile_row;
+				written = ane_plan_pad(plan, tile, written, row, flags);
+				memcpy((uint8_t *)tile + row, src + (uint64_t)r * copy->data_row, copy->size);
+				written += copy->size;
+			}
+		}
 	}
 
-	memset(tile, 0, N * C * P);
+	ane_plan_pad(plan, tile, written, plan->clear, flags);
+}
 
-	for (uint64_t n = 0; n < N; n++) {
-		for (uint64_t c = 0; c < C; c++) {
-			for (uint64_t h = 0; h < H; h++) {
-				void *src = ((void *)(data)) + ((n * C0 + c * H0 + h * W) * sizeof(uint16_t));
-				void *dst = ((void *)(tile)) + ((n * C1 + c * H1 + h * new_W) * sizeof(uint16_t));
-				memcpy(dst, src, stride);
+/* Plans cover every element, so nothing is cleared on the way out */
+static void ane_plan_read(const struct ane_plan *plan, const void *tile, void *data)
+{
+	for (uint32_t i = 0; i < plan->copy_count; i++) {
+		const struct ane_copy *copy = &plan->copies[i];
+		for (uint32_t p = 0; p < copy->planes; p++) {
+			const uint8_t *src = (const uint8_t *)tile + copy->tile_offset + (uint64_t)p * copy->tile_plane;
+			uint8_t *dst = (uint8_t *)data + copy->data_offset + (uint64_t)p * copy->data_plane;
+			for (uint32_t r = 0; r < copy->rows; r++) {
+				memcpy(dst + (uint64_t)r * copy->data_row, src + (uint64_t)r * copy->tile_row, copy->size);
 			}
 		}
 	}
-	return;
 }
 
-void ane_untile(void *data, void *tile, const uint64_t N, const uint64_t C,
-		const uint64_t H, const uint64_t W, const uint64_t P,
-		const uint64_t R)
+/*
+ * fp32 variants convert each row on its way to or from the channel, in one
+ * pass. Offsets and sizes in a plan are in fp16 bytes, so element counts are
+ * half of them.
+ */
+static void ane_plan_send_f32(const struct ane_plan *plan, void *tile, const float *data,
+			      uint32_t flags)
 {
-	const uint64_t new_H = P / R;
-	const uint64_t new_W = R / sizeof(uint16_t);
-	const uint64_t stride = W * sizeof(uint16_t);
-
-	const uint64_t C0 = C * H * W;
-	const uint64_t C1 = C * new_H * new_W;
-	const uint64_t H0 = H * W;
-	const uint64_t H1 = new_H * new_W;
-
-	if ((new_H == H) && (new_W == W)) {
-		memcpy(data, tile, N * C * H * W * sizeof(uint16_t));
-		return;
+	uint8_t *base = (uint8_t *)tile;
+	uint64_t written = 0;
+
+	for (uint32_t i = 0; i < plan->copy_count; i++) {
+		const struct ane_copy *copy = &plan->copies[i];
+		for (uint32_t p = 0; p < copy->planes; p++) {
+			for (uint32_t r = 0; r < copy->rows; r++) {
+				const uint64_t dst = copy->tile_offset + (uint64_t)p * copy->tile_plane +
+						     (uint64_t)r * copy->tile_row;
+				const uint64_t src = copy->data_offset + (uint64_t)p * copy->data_plane +
+						     (uint64_t)r * copy->data_row;
+				written = ane_plan_pad(plan, base, written, dst, flags);
+				ane_f32_to_f16_row(data + src / sizeof(uint16_t),
+						   (uint16_t *)(base + dst), copy->size / sizeof(uint16_t));
+				written += copy->size;
+			}
+		}
 	}
 
-	memset(data, 0, N * C * H * W * sizeof(uint16_t));
+	ane_plan_pad(plan, base, written, plan->clear, flags);
+}
 
-	for (uint64_t n = 0; n < N; n++) {
-		for (uint64_t c = 0; c < C; c++) {
-			for (uint64_t h = 0; h < H; h++) {
-				void *src = ((void *)(tile)) + ((n * C1 + c * H1 + h * new_W) * sizeof(uint16_t));
-				void *dst = ((void *)(data)) + ((n * C0 + c * H0 + h * W) * sizeof(uint16_t));
-				memcpy(dst, src, stride);
+static void ane_plan_read_f32(const struct ane_plan *plan, const void *tile, float *data)
+{
+	for (uint32_t i = 0; i < plan->copy_count; i++) {
+		const struct ane_copy *copy = &plan->copies[i];
+		for (uint32_t p = 0; p < copy->planes; p++) {
+			for (uint32_t r = 0; r < copy->rows; r++) {
+				const uint64_t src = copy->tile_offset + (uint64_t)p * copy->tile_plane +
+						     (uint64_t)r * copy->tile_row;
+				const uint64_t dst = copy->data_offset + (uint64_t)p * copy->data_plane +
+						     (uint64_t)r * copy->data_row;
+				ane_f16_to_f32_row((const uint16_t *)((const uint8_t *)tile + src),
+						   data + dst / sizeof(uint16_t), copy->size / sizeof(uint16_t));
 			}
 		}
 	}
-	return;
 }
-// clang-format on
 
 static inline void ___ane_tile_send(struct ane_nn *nn, void *from,
 				    const uint32_t idx)
 {
-	const struct ane_model *model = ane_model(nn);
-	const int bdx = src_bdx(nn, idx);
-	ane_tile(from, nn->chans[bdx].map, model->nchw[bdx][0],
-		 model->nchw[bdx][1], model->nchw[bdx][2], model->nchw[bdx][3],
-		 model->nchw[bdx][4], model->nchw[bdx][5]);
+	const struct ane_plan *plan = &ane_model(nn)->src_plans[idx];
+	ane_plan_send(plan, nn->chans[plan->bdx].map, from, nn->tile_flags);
 }
 
 static inline void ___ane_tile_read(struct ane_nn *nn, void *to,
 				    const uint32_t idx)
 {
-	const struct ane_model *model = ane_model(nn);
-	const int bdx = dst_bdx(nn, idx);
-	ane_untile(to, nn->chans[bdx].map, model->nchw[bdx][0],
-		   model->nchw[bdx][1], model->nchw[bdx][2], model->nchw[bdx][3],
-		   model->nchw[bdx][4], model->nchw[bdx][5]);
+	const struct ane_plan *plan = &ane_model(nn)->dst_plans[idx];
+	ane_plan_read(plan, nn->chans[plan->bdx].map, to);
 }
 
 void __ane_tile_send(struct ane_nn *nn, void *from, const uint32_t idx)
@@ -630,3 +1766,144 @@ void __ane_tile_read(struct ane_nn *nn, void *to, const uint32_t idx)
 	INDEX_CHECK(ane_dst_count(nn), idx, );
 	___ane_tile_read(nn, to, idx);
 }
+
+void __ane_tile_send_f32(struct ane_nn *nn, const float *from, const uint32_t idx)
+{
+	INDEX_CHECK(ane_src_count(nn), idx, );
+	const struct ane_plan *plan = &ane_model(nn)->src_plans[idx];
+	ane_plan_send_f32(plan, nn->chans[plan->bdx].map, from, nn->tile_flags);
+}
+
+void __ane_tile_read_f32(struct ane_nn *nn, float *to, const uint32_t idx)
+{
+	INDEX_CHECK(ane_dst_count(nn), idx, );
+	const struct ane_plan *plan = &ane_model(nn)->dst_plans[idx];
+	ane_plan_read_f32(plan, nn->chans[plan->bdx].map, to);
+}
+
+/* Channels hold their tensor at the layout nchw[bdx] describes */
+static int ane_chan_map(struct ane_nn *nn, const uint32_t bdx, struct ane_map *map)
+{
+	const uint64_t *nchw = ane_model(nn)->nchw[bdx];
+	const uint64_t P = nchw[4];
+	const uint64_t R = nchw[5];
+
+	if (!nn->chans[bdx].map || P % sizeof(uint16_t) || R % sizeof(uint16_t)) {
+		return -EINVAL;
+	}
+
+	map->data = (uint16_t *)nn->chans[bdx].map;
+	map->N = (uint32_t)nchw[0];
+	map->C = (uint32_t)nchw[1];
+	map->H = (uint32_t)nchw[2];
+	map->W = (uint32_t)nchw[3];
+	map->plane_stride = P / sizeof(uint16_t);
+	map->row_stride = R / sizeof(uint16_t);
+	map->batch_stride = map->C * map->plane_stride;
+	return 0;
+}
+
+int __ane_src_map(struct ane_nn *nn, const uint32_t idx, struct ane_map *map)
+{
+	INDEX_CHECK(ane_src_count(nn), idx, -EINVAL);
+	return ane_chan_map(nn, src_bdx(nn, idx), map);
+}
+
+int __ane_dst_map(struct ane_nn *nn, const uint32_t idx, struct ane_map *map)
+{
+	INDEX_CHECK(ane_dst_count(nn), idx, -EINVAL);
+	return ane_chan_map(nn, dst_bdx(nn, idx), map);
+}
+
+/* Pixels per block: a block of every channel stays in L1 while it is split */
+#define IMAGE_BLOCK  256
+#define IMAGE_MAX_C  4
+
+/*
+ * Splits n interleaved pixels into planar floats. Inlined with C a constant,
+ * the compiler turns the strided loads into vector shuffles.
+ */
+static inline __attribute__((always_inline)) void
+ane_image_split(const uint8_t *px, float (*rows)[IMAGE_BLOCK], const uint32_t n,
+		const uint32_t C, const float scale, const float bias)
+{
+	for (uint32_t i = 0; i < n; i++) {
+		for (uint32_t c = 0; c < C; c++) {
+			rows[c][i] = (float)px[(uint64_t)i * C + c] * scale + bias;
+		}
+	}
+}
+
+static void ane_image_split_any(const uint8_t *px, float (*rows)[IMAGE_BLOCK], const uint32_t n,
+				const uint32_t C, const float scale, const float bias)
+{
+	switch (C) {
+	case 1:
+		ane_image_split(px, rows, n, 1, scale, bias);
+		break;
+	case 3:
+		ane_image_split(px, rows, n, 3, scale, bias);
+		break;
+	case 4:
+		ane_image_split(px, rows, n, 4, scale, bias);
+		break;
+	default:
+		ane_image_split(px, rows, n, C, scale, bias);
+		break;
+	}
+}
+
+/*
+ * A block of pixels is split into a float row per channel, normalized on the
+ * way, and each row converted straight into its plane: the image is read once
+ * and every channel byte written once.
+ */
+int __ane_send_image(struct ane_nn *nn, const uint32_t idx, const uint8_t *hwc,
+		     const uint32_t H, const uint32_t W, const uint32_t C,
+		     const float scale, const float bias)
+{
+	struct ane_map map;
+	float rows[IMAGE_MAX_C][IMAGE_BLOCK];
+
+	int err = __ane_src_map(nn, idx, &map);
+	if (err < 0) {
+		return err;
+	}
+	if (C > IMAGE_MAX_C) {
+		ane_err("images have at most %u channels, not %u\n", IMAGE_MAX_C, C);
+		return -EINVAL;
+	}
+	if (map.N != 1 || map.C != C || map.H != H || map.W != W) {
+		ane_err("image is %ux%ux%u but input %u is %ux%ux%ux%u\n", H, W, C, idx,
+			map.N, map.C, map.H, map.W);
+		return -EINVAL;
+	}
+
+	const int pad = !(nn->tile_flags & ANE_TILE_NO_PAD);
+	for (uint32_t h = 0; h < H; h++) {
+		const uint8_t *src = hwc + (uint64_t)h * W * C;
+		for (uint32_t w = 0; w < W; w += IMAGE_BLOCK) {
+			const uint32_t n = W - w < IMAGE_BLOCK ? W - w : IMAGE_BLOCK;
+			ane_image_split_any(src + (uint64_t)w * C, rows, n, C, scale, bias);
+			for (uint32_t c = 0; c < C; c++) {
+				ane_f32_to_f16_row(rows[c], ane_map_at(&map, 0, c, h, w), n);
+			}
+		}
+
+		if (pad && map.row_stride > W) {
+			for (uint32_t c = 0; c < C; c++) {
+				memset(ane_map_at(&map, 0, c, h, W), 0,
+				       (map.row_stride - W) * sizeof(uint16_t));
+			}
+		}
+	}
+
+	if (pad && map.plane_stride > H * map.row_stride) {
+		for (uint32_t c = 0; c < C; c++) {
+			memset(ane_map_at(&map, 0, c, H, 0), 0,
+			       (map.plane_stride - H * map.row_stride) * sizeof(uint16_t));
+		}
+	}
+
+	return 0;
+}
@@ -48,9 +48,38 @@ extern "C" {
 #include <stdint.h>
 
 #define TILE_COUNT 0x61 // 0x20
+#define ANE_IO_COUNT 0x20
+#define ANE_PLAN_COPIES 4
+#define ANE_MAX_SLOTS 4
+#define ANE_MAX_BATCH 16 /* DRM_ANE_MAX_BATCH, checked in ane.c */
 
 struct hwx_file;
 
+/*
+ * One strided copy between a dense NCHW buffer and a tile channel: planes
+ * times rows runs of size bytes. Offsets and strides are in bytes.
+ */
+struct ane_copy {
+	uint32_t size;
+	uint32_t rows;
+	uint32_t planes;
+	uint32_t data_offset;
+	uint32_t data_row;
+	uint32_t data_plane;
+	uint32_t tile_offset;
+	uint32_t tile_row;
+	uint32_t tile_plane;
+};
+
+/* Transfer plan of one input or output, resolved once at init */
+struct ane_plan {
+	uint32_t bdx; /* tile channel the tensor lives in */
+	uint32_t copy_count;
+	uint64_t size; /* bytes of the dense tensor */
+	uint64_t clear; /* channel bytes zeroed before a send; 0 if all are copied */
+	struct ane_copy copies[ANE_PLAN_COPIES];
+};
+
 struct ane_model {
 	uint64_t size;
 	uint32_t td_size;
@@ -61,45 +90,323 @@ struct ane_model {
 	uint32_t dst_count;
 	uint32_t tiles[TILE_COUNT];
 	uint64_t nchw[TILE_COUNT][6];
-	struct hwx_file *hwx;
+	struct ane_plan src_plans[ANE_IO_COUNT];
+	struct ane_plan dst_plans[ANE_IO_COUNT];
+	const void *btsp; /* bootstrap TD blob copied into btsp_chan */
+	uint64_t btsp_size;
+	struct hwx_file *hwx; /* set when parsed from HWX */
+	void *cache; /* cache entry when loaded warm */
+	uint64_t cache_size;
 };
 
+/*
+ * A bo, or a range of one: channels are carved out of a parent bo, and share
+ * its handle and mapping.
+ */
 struct ane_bo {
 	void *map; /* mmap-ed CPU virtual address */
 	uint64_t size; /* size of mmap region */
 	uint32_t handle; /* drm gem handle */
-	uint64_t offset; /* drm gem fake offset for mmap */
+	uint64_t mmap_offset; /* drm gem fake offset for mmap */
+	struct ane_bo *parent; /* bo this range lives in, or NULL */
+	uint64_t offset; /* byte offset into parent */
 };
 
+struct ane_backend;
+struct ane_shared;
+
 struct ane_nn {
 	int fd; /* file descriptor to accel node (index dev_id) */
 	struct ane_model model; /* ane model metadata */
+	struct ane_bo arena; /* one bo holding every channel below */
 	struct ane_bo chans[TILE_COUNT]; /* mmap-ed tile channels */
 	struct ane_bo btsp_chan; /* mmap-ed bootstrap channel */
+	uint32_t slot_count; /* copies of the I/O channels in the arena */
+	uint32_t slot; /* copy chans[] of I/O channels point at */
+	uint64_t slot_size; /* arena bytes between two copies */
+	const struct ane_backend *backend; /* device ops */
+	void *priv; /* backend state */
+	struct ane_shared *shared; /* state shared with clones, or NULL */
+	uint32_t tile_flags; /* ANE_TILE_* for ane_tile_send() */
 };
 
 /* #define LIBANE_CONFIG_NO_ERR */
 /* #define LIBANE_CONFIG_NO_INDEX_CHECK */
 /* #define LIBANE_CONFIG_NO_STATIC_ASSERT */
+/* #define LIBANE_CONFIG_DRM_SUBMIT */
 
 #define LIBANE_ASSERT_TILE_INDEX(idx) \
 	do {                              \
 	} while (0)
 
+/*
+ * An ANE of this machine. Devices are enumerated once per process, on first
+ * use, and models opened on the same device share one fd. chip_id is an enum
+ * drm_ane_id.
+ */
+#define ANE_NODE_LEN 30
+
+struct ane_device {
+	int dev_id;
+	uint32_t chip_id;
+	char node[ANE_NODE_LEN]; /* accel node */
+};
+
+int ane_device_count(void);
+/* NULL if there is no device dev_id */
+const struct ane_device *ane_device_get(int dev_id);
+struct ane_nn *ane_init_on(const struct ane_device *device, const char *path);
+
 struct ane_nn *__ane_init(const char *path, int dev_id);
 static inline struct ane_nn *ane_init(const char *path)
 {
 	return __ane_init(path, 0);
 }
 
+/*
+ * Loads count models on up to threads workers, one per CPU if threads <= 0.
+ * nns[i] receives the model for paths[i], or NULL if it failed to load.
+ * Returns the number of models loaded, or -ENODEV if there is no device.
+ */
+int __ane_init_many(const char *const *paths, uint32_t count,
+		    struct ane_nn **nns, int threads, int dev_id);
+static inline int ane_init_many(const char *const *paths, uint32_t count,
+				struct ane_nn **nns, int threads)
+{
+	return __ane_init_many(paths, count, nns, threads, 0);
+}
+
+/* data must stay valid until ane_free() */
+struct ane_nn *__ane_init_memory(const void *data, uint64_t size, int dev_id);
+static inline struct ane_nn *ane_init_memory(const void *data, uint64_t size)
+{
+	return __ane_init_memory(data, size, 0);
+}
+
+/* fd is not consumed and may be closed once this returns */
+struct ane_nn *__ane_init_fd(int fd, int dev_id);
+static inline struct ane_nn *ane_init_fd(int fd)
+{
+	return __ane_init_fd(fd, 0);
+}
+
+/*
+ * Reads a model from a pipe, socket or other non-seekable fd; the fd is not
+ * consumed. Only the load commands are buffered and the bootstrap TD is read
+ * straight into its channel, so the fd is left just past it.
+ */
+struct ane_nn *__ane_init_stream(int fd, int dev_id);
+static inline struct ane_nn *ane_init_stream(int fd)
+{
+	return __ane_init_stream(fd, 0);
+}
+
+/*
+ * Resolves model metadata from an HWX image without opening a device, through
+ * the model cache when enabled. data must stay valid until ane_model_unload().
+ */
+int ane_model_load(struct ane_model *model, const void *data, uint64_t size);
+void ane_model_unload(struct ane_model *model);
+
+/*
+ * Precompiled model cache, keyed by a hash of the HWX header and load
+ * commands and checked against the bootstrap TD, so TDs edited in place miss.
+ * Disabled unless a directory is set here or in $LIBANE_CACHE_DIR; NULL
+ * disables it. Not thread-safe; set it before loading models.
+ */
+struct ane_cache_stats {
+	uint64_t hits;
+	uint64_t misses;
+};
+
+int ane_cache_set_dir(const char *dir);
+void ane_cache_get_stats(struct ane_cache_stats *stats);
+void ane_cache_reset_stats(void);
+
+/*
+ * Another instance of the model of nn on the same device. The bootstrap
+ * channel, the tile channels that are neither inputs nor outputs and the
+ * parsed model are shared with nn and every other clone; only the input and
+ * output channels are allocated, so a clone costs its activations. libane
+ * never uploads the TSK or the weights, so there is no copy of either to
+ * share. Instances are freed in any order. An nn keeps its slot count while
+ * clones of it are alive.
+ */
+struct ane_nn *ane_nn_clone(struct ane_nn *nn);
+
 void __ane_free(struct ane_nn *nn);
 static inline void ane_free(struct ane_nn *nn)
 {
 	__ane_free(nn);
 }
 
+/*
+ * Runs a request and waits for it. -EINTR means a signal cut the wait short
+ * after the request was queued; it still runs, so do not simply retry.
+ */
 int ane_exec(struct ane_nn *nn);
 
+/*
+ * Completion of an ane_exec_async() request. fd polls readable once the
+ * request retires, so it can sit in a poll()/epoll set next to other fds.
+ */
+struct ane_fence {
+	int fd;
+};
+
+/*
+ * Queues a request and returns without waiting for it. Channels of nn must
+ * not be touched until its fence has signaled; fence must be closed with
+ * ane_fence_close() either way.
+ *
+ * On the DRM backend, requests are not sent to the engine yet unless libane is
+ * built with LIBANE_CONFIG_DRM_SUBMIT: every ane_exec*() retires at once
+ * without running and its fence is signaled.
+ */
+int ane_exec_async(struct ane_nn *nn, struct ane_fence *fence);
+
+/*
+ * Waits up to timeout_ms, or forever if negative. Returns 0 once the request
+ * retired, -ETIMEDOUT if it has not, or the error the request failed with.
+ */
+int ane_fence_wait(struct ane_fence *fence, int timeout_ms);
+void ane_fence_close(struct ane_fence *fence);
+
+/*
+ * Multi-buffering. Input and output channels get count copies ("slots") in
+ * the arena, so the next request can be staged while earlier ones run; other
+ * channels stay shared. Slot 0 keeps its contents, the others start zeroed.
+ * No request may be in flight. ane_select_slot() points ane_send(), ane_read(),
+ * their tile and map variants and ane_exec() at a slot. Fails with -EBUSY
+ * while clones of nn are alive.
+ */
+int ane_set_slots(struct ane_nn *nn, uint32_t count);
+int ane_select_slot(struct ane_nn *nn, uint32_t slot);
+
+/*
+ * Tiled sends zero the row and plane padding around the data they write.
+ * With ANE_TILE_NO_PAD they leave it as it is, for models known never to read
+ * it. Per instance; clones start without flags.
+ */
+#define ANE_TILE_NO_PAD (1u << 0)
+int ane_set_tile_flags(struct ane_nn *nn, uint32_t flags);
+
+/* ane_exec() and ane_exec_async() on the channels of slot */
+int ane_exec_slot(struct ane_nn *nn, uint32_t slot);
+int ane_exec_slot_async(struct ane_nn *nn, uint32_t slot, struct ane_fence *fence);
+
+/*
+ * Runs the selected slot of each of count models, in order, as one submission:
+ * one trip into the driver and one power-up of the engine for all of them.
+ * The models must be on the same device (-EXDEV) and count at most
+ * ANE_MAX_BATCH. Nothing runs if any request is rejected; otherwise the batch
+ * stops at the first request that fails and returns its error.
+ */
+int ane_exec_batch(struct ane_nn *const *nns, uint32_t count);
+/* Queues the batch like ane_exec_async(); fence covers every request */
+int ane_exec_batch_async(struct ane_nn *const *nns, uint32_t count,
+			 struct ane_fence *fence);
+
+/*
+ * Thread-safe inference. An executor owns models, each with a pool of
+ * instances (the nn and ane_nn_clone()s of it), and a pool of worker threads.
+ * Requests are submitted from any thread through a lock-free queue; a worker
+ * takes an idle instance of the model, sends the inputs, runs it and reads the
+ * outputs, so instances of a model and different models run concurrently.
+ */
+struct ane_executor;
+
+struct ane_infer {
+	uint32_t model; /* from ane_executor_add() */
+	void *const *inputs; /* dense fp16 tensors, as for ane_tile_send() */
+	void *const *outputs; /* as for ane_tile_read() */
+	/* Called on a worker once done; infer is not waited on then */
+	void (*done)(struct ane_infer *infer, void *arg);
+	void *arg;
+	/* Set once done */
+	int status;
+	uint64_t queue_ns; /* from submission until a worker took it */
+	uint64_t latency_ns; /* from submission until done */
+	/* Private */
+	uint32_t state;
+	uint64_t submit_ns;
+};
+
+/* threads <= 0 starts one worker per CPU; depth 0 queues up to 256 requests */
+struct ane_executor *ane_executor_create(int threads, uint32_t depth);
+/*
+ * Takes over nn and runs it on instances instances, nn and clones of it.
+ * Returns the model index, or a negative errno with nn left to the caller.
+ * Not concurrently with other calls on the executor.
+ */
+int ane_executor_add(struct ane_executor *ex, struct ane_nn *nn, uint32_t instances);
+/*
+ * Queues infer, which must stay valid until done. -EAGAIN when the queue is
+ * full, -EINVAL for an unknown model.
+ */
+int ane_executor_submit(struct ane_executor *ex, struct ane_infer *infer);
+/* Waits for infer and returns its status */
+int ane_executor_wait(struct ane_infer *infer);
+/* Finishes every queued request, then frees the models */
+void ane_executor_destroy(struct ane_executor *ex);
+
+/*
+ * Device backend of models initialized after the call. Defaults to the DRM
+ * device, or to $LIBANE_BACKEND ("drm" or "mock") when set. The mock backend
+ * needs no ANE and completes requests without running them.
+ * Not thread-safe; set it before loading models.
+ */
+enum ane_backend_id {
+	ANE_BACKEND_DRM = 0,
+	ANE_BACKEND_MOCK = 1,
+};
+
+int ane_set_backend(enum ane_backend_id id);
+
+/*
+ * Mock backend settings, picked up by models initialized after the call; NULL
+ * restores the defaults. Every request takes latency_us on a device thread,
+ * queued behind earlier ones; $LIBANE_MOCK_LATENCY_US sets it when no config
+ * was given. Each submission first costs overhead_us, once per batch. run, if
+ * set, stands in for the hardware: it is called on the device thread before
+ * the request retires and may read the inputs and write the outputs of nn.
+ */
+typedef void (*ane_mock_run_fn)(struct ane_nn *nn, void *arg);
+
+struct ane_mock_config {
+	uint32_t latency_us;
+	ane_mock_run_fn run;
+	void *arg;
+	uint32_t overhead_us;
+};
+
+void ane_mock_set_config(const struct ane_mock_config *config);
+
+/* Last request submitted on a mock nn */
+struct ane_mock_request {
+	uint64_t seqno; /* 1 for the first request of nn */
+	uint64_t tsk_size;
+	uint32_t td_count;
+	uint32_t td_size;
+	uint32_t chan_count; /* tile channels with a bo */
+	uint32_t btsp_handle;
+	uint64_t btsp_offset;
+};
+
+/* Fails with -EINVAL if nn is not on the mock backend, -ENOENT before any */
+int ane_mock_last_request(struct ane_nn *nn, struct ane_mock_request *request);
+
+/* Totals over every mock device */
+struct ane_mock_stats {
+	uint64_t submitted; /* requests */
+	uint64_t retired;
+	uint64_t bo_allocs;
+	uint64_t submissions; /* a batch counts once */
+};
+
+void ane_mock_get_stats(struct ane_mock_stats *stats);
+void ane_mock_reset_stats(void);
+
 #define ane_model(nn)	  (&(nn)->model)
 #define ane_src_count(nn) (ane_model(nn)->src_count)
 #define ane_dst_count(nn) (ane_model(nn)->dst_count)
@@ -132,6 +439,65 @@ static inline void ane_read(struct ane_nn *nn, void *to, const uint32_t idx)
 	__ane_read(nn, to, idx);
 }
 
+/*
+ * In-place view of an input or output channel. Element (n, c, h, w) is the
+ * fp16 at data[n * batch_stride + c * plane_stride + h * row_stride + w];
+ * strides count elements. Inputs written through a view skip ane_tile_send(),
+ * outputs read through one skip ane_tile_read(). Only elements may be written:
+ * the padding between rows and planes stays zero, as the engine expects.
+ */
+struct ane_map {
+	uint16_t *data;
+	uint32_t N;
+	uint32_t C;
+	uint32_t H;
+	uint32_t W;
+	uint64_t batch_stride;
+	uint64_t plane_stride;
+	uint64_t row_stride;
+};
+
+static inline uint16_t *ane_map_at(const struct ane_map *map, const uint32_t n,
+				   const uint32_t c, const uint32_t h,
+				   const uint32_t w)
+{
+	return map->data + n * map->batch_stride + c * map->plane_stride +
+	       h * map->row_stride + w;
+}
+
+int __ane_src_map(struct ane_nn *nn, const uint32_t idx, struct ane_map *map);
+int __ane_dst_map(struct ane_nn *nn, const uint32_t idx, struct ane_map *map);
+static inline int ane_src_map(struct ane_nn *nn, const uint32_t idx,
+			      struct ane_map *map)
+{
+	LIBANE_ASSERT_TILE_INDEX(idx);
+	return __ane_src_map(nn, idx, map);
+}
+
+static inline int ane_dst_map(struct ane_nn *nn, const uint32_t idx,
+			      struct ane_map *map)
+{
+	LIBANE_ASSERT_TILE_INDEX(idx);
+	return __ane_dst_map(nn, idx, map);
+}
+
+/*
+ * Sends an 8-bit H x W x C interleaved image to an input of shape 1 x C x H x
+ * W, as fp16 of pixel * scale + bias: scale 2/255 and bias -1 map [0, 255] to
+ * [-1, 1]. Up to 4 channels; -EINVAL if the shapes differ.
+ */
+int __ane_send_image(struct ane_nn *nn, const uint32_t idx, const uint8_t *hwc,
+		     const uint32_t H, const uint32_t W, const uint32_t C,
+		     const float scale, const float bias);
+static inline int ane_send_image(struct ane_nn *nn, const uint32_t idx,
+				 const uint8_t *hwc, const uint32_t H,
+				 const uint32_t W, const uint32_t C,
+				 const float scale, const float bias)
+{
+	LIBANE_ASSERT_TILE_INDEX(idx);
+	return __ane_send_image(nn, idx, hwc, H, W, C, scale, bias);
+}
+
 void __ane_tile_send(struct ane_nn *nn, void *from, const uint32_t idx);
 void __ane_tile_read(struct ane_nn *nn, void *to, const uint32_t idx);
 static inline void ane_tile_send(struct ane_nn *nn, void *from,
@@ -147,13 +513,59 @@ static inline void ane_tile_read(struct ane_nn *nn, void *to, const uint32_t idx
 	__ane_tile_read(nn, to, idx);
 }
 
+/*
+ * ane_tile_send() and ane_tile_read() of dense fp32 tensors, converting to and
+ * from fp16 on the way in one pass.
+ */
+void __ane_tile_send_f32(struct ane_nn *nn, const float *from, const uint32_t idx);
+void __ane_tile_read_f32(struct ane_nn *nn, float *to, const uint32_t idx);
+static inline void ane_tile_send_f32(struct ane_nn *nn, const float *from,
+				     const uint32_t idx)
+{
+	LIBANE_ASSERT_TILE_INDEX(idx);
+	__ane_tile_send_f32(nn, from, idx);
+}
+
+static inline void ane_tile_read_f32(struct ane_nn *nn, float *to, const uint32_t idx)
+{
+	LIBANE_ASSERT_TILE_INDEX(idx);
+	__ane_tile_read_f32(nn, to, idx);
+}
+
+/*
+ * Dense N x C x H x W fp16 to and from channels of planes P bytes apart with
+ * rows R bytes apart. Every byte is written once: ane_tile() zeroes only the
+ * row and plane padding, or none of it with ANE_TILE_NO_PAD in
+ * ane_tile_flags().
+ */
 void ane_tile(void *data, void *tile, const uint64_t N, const uint64_t C,
 	      const uint64_t H, const uint64_t W, const uint64_t P,
 	      const uint64_t R);
+void ane_tile_flags(void *data, void *tile, const uint64_t N, const uint64_t C,
+		    const uint64_t H, const uint64_t W, const uint64_t P,
+		    const uint64_t R, const uint32_t flags);
 void ane_untile(void *data, void *tile, const uint64_t N, const uint64_t C,
 		const uint64_t H, const uint64_t W, const uint64_t P,
 		const uint64_t R);
 
+/*
+ * ane_tile() and ane_untile() split across an internal pool of threads, in
+ * chunks of whole rows. Tensors under ANE_TILE_MT_MIN bytes of tile take the
+ * serial path, where waking threads costs more than it saves.
+ */
+#define ANE_TILE_MT_MIN (1 << 20)
+void ane_tile_mt(void *data, void *tile, const uint64_t N, const uint64_t C,
+		 const uint64_t H, const uint64_t W, const uint64_t P,
+		 const uint64_t R);
+void ane_tile_mt_flags(void *data, void *tile, const uint64_t N, const uint64_t C,
+		       const uint64_t H, const uint64_t W, const uint64_t P,
+		       const uint64_t R, const uint32_t flags);
+void ane_untile_mt(void *data, void *tile, const uint64_t N, const uint64_t C,
+		   const uint64_t H, const uint64_t W, const uint64_t P,
+		   const uint64_t R);
+/* Threads ane_tile_mt() uses, the caller's included; 0 for one per CPU */
+int ane_tile_set_threads(int threads);
+
 #if defined(__cplusplus)
 }
 #endif
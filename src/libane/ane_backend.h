@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef ANE_BACKEND_H_
+#define ANE_BACKEND_H_
+
+#include <stdint.h>
+
+#include "ane.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct drm_ane_submit;
+
+/*
+ * Device operations behind an ane_nn. Errors are negative errno values. The
+ * DRM backend talks to /dev/accel; the mock backend stands in for it on
+ * machines without an ANE.
+ */
+struct ane_backend {
+	const char *name;
+	/* Device dev_id from the cached enumeration, or NULL */
+	const struct ane_device *(*device)(int dev_id);
+	/* node is NULL unless taken from device() */
+	int (*open)(struct ane_nn *nn, int dev_id, const char *node);
+	void (*close)(struct ane_nn *nn);
+	/* Opens nn on the device from is open on, sharing its bo handles */
+	int (*attach)(struct ane_nn *nn, const struct ane_nn *from);
+	/* Allocates and maps bo->size bytes */
+	int (*bo_init)(struct ane_nn *nn, struct ane_bo *bo);
+	void (*bo_free)(struct ane_nn *nn, struct ane_bo *bo);
+	/*
+	 * Blocks until the request retires if fence_fd is NULL. Otherwise
+	 * returns once it is queued, with an fd in fence_fd that polls readable
+	 * when it retires.
+	 */
+	int (*submit)(struct ane_nn *nn, const struct drm_ane_submit *args,
+		      int *fence_fd);
+	/*
+	 * Like submit, for count requests of nns that run back to back under
+	 * one fence. Nothing is queued if any request is invalid. -EXDEV if
+	 * the nns are not all on the same device.
+	 */
+	int (*submit_batch)(struct ane_nn *const *nns, const struct drm_ane_submit *args,
+			    uint32_t count, int *fence_fd);
+};
+
+extern const struct ane_backend ane_drm_backend;
+extern const struct ane_backend ane_mock_backend;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ANE_BACKEND_H_
@@ -0,0 +1,401 @@
+// SPDX-License-Identifier: MIT
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ane.h"
+#include "ane_cache.h"
+#include "ane_tile.h"
+#include "hwx.h"
+
+#define ANE_CACHE_DIR_ENV "LIBANE_CACHE_DIR"
+
+static char cache_dir[PATH_MAX];
+static int cache_dir_set;
+
+static atomic_uint_fast64_t cache_hits;
+static atomic_uint_fast64_t cache_misses;
+static atomic_uint cache_tmp_seq;
+
+int ane_cache_set_dir(const char *dir)
+{
+	if (!dir) {
+		cache_dir[0] = '\0';
+		cache_dir_set = 1;
+		return 0;
+	}
+
+	const size_t len = strlen(dir);
+	if (len == 0 || len >= sizeof(cache_dir)) {
+		return -EINVAL;
+	}
+
+	memcpy(cache_dir, dir, len + 1);
+	cache_dir_set = 1;
+	return 0;
+}
+
+static const char *ane_cache_dir(void)
+{
+	if (cache_dir_set) {
+		return cache_dir[0] ? cache_dir : NULL;
+	}
+
+	const char *dir = getenv(ANE_CACHE_DIR_ENV);
+	return (dir && dir[0]) ? dir : NULL;
+}
+
+int ane_cache_enabled(void)
+{
+	return ane_cache_dir() != NULL;
+}
+
+void ane_cache_get_stats(struct ane_cache_stats *stats)
+{
+	stats->hits = atomic_load(&cache_hits);
+	stats->misses = atomic_load(&cache_misses);
+}
+
+void ane_cache_reset_stats(void)
+{
+	atomic_store(&cache_hits, 0);
+	atomic_store(&cache_misses, 0);
+}
+
+static uint64_t ane_cache_hash(const void *data, uint64_t size)
+{
+	struct hwx_fingerprint fingerprint;
+	hwx_fingerprint(data, (size_t)size, &fingerprint);
+	return fingerprint.lo;
+}
+
+/*
+ * A resolved model only depends on the load commands and the TSK, and of the
+ * TSK only on the bootstrap TD the entry keeps a copy of. The key covers the
+ * header and load commands, which place and size every section; lookups then
+ * compare the copy with the image, so TDs tuned in place (ane-opt) miss. The
+ * rest of the TSK and the weights are never read, however large.
+ */
+int ane_cache_key(const void *data, uint64_t size, uint64_t *key)
+{
+	struct MachHeader64 header;
+	if (!data || size < sizeof(header)) {
+		return -EINVAL;
+	}
+
+	memcpy(&header, data, sizeof(header));
+	if (header.magic != HWX_MACHO_MAGIC_64 ||
+	    header.sizeofcmds > size - sizeof(header)) {
+		return -EINVAL;
+	}
+
+	*key = ane_cache_hash(data, sizeof(header) + header.sizeofcmds) ^ size;
+	return 0;
+}
+
+static int ane_cache_path(char *path, size_t len, const char *dir, uint64_t key)
+{
+	int n = snprintf(path, len, "%s/%016" PRIx64 ".anecache", dir, key);
+	if (n < 0 || (size_t)n >= len) {
+		return -ENAMETOOLONG;
+	}
+	return 0;
+}
+
+/*
+ * Entries are trusted no more than the HWX they replace: every copy in a plan
+ * must stay inside its channel and the caller's buffer, and every shape must
+ * pass the checks ane_plan_init() makes, or sends and maps run off the end.
+ */
+static int ane_cache_copy_fits(uint32_t offset, uint32_t planes, uint32_t plane,
+			       uint32_t rows, uint32_t row, uint32_t size, uint64_t limit)
+{
+	const uint64_t plane_end = (uint64_t)(planes - 1) * plane;
+	const uint64_t row_end = (uint64_t)(rows - 1) * row;
+
+	if (!planes || !rows || plane_end > limit || row_end > limit) {
+		return 0;
+	}
+	return (uint64_t)offset + plane_end + row_end + size <= limit;
+}
+
+static int ane_cache_shape_valid(const uint64_t *nchw, uint64_t tile_size)
+{
+	const uint64_t N = nchw[0], C = nchw[1], H = nchw[2];
+	const uint64_t W = nchw[3], P = nchw[4], R = nchw[5];
+
+	for (int i = 0; i < 6; i++) {
+		if (!nchw[i] || nchw[i] > UINT32_MAX) {
+			return 0;
+		}
+	}
+	return R >= W * sizeof(uint16_t) && P >= (H - 1) * R + W * sizeof(uint16_t) &&
+	       N * C <= tile_size / P;
+}
+
+static int ane_cache_plans_valid(const struct ane_cache_header *header,
+				 const struct ane_plan *plans, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; i++) {
+		const struct ane_plan *plan = &plans[i];
+		if (plan->bdx >= TILE_COUNT || plan->copy_count > ANE_PLAN_COPIES) {
+			return 0;
+		}
+
+		const uint64_t tile_size = tile_shift(header->tiles[plan->bdx]);
+		if (!tile_size || tile_size > UINT32_MAX || plan->size > tile_size ||
+		    plan->clear > tile_size ||
+		    !ane_cache_shape_valid(header->nchw[plan->bdx], tile_size)) {
+			return 0;
+		}
+
+		for (uint32_t j = 0; j < plan->copy_count; j++) {
+			const struct ane_copy *copy = &plan->copies[j];
+			if (!ane_cache_copy_fits(copy->tile_offset, copy->planes, copy->tile_plane,
+						 copy->rows, copy->tile_row, copy->size, tile_size) ||
+			    !ane_cache_copy_fits(copy->data_offset, copy->planes, copy->data_plane,
+						 copy->rows, copy->data_row, copy->size, plan->size)) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+static int ane_cache_valid(const struct ane_cache_header *header, uint64_t map_size,
+			   uint64_t key, const void *data, uint64_t size)
+{
+	if (header->magic != ANE_CACHE_MAGIC || header->version != ANE_CACHE_VERSION) {
+		return 0;
+	}
+
+	if (header->key != key || header->hwx_size != size) {
+		return 0;
+	}
+
+	if (header->src_count > ANE_IO_COUNT || header->dst_count > ANE_IO_COUNT ||
+	    !header->td_size) {
+		return 0;
+	}
+
+	if (!ane_cache_plans_valid(header, header->src_plans, header->src_count) ||
+	    !ane_cache_plans_valid(header, header->dst_plans, header->dst_count)) {
+		return 0;
+	}
+
+	if (header->btsp_offset < sizeof(*header) || header->btsp_offset > map_size ||
+	    header->btsp_size > map_size - header->btsp_offset) {
+		return 0;
+	}
+
+	if (header->tsk_offset > size || header->tsk_size > size - header->tsk_offset ||
+	    header->btsp_size > header->tsk_size) {
+		return 0;
+	}
+
+	return memcmp((const uint8_t *)header + header->btsp_offset,
+		      (const uint8_t *)data + header->tsk_offset, header->btsp_size) == 0;
+}
+
+static int ane_cache_read(int fd, void *data, uint64_t size)
+{
+	uint8_t *p = (uint8_t *)data;
+	while (size > 0) {
+		ssize_t n = read(fd, p, size);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -EIO;
+		}
+		p += n;
+		size -= (uint64_t)n;
+	}
+	return 0;
+}
+
+/*
+ * Entries are a few pages, so reading one costs less than mapping and
+ * unmapping it on every load.
+ */
+static int ane_cache_map(const char *path, uint64_t key, const void *data,
+			 uint64_t size, struct ane_cache_entry *entry)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -ENOENT;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct ane_cache_header)) {
+		close(fd);
+		return -ENOENT;
+	}
+
+	void *map = aligned_alloc(ANE_CACHE_ALIGN, ((uint64_t)st.st_size + ANE_CACHE_ALIGN - 1) &
+							   ~(uint64_t)(ANE_CACHE_ALIGN - 1));
+	if (!map || ane_cache_read(fd, map, (uint64_t)st.st_size) < 0 ||
+	    !ane_cache_valid((const struct ane_cache_header *)map, (uint64_t)st.st_size,
+			     key, data, size)) {
+		free(map);
+		close(fd);
+		return -ENOENT;
+	}
+	close(fd);
+
+	entry->map = map;
+	entry->size = (uint64_t)st.st_size;
+	return 0;
+}
+
+int ane_cache_lookup(uint64_t key, const void *data, uint64_t size,
+		     struct ane_cache_entry *entry)
+{
+	entry->map = NULL;
+	entry->size = 0;
+
+	const char *dir = ane_cache_dir();
+	if (!dir) {
+		return -ENOENT;
+	}
+
+	char path[PATH_MAX];
+	if (ane_cache_path(path, sizeof(path), dir, key) < 0 ||
+	    ane_cache_map(path, key, data, size, entry) < 0) {
+		atomic_fetch_add(&cache_misses, 1);
+		return -ENOENT;
+	}
+
+	atomic_fetch_add(&cache_hits, 1);
+	return 0;
+}
+
+void ane_cache_release(struct ane_cache_entry *entry)
+{
+	free(entry->map);
+	entry->map = NULL;
+	entry->size = 0;
+}
+
+void ane_cache_entry_model(const struct ane_cache_entry *entry, struct ane_model *model)
+{
+	const struct ane_cache_header *header = (const struct ane_cache_header *)entry->map;
+
+	memset(model, 0, sizeof(*model));
+	model->size = header->size;
+	model->td_size = header->td_size;
+	model->td_count = header->td_count;
+	model->tsk_size = header->tsk_size;
+	model->krn_size = header->krn_size;
+	model->src_count = header->src_count;
+	model->dst_count = header->dst_count;
+	memcpy(model->tiles, header->tiles, sizeof(model->tiles));
+	memcpy(model->nchw, header->nchw, sizeof(model->nchw));
+	memcpy(model->src_plans, header->src_plans, sizeof(model->src_plans));
+	memcpy(model->dst_plans, header->dst_plans, sizeof(model->dst_plans));
+	model->btsp = (const uint8_t *)entry->map + header->btsp_offset;
+	model->btsp_size = header->btsp_size;
+}
+
+static int ane_cache_write(int fd, const void *data, uint64_t size)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	while (size > 0) {
+		ssize_t n = write(fd, p, size);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		p += n;
+		size -= (uint64_t)n;
+	}
+	return 0;
+}
+
+int ane_cache_store(uint64_t key, uint64_t size, const struct ane_model *model)
+{
+	const char *dir = ane_cache_dir();
+	if (!dir) {
+		return -ENOENT;
+	}
+
+	const struct hwx_section *tsk = hwx_get_tsk_section(model->hwx);
+	if (!tsk || (!model->btsp && model->btsp_size)) {
+		return -EINVAL;
+	}
+
+	struct ane_cache_header header;
+	memset(&header, 0, sizeof(header));
+	header.magic = ANE_CACHE_MAGIC;
+	header.version = ANE_CACHE_VERSION;
+	header.key = key;
+	header.hwx_size = size;
+	header.tsk_offset = tsk->offset;
+	header.size = model->size;
+	header.td_size = model->td_size;
+	header.td_count = model->td_count;
+	header.tsk_size = model->tsk_size;
+	header.krn_size = model->krn_size;
+	header.src_count = model->src_count;
+	header.dst_count = model->dst_count;
+	memcpy(header.tiles, model->tiles, sizeof(header.tiles));
+	memcpy(header.nchw, model->nchw, sizeof(header.nchw));
+	memcpy(header.src_plans, model->src_plans, sizeof(header.src_plans));
+	memcpy(header.dst_plans, model->dst_plans, sizeof(header.dst_plans));
+	header.btsp_offset = (sizeof(header) + ANE_CACHE_ALIGN - 1) & ~(uint64_t)(ANE_CACHE_ALIGN - 1);
+	header.btsp_size = model->btsp_size;
+
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	int err = ane_cache_path(path, sizeof(path), dir, key);
+	if (err < 0) {
+		return err;
+	}
+
+	int n = snprintf(tmp, sizeof(tmp), "%s.%ld.%u.tmp", path, (long)getpid(),
+			 atomic_fetch_add(&cache_tmp_seq, 1));
+	if (n < 0 || (size_t)n >= sizeof(tmp)) {
+		return -ENAMETOOLONG;
+	}
+
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		return -errno;
+	}
+
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return -errno;
+	}
+
+	static const uint8_t zeros[ANE_CACHE_ALIGN];
+	err = ane_cache_write(fd, &header, sizeof(header));
+	if (!err) {
+		err = ane_cache_write(fd, zeros, header.btsp_offset - sizeof(header));
+	}
+	if (!err && model->btsp_size) {
+		err = ane_cache_write(fd, model->btsp, model->btsp_size);
+	}
+	if (close(fd) != 0 && !err) {
+		err = -errno;
+	}
+
+	/* Readers only ever see a complete entry */
+	if (!err && rename(tmp, path) != 0) {
+		err = -errno;
+	}
+	if (err) {
+		unlink(tmp);
+	}
+
+	return err;
+}
@@ -0,0 +1,78 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef ANE_CACHE_H_
+#define ANE_CACHE_H_
+
+#include <stdint.h>
+
+#include "ane.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ANE_CACHE_MAGIC 0x43454E41u /* "ANEC" */
+#define ANE_CACHE_VERSION 4u
+#define ANE_CACHE_ALIGN 64u
+
+/*
+ * On-disk layout of a cache entry: this header followed by the bootstrap TD
+ * blob at btsp_offset. Entries are only ever read back on the host that wrote
+ * them, so fields are stored in native byte order.
+ */
+struct ane_cache_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key; /* ane_cache_key() of the HWX image */
+	uint64_t hwx_size;
+	uint64_t tsk_offset; /* TSK the model was resolved from, tsk_size long */
+	uint64_t size;
+	uint32_t td_size;
+	uint32_t td_count;
+	uint64_t tsk_size;
+	uint64_t krn_size;
+	uint32_t src_count;
+	uint32_t dst_count;
+	uint64_t nchw[TILE_COUNT][6];
+	uint32_t tiles[TILE_COUNT];
+	uint32_t reserved;
+	struct ane_plan src_plans[ANE_IO_COUNT];
+	struct ane_plan dst_plans[ANE_IO_COUNT];
+	uint64_t btsp_offset;
+	uint64_t btsp_size;
+};
+
+struct ane_cache_entry {
+	void *map; /* entry file, read into memory */
+	uint64_t size; /* size of the entry file */
+};
+
+/* Returns non-zero if a cache directory is configured */
+int ane_cache_enabled(void);
+
+/* Fails with -EINVAL if data is not an HWX image */
+int ane_cache_key(const void *data, uint64_t size, uint64_t *key);
+
+/*
+ * Reads the entry for key and checks it against the HWX image data. Counts a
+ * hit or a miss; returns -ENOENT on a miss, including stale or corrupt
+ * entries.
+ */
+int ane_cache_lookup(uint64_t key, const void *data, uint64_t size,
+		     struct ane_cache_entry *entry);
+void ane_cache_release(struct ane_cache_entry *entry);
+
+/* Fills model from entry; btsp points into the entry */
+void ane_cache_entry_model(const struct ane_cache_entry *entry, struct ane_model *model);
+
+/*
+ * Writes the entry for a model parsed from an HWX image of size bytes,
+ * atomically; concurrent writers of one key are harmless.
+ */
+int ane_cache_store(uint64_t key, uint64_t size, const struct ane_model *model);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ANE_CACHE_H_
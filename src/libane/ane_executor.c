@@ -0,0 +1,367 @@
+// SPDX-License-Identifier: MIT
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ane.h"
+
+#define EXECUTOR_MODELS	    32
+#define EXECUTOR_DEPTH	    256
+#define EXECUTOR_CACHE_LINE 64
+
+/*
+ * Bounded MPMC queue (Vyukov): every cell carries a sequence number telling
+ * producers and consumers whose turn it is, so both sides only ever CAS their
+ * own index. Pushing to a full queue and popping an empty one fail at once.
+ */
+struct mpmc_cell {
+	atomic_size_t seq;
+	void *data;
+};
+
+struct mpmc_queue {
+	struct mpmc_cell *cells;
+	size_t mask;
+	_Alignas(EXECUTOR_CACHE_LINE) atomic_size_t tail;
+	_Alignas(EXECUTOR_CACHE_LINE) atomic_size_t head;
+};
+
+static int mpmc_init(struct mpmc_queue *q, size_t depth)
+{
+	size_t size = 1;
+	while (size < depth) {
+		size <<= 1;
+	}
+
+	q->cells = calloc(size, sizeof(*q->cells));
+	if (!q->cells) {
+		return -ENOMEM;
+	}
+
+	for (size_t i = 0; i < size; i++) {
+		atomic_init(&q->cells[i].seq, i);
+	}
+	q->mask = size - 1;
+	atomic_init(&q->tail, 0);
+	atomic_init(&q->head, 0);
+	return 0;
+}
+
+static void mpmc_fini(struct mpmc_queue *q)
+{
+	free(q->cells);
+	q->cells = NULL;
+}
+
+static int mpmc_push(struct mpmc_queue *q, void *data)
+{
+	struct mpmc_cell *cell;
+	size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+	for (;;) {
+		cell = &q->cells[pos & q->mask];
+		size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+								  memory_order_relaxed,
+								  memory_order_relaxed)) {
+				break;
+			}
+		} else if (dif < 0) {
+			return -EAGAIN;
+		} else {
+			pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+		}
+	}
+
+	cell->data = data;
+	atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+	return 0;
+}
+
+static void *mpmc_pop(struct mpmc_queue *q)
+{
+	struct mpmc_cell *cell;
+	size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+	for (;;) {
+		cell = &q->cells[pos & q->mask];
+		size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+								  memory_order_relaxed,
+								  memory_order_relaxed)) {
+				break;
+			}
+		} else if (dif < 0) {
+			return NULL;
+		} else {
+			pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+		}
+	}
+
+	void *data = cell->data;
+	atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+	return data;
+}
+
+/*
+ * A semaphore counts what a queue holds, so that waiting is the only place a
+ * thread sleeps. A count can run ahead of a push that is still publishing its
+ * cell; poppers then retry.
+ */
+static void *mpmc_pop_wait(struct mpmc_queue *q, sem_t *sem, const atomic_int *stopping)
+{
+	while (sem_wait(sem) != 0) {
+	}
+
+	for (;;) {
+		void *data = mpmc_pop(q);
+		if (data || (stopping && atomic_load(stopping))) {
+			return data;
+		}
+		sched_yield();
+	}
+}
+
+/* Instances of a model, idle ones waiting in pool */
+struct executor_model {
+	struct ane_nn **instances;
+	uint32_t count;
+	struct mpmc_queue pool;
+	sem_t idle;
+};
+
+struct ane_executor {
+	struct mpmc_queue queue;
+	sem_t queued;
+	atomic_int stopping;
+	struct executor_model models[EXECUTOR_MODELS];
+	atomic_uint model_count;
+	pthread_t *workers;
+	int worker_count;
+};
+
+static uint64_t executor_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void executor_complete(struct ane_infer *infer)
+{
+	/* With a callback, infer belongs to it from here on */
+	if (infer->done) {
+		infer->done(infer, infer->arg);
+		return;
+	}
+
+	__atomic_store_n(&infer->state, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &infer->state, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static void executor_run(struct ane_executor *ex, struct ane_infer *infer)
+{
+	struct executor_model *model = &ex->models[infer->model];
+	infer->queue_ns = executor_now_ns() - infer->submit_ns;
+
+	struct ane_nn *nn = mpmc_pop_wait(&model->pool, &model->idle, NULL);
+	const struct ane_model *m = ane_model(nn);
+
+	for (uint32_t i = 0; i < m->src_count; i++) {
+		ane_tile_send(nn, infer->inputs[i], i);
+	}
+	infer->status = ane_exec(nn);
+	if (!infer->status) {
+		for (uint32_t i = 0; i < m->dst_count; i++) {
+			ane_tile_read(nn, infer->outputs[i], i);
+		}
+	}
+
+	mpmc_push(&model->pool, nn);
+	sem_post(&model->idle);
+
+	infer->latency_ns = executor_now_ns() - infer->submit_ns;
+	executor_complete(infer);
+}
+
+static void *executor_worker(void *arg)
+{
+	struct ane_executor *ex = arg;
+
+	for (;;) {
+		struct ane_infer *infer = mpmc_pop_wait(&ex->queue, &ex->queued, &ex->stopping);
+		if (!infer) {
+			break;
+		}
+		executor_run(ex, infer);
+	}
+
+	return NULL;
+}
+
+static void executor_stop(struct ane_executor *ex)
+{
+	/* One wakeup per worker; each leaves once the queue is empty */
+	atomic_store(&ex->stopping, 1);
+	for (int i = 0; i < ex->worker_count; i++) {
+		sem_post(&ex->queued);
+	}
+	for (int i = 0; i < ex->worker_count; i++) {
+		pthread_join(ex->workers[i], NULL);
+	}
+	free(ex->workers);
+	ex->workers = NULL;
+	ex->worker_count = 0;
+}
+
+struct ane_executor *ane_executor_create(int threads, uint32_t depth)
+{
+	if (threads <= 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? (int)cpus : 1;
+	}
+
+	struct ane_executor *ex = calloc(1, sizeof(*ex));
+	if (!ex) {
+		return NULL;
+	}
+
+	if (mpmc_init(&ex->queue, depth ? depth : EXECUTOR_DEPTH) < 0) {
+		free(ex);
+		return NULL;
+	}
+	sem_init(&ex->queued, 0, 0);
+	atomic_init(&ex->stopping, 0);
+	atomic_init(&ex->model_count, 0);
+
+	ex->workers = calloc((size_t)threads, sizeof(*ex->workers));
+	if (!ex->workers) {
+		ane_executor_destroy(ex);
+		return NULL;
+	}
+	for (; ex->worker_count < threads; ex->worker_count++) {
+		if (pthread_create(&ex->workers[ex->worker_count], NULL, executor_worker, ex)) {
+			ane_executor_destroy(ex);
+			return NULL;
+		}
+	}
+
+	return ex;
+}
+
+static void executor_model_free(struct executor_model *model)
+{
+	for (uint32_t i = 0; i < model->count; i++) {
+		ane_free(model->instances[i]);
+	}
+	free(model->instances);
+	mpmc_fini(&model->pool);
+	sem_destroy(&model->idle);
+}
+
+int ane_executor_add(struct ane_executor *ex, struct ane_nn *nn, uint32_t instances)
+{
+	const uint32_t idx = atomic_load(&ex->model_count);
+	if (!nn || !instances) {
+		return -EINVAL;
+	}
+	if (idx >= EXECUTOR_MODELS) {
+		return -ENOSPC;
+	}
+
+	struct executor_model *model = &ex->models[idx];
+	model->instances = calloc(instances, sizeof(*model->instances));
+	if (!model->instances || mpmc_init(&model->pool, instances) < 0) {
+		free(model->instances);
+		return -ENOMEM;
+	}
+	sem_init(&model->idle, 0, 0);
+
+	/* Clones share every channel but the I/O channels, which are per instance */
+	model->instances[model->count++] = nn;
+	while (model->count < instances) {
+		struct ane_nn *clone = ane_nn_clone(nn);
+		if (!clone) {
+			/* Leaves nn to the caller, as it was once its clones are gone */
+			while (--model->count) {
+				ane_free(model->instances[model->count]);
+			}
+			free(model->instances);
+			mpmc_fini(&model->pool);
+			sem_destroy(&model->idle);
+			memset(model, 0, sizeof(*model));
+			return -ENOMEM;
+		}
+		model->instances[model->count++] = clone;
+	}
+
+	for (uint32_t i = 0; i < model->count; i++) {
+		mpmc_push(&model->pool, model->instances[i]);
+		sem_post(&model->idle);
+	}
+
+	atomic_store(&ex->model_count, idx + 1);
+	return (int)idx;
+}
+
+int ane_executor_submit(struct ane_executor *ex, struct ane_infer *infer)
+{
+	if (infer->model >= atomic_load(&ex->model_count)) {
+		return -EINVAL;
+	}
+
+	infer->status = 0;
+	infer->state = 0;
+	infer->queue_ns = 0;
+	infer->latency_ns = 0;
+	infer->submit_ns = executor_now_ns();
+
+	int err = mpmc_push(&ex->queue, infer);
+	if (err < 0) {
+		return err;
+	}
+
+	sem_post(&ex->queued);
+	return 0;
+}
+
+int ane_executor_wait(struct ane_infer *infer)
+{
+	while (!__atomic_load_n(&infer->state, __ATOMIC_ACQUIRE)) {
+		syscall(SYS_futex, &infer->state, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+	}
+	return infer->status;
+}
+
+void ane_executor_destroy(struct ane_executor *ex)
+{
+	if (!ex) {
+		return;
+	}
+
+	executor_stop(ex);
+
+	const uint32_t count = atomic_load(&ex->model_count);
+	for (uint32_t i = 0; i < count; i++) {
+		executor_model_free(&ex->models[i]);
+	}
+
+	mpmc_fini(&ex->queue);
+	sem_destroy(&ex->queued);
+	free(ex);
+}
@@ -0,0 +1,196 @@
+// SPDX-License-Identifier: MIT
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ANE_F16_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define ANE_F16_NEON 1
+#endif
+
+#include "ane_f16.h"
+
+typedef void (*f16_to_f32_fn)(const uint16_t *x, float *y, const uint64_t n);
+typedef void (*f32_to_f16_fn)(const float *x, uint16_t *y, const uint64_t n);
+
+/* Tails shorter than a vector go through the scalar code */
+
+#ifdef ANE_F16_NEON
+/* Advanced SIMD is part of every arm64 CPU, fp16 conversion included */
+static void f16_to_f32_neon(const uint16_t *x, float *y, const uint64_t n)
+{
+	uint64_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		float16x8_t h = vreinterpretq_f16_u16(vld1q_u16(x + i));
+		vst1q_f32(y + i, vcvt_f32_f16(vget_low_f16(h)));
+		vst1q_f32(y + i + 4, vcvt_high_f32_f16(h));
+	}
+	ane_f16_to_f32_row_scalar(x + i, y + i, n - i);
+}
+
+static void f32_to_f16_neon(const float *x, uint16_t *y, const uint64_t n)
+{
+	uint64_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		float16x4_t lo = vcvt_f16_f32(vld1q_f32(x + i));
+		float16x8_t h = vcvt_high_f16_f32(lo, vld1q_f32(x + i + 4));
+		vst1q_u16(y + i, vreinterpretq_u16_f16(h));
+	}
+	ane_f32_to_f16_row_scalar(x + i, y + i, n - i);
+}
+#endif
+
+#ifdef ANE_F16_X86
+__attribute__((target("avx,f16c")))
+static void f16_to_f32_f16c(const uint16_t *x, float *y, const uint64_t n)
+{
+	uint64_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128i h = _mm_loadu_si128((const __m128i *)(x + i));
+		_mm256_storeu_ps(y + i, _mm256_cvtph_ps(h));
+	}
+	ane_f16_to_f32_row_scalar(x + i, y + i, n - i);
+}
+
+__attribute__((target("avx,f16c")))
+static void f32_to_f16_f16c(const float *x, uint16_t *y, const uint64_t n)
+{
+	uint64_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(x + i), _MM_FROUND_TO_NEAREST_INT);
+		_mm_storeu_si128((__m128i *)(y + i), h);
+	}
+	ane_f32_to_f16_row_scalar(x + i, y + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+static void f16_to_f32_avx512(const uint16_t *x, float *y, const uint64_t n)
+{
+	uint64_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m256i h = _mm256_loadu_si256((const __m256i *)(x + i));
+		_mm512_storeu_ps(y + i, _mm512_cvtph_ps(h));
+	}
+	ane_f16_to_f32_row_scalar(x + i, y + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+static void f32_to_f16_avx512(const float *x, uint16_t *y, const uint64_t n)
+{
+	uint64_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m256i h = _mm512_cvtps_ph(_mm512_loadu_ps(x + i), _MM_FROUND_TO_NEAREST_INT);
+		_mm256_storeu_si256((__m256i *)(y + i), h);
+	}
+	ane_f32_to_f16_row_scalar(x + i, y + i, n - i);
+}
+#endif
+
+static int f16_isa_supported(enum ane_f16_isa isa)
+{
+	switch (isa) {
+	case ANE_F16_ISA_SCALAR:
+		return 1;
+#ifdef ANE_F16_NEON
+	case ANE_F16_ISA_NEON:
+		return 1;
+#endif
+#ifdef ANE_F16_X86
+	case ANE_F16_ISA_F16C:
+		return __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+	case ANE_F16_ISA_AVX512:
+		return __builtin_cpu_supports("avx512f");
+#endif
+	default:
+		return 0;
+	}
+}
+
+static enum ane_f16_isa f16_isa_best(void)
+{
+	static const enum ane_f16_isa order[] = {
+		ANE_F16_ISA_AVX512,
+		ANE_F16_ISA_F16C,
+		ANE_F16_ISA_NEON,
+	};
+
+	for (unsigned i = 0; i < sizeof(order) / sizeof(order[0]); i++) {
+		if (f16_isa_supported(order[i])) {
+			return order[i];
+		}
+	}
+	return ANE_F16_ISA_SCALAR;
+}
+
+struct f16_impl {
+	enum ane_f16_isa isa;
+	f16_to_f32_fn to_f32;
+	f32_to_f16_fn to_f16;
+};
+
+static const struct f16_impl f16_impls[] = {
+	{ ANE_F16_ISA_SCALAR, ane_f16_to_f32_row_scalar, ane_f32_to_f16_row_scalar },
+#ifdef ANE_F16_NEON
+	{ ANE_F16_ISA_NEON, f16_to_f32_neon, f32_to_f16_neon },
+#endif
+#ifdef ANE_F16_X86
+	{ ANE_F16_ISA_F16C, f16_to_f32_f16c, f32_to_f16_f16c },
+	{ ANE_F16_ISA_AVX512, f16_to_f32_avx512, f32_to_f16_avx512 },
+#endif
+};
+
+/* NULL until the first conversion or ane_f16_set_isa() */
+static _Atomic(const struct f16_impl *) f16_impl;
+
+static const struct f16_impl *f16_impl_find(enum ane_f16_isa isa)
+{
+	for (unsigned i = 0; i < sizeof(f16_impls) / sizeof(f16_impls[0]); i++) {
+		if (f16_impls[i].isa == isa) {
+			return &f16_impls[i];
+		}
+	}
+	return &f16_impls[0];
+}
+
+static const struct f16_impl *f16_impl_get(void)
+{
+	const struct f16_impl *impl = atomic_load_explicit(&f16_impl, memory_order_acquire);
+	if (!impl) {
+		/* Racing threads pick the same one */
+		impl = f16_impl_find(f16_isa_best());
+		atomic_store_explicit(&f16_impl, impl, memory_order_release);
+	}
+	return impl;
+}
+
+void ane_f16_to_f32_row(const uint16_t *x, float *y, const uint64_t n)
+{
+	f16_impl_get()->to_f32(x, y, n);
+}
+
+void ane_f32_to_f16_row(const float *x, uint16_t *y, const uint64_t n)
+{
+	f16_impl_get()->to_f16(x, y, n);
+}
+
+int ane_f16_set_isa(enum ane_f16_isa isa)
+{
+	if (isa == ANE_F16_ISA_AUTO) {
+		isa = f16_isa_best();
+	}
+	if (!f16_isa_supported(isa)) {
+		return -ENOTSUP;
+	}
+
+	atomic_store_explicit(&f16_impl, f16_impl_find(isa), memory_order_release);
+	return 0;
+}
+
+enum ane_f16_isa ane_f16_get_isa(void)
+{
+	return f16_impl_get()->isa;
+}
@@ -7,6 +7,10 @@
 #include <math.h>
 #include <stdint.h>
 
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
 /* FP16 <-> FP32 */
 /* ref: https://github.com/ggerganov/ggml */
 /* ref: https://github.com/Maratyszcza/FP16 */
@@ -89,23 +93,48 @@ static inline uint16_t ane_compute_f32_to_f16(const float f)
 	       (shl1_w > UINT32_C(0xFF000000) ? UINT16_C(0x7E00) : nonsign);
 }
 
-static inline void ane_f16_to_f32_row(const uint16_t *x, float *y,
-				      const uint64_t n)
+/* Portable fallback of the row conversions below */
+static inline void ane_f16_to_f32_row_scalar(const uint16_t *x, float *y,
+					     const uint64_t n)
 {
 	for (uint64_t i = 0; i < n; i++) {
 		y[i] = ane_compute_f16_to_f32(x[i]);
 	}
 }
 
-static inline void ane_f32_to_f16_row(const float *x, uint16_t *y,
-				      const uint64_t n)
+static inline void ane_f32_to_f16_row_scalar(const float *x, uint16_t *y,
+					     const uint64_t n)
 {
 	for (uint64_t i = 0; i < n; i++) {
 		y[i] = ane_compute_f32_to_f16(x[i]);
 	}
 }
 
+/*
+ * Row conversions use the widest converter the CPU has, picked at first use:
+ * NEON on arm64, AVX-512 or F16C on x86, else the scalar code. All round to
+ * nearest even; NaNs stay NaNs but may keep their payload.
+ */
+enum ane_f16_isa {
+	ANE_F16_ISA_AUTO = 0,
+	ANE_F16_ISA_SCALAR = 1,
+	ANE_F16_ISA_NEON = 2,
+	ANE_F16_ISA_F16C = 3, /* with AVX, 8 lanes */
+	ANE_F16_ISA_AVX512 = 4, /* AVX-512F, 16 lanes */
+};
+
+void ane_f16_to_f32_row(const uint16_t *x, float *y, const uint64_t n);
+void ane_f32_to_f16_row(const float *x, uint16_t *y, const uint64_t n);
+
+/* Forces a converter; -ENOTSUP if the CPU lacks it. AUTO picks the best */
+int ane_f16_set_isa(enum ane_f16_isa isa);
+enum ane_f16_isa ane_f16_get_isa(void);
+
 #define ane_f16_to_f32(x) ane_compute_f16_to_f32(x)
 #define ane_f32_to_f16(x) ane_compute_f32_to_f16(x)
 
+#if defined(__cplusplus)
+}
+#endif
+
 #endif /* __ANE_F16_H__ */
@@ -0,0 +1,604 @@
+// SPDX-License-Identifier: MIT
+
+#define _GNU_SOURCE /* memfd_create */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <drm.h>
+#include <ane_accel.h>
+#include "ane.h"
+#include "ane_backend.h"
+
+/*
+ * Software stand-in for the DRM device. BOs are memfds and requests retire in
+ * submission order on a worker thread per device, each submission signaling
+ * an eventfd. Like the DRM nodes, a device is shared by every nn opened on it,
+ * so one submission can carry requests of several models.
+ */
+
+#define MOCK_DEVICES 2
+
+#define MOCK_LATENCY_ENV "LIBANE_MOCK_LATENCY_US"
+
+static struct ane_mock_config mock_config;
+static int mock_config_set;
+
+static atomic_uint_fast64_t mock_submitted;
+static atomic_uint_fast64_t mock_retired;
+static atomic_uint_fast64_t mock_bo_allocs;
+static atomic_uint_fast64_t mock_submissions;
+
+struct mock_device;
+
+/* What the device keeps per nn */
+struct mock_ctx {
+	struct ane_nn *nn;
+	struct mock_device *dev;
+	struct ane_mock_config config;
+	struct ane_mock_request last; /* under dev->lock */
+	uint32_t inflight; /* requests queued or running, under dev->lock */
+	struct ane_nn *view; /* nn as the running job sees it */
+};
+
+struct mock_req {
+	struct mock_ctx *ctx;
+	struct drm_ane_submit args;
+};
+
+/* One submission: requests run back to back and retire together */
+struct mock_job {
+	struct mock_job *next;
+	uint64_t submit_ns;
+	int efd; /* written once the job retires */
+	uint32_t count;
+	struct mock_req reqs[];
+};
+
+struct mock_device {
+	int id;
+	uint32_t refs; /* under mock_devices_lock */
+	pthread_mutex_t lock;
+	pthread_cond_t cond; /* signaled when a job is queued */
+	pthread_cond_t idle; /* broadcast when a job retires */
+	struct mock_job *head;
+	struct mock_job *tail;
+	uint64_t free_ns; /* when the device is done with earlier jobs */
+	pthread_t worker;
+	int started;
+	int stopping;
+};
+
+static struct mock_device *mock_devices[MOCK_DEVICES];
+static pthread_mutex_t mock_devices_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void ane_mock_set_config(const struct ane_mock_config *config)
+{
+	if (config) {
+		mock_config = *config;
+	} else {
+		memset(&mock_config, 0, sizeof(mock_config));
+	}
+	mock_config_set = config != NULL;
+}
+
+static void mock_get_config(struct ane_mock_config *config)
+{
+	*config = mock_config;
+	if (mock_config_set) {
+		return;
+	}
+
+	const char *latency = getenv(MOCK_LATENCY_ENV);
+	if (latency && latency[0]) {
+		config->latency_us = (uint32_t)strtoul(latency, NULL, 0);
+	}
+}
+
+void ane_mock_get_stats(struct ane_mock_stats *stats)
+{
+	stats->submitted = atomic_load(&mock_submitted);
+	stats->retired = atomic_load(&mock_retired);
+	stats->bo_allocs = atomic_load(&mock_bo_allocs);
+	stats->submissions = atomic_load(&mock_submissions);
+}
+
+void ane_mock_reset_stats(void)
+{
+	atomic_store(&mock_submitted, 0);
+	atomic_store(&mock_retired, 0);
+	atomic_store(&mock_bo_allocs, 0);
+	atomic_store(&mock_submissions, 0);
+}
+
+int ane_mock_last_request(struct ane_nn *nn, struct ane_mock_request *request)
+{
+	if (nn->backend != &ane_mock_backend || !nn->priv) {
+		return -EINVAL;
+	}
+
+	struct mock_ctx *ctx = nn->priv;
+	pthread_mutex_lock(&ctx->dev->lock);
+	*request = ctx->last;
+	pthread_mutex_unlock(&ctx->dev->lock);
+
+	return request->seqno ? 0 : -ENOENT;
+}
+
+static uint64_t mock_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void mock_sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = (time_t)(ns / 1000000000ull),
+		.tv_nsec = (long)(ns % 1000000000ull),
+	};
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+	}
+}
+
+static struct ane_device mock_device_list[MOCK_DEVICES];
+static pthread_once_t mock_device_once = PTHREAD_ONCE_INIT;
+
+static void mock_enumerate(void)
+{
+	for (int i = 0; i < MOCK_DEVICES; i++) {
+		mock_device_list[i].dev_id = i;
+		mock_device_list[i].chip_id = DRM_ANE_ID_H14;
+		snprintf(mock_device_list[i].node, sizeof(mock_device_list[i].node), "mock%d", i);
+	}
+}
+
+static const struct ane_device *mock_device(int dev_id)
+{
+	pthread_once(&mock_device_once, mock_enumerate);
+
+	if (dev_id < 0 || dev_id >= MOCK_DEVICES) {
+		return NULL;
+	}
+	return &mock_device_list[dev_id];
+}
+
+static void *mock_worker(void *arg);
+
+static struct mock_device *mock_device_get(int dev_id)
+{
+	pthread_mutex_lock(&mock_devices_lock);
+
+	struct mock_device *dev = mock_devices[dev_id];
+	if (dev) {
+		dev->refs++;
+		pthread_mutex_unlock(&mock_devices_lock);
+		return dev;
+	}
+
+	dev = calloc(1, sizeof(*dev));
+	if (dev) {
+		dev->id = dev_id;
+		dev->refs = 1;
+		pthread_mutex_init(&dev->lock, NULL);
+		pthread_cond_init(&dev->cond, NULL);
+		pthread_cond_init(&dev->idle, NULL);
+		mock_devices[dev_id] = dev;
+	}
+
+	pthread_mutex_unlock(&mock_devices_lock);
+	return dev;
+}
+
+static void mock_device_put(struct mock_device *dev)
+{
+	pthread_mutex_lock(&mock_devices_lock);
+	if (--dev->refs) {
+		pthread_mutex_unlock(&mock_devices_lock);
+		return;
+	}
+	mock_devices[dev->id] = NULL;
+	pthread_mutex_unlock(&mock_devices_lock);
+
+	/* Every nn drained its requests before letting go */
+	if (dev->started) {
+		pthread_mutex_lock(&dev->lock);
+		dev->stopping = 1;
+		pthread_cond_signal(&dev->cond);
+		pthread_mutex_unlock(&dev->lock);
+		pthread_join(dev->worker, NULL);
+	}
+
+	pthread_cond_destroy(&dev->idle);
+	pthread_cond_destroy(&dev->cond);
+	pthread_mutex_destroy(&dev->lock);
+	free(dev);
+}
+
+/* node, if given, is "mock<dev_id>" */
+static int mock_open(struct ane_nn *nn, int dev_id, const char *node)
+{
+	if (node && sscanf(node, "mock%d", &dev_id) != 1) {
+		return -ENODEV;
+	}
+	if (!mock_device(dev_id)) {
+		return -ENODEV;
+	}
+
+	struct mock_ctx *ctx = calloc(1, sizeof(*ctx));
+	if (!ctx) {
+		return -ENOMEM;
+	}
+
+	ctx->dev = mock_device_get(dev_id);
+	if (!ctx->dev) {
+		free(ctx);
+		return -ENOMEM;
+	}
+
+	ctx->nn = nn;
+	mock_get_config(&ctx->config);
+
+	nn->fd = -1;
+	nn->priv = ctx;
+	return 0;
+}
+
+static int mock_attach(struct ane_nn *nn, const struct ane_nn *from)
+{
+	const struct mock_ctx *from_ctx = from->priv;
+
+	return mock_open(nn, from_ctx->dev->id, NULL);
+}
+
+/* Waits until every request of ctx has retired */
+static void mock_drain(struct mock_ctx *ctx)
+{
+	struct mock_device *dev = ctx->dev;
+
+	pthread_mutex_lock(&dev->lock);
+	while (ctx->inflight) {
+		pthread_cond_wait(&dev->idle, &dev->lock);
+	}
+	pthread_mutex_unlock(&dev->lock);
+}
+
+static void mock_close(struct ane_nn *nn)
+{
+	struct mock_ctx *ctx = nn->priv;
+	if (!ctx) {
+		return;
+	}
+
+	mock_drain(ctx);
+	mock_device_put(ctx->dev);
+	free(ctx->view);
+	free(ctx);
+	nn->priv = NULL;
+}
+
+/* Handles are the memfd plus one, so that 0 stays "no bo" */
+static int mock_bo_init(struct ane_nn *nn, struct ane_bo *bo)
+{
+	(void)nn;
+
+	int fd = memfd_create("ane-bo", MFD_CLOEXEC);
+	if (fd < 0) {
+		return -errno;
+	}
+
+	if (ftruncate(fd, (off_t)bo->size) != 0) {
+		int err = -errno;
+		close(fd);
+		return err;
+	}
+
+	void *map = mmap(NULL, bo->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		int err = -errno;
+		close(fd);
+		return err;
+	}
+
+	bo->map = map;
+	bo->handle = (uint32_t)fd + 1;
+	bo->mmap_offset = 0;
+	atomic_fetch_add(&mock_bo_allocs, 1);
+	return 0;
+}
+
+static void mock_bo_free(struct ane_nn *nn, struct ane_bo *bo)
+{
+	struct mock_ctx *ctx = nn->priv;
+
+	/* Queued jobs may still run the reference on this bo */
+	if (ctx && bo->handle) {
+		mock_drain(ctx);
+	}
+
+	if (bo->map) {
+		munmap(bo->map, bo->size);
+	}
+	if (bo->handle) {
+		close((int)bo->handle - 1);
+	}
+	bo->map = NULL;
+	bo->handle = 0;
+	bo->mmap_offset = 0;
+}
+
+/*
+ * The reference runs on the channels named by the request, which need not be
+ * those nn points at, e.g. with another slot selected.
+ */
+static struct ane_nn *mock_view(struct mock_ctx *ctx, const struct drm_ane_submit *args)
+{
+	const struct ane_nn *nn = ctx->nn;
+
+	if (!ctx->view) {
+		ctx->view = malloc(sizeof(*ctx->view));
+		if (!ctx->view) {
+			return ctx->nn;
+		}
+	}
+
+	/* chans[] of nn may change under us; everything else is fixed */
+	struct ane_nn *view = ctx->view;
+	memset(view, 0, sizeof(*view));
+	view->fd = nn->fd;
+	view->model = nn->model;
+	view->arena = nn->arena;
+	view->btsp_chan = nn->btsp_chan;
+	view->slot_count = nn->slot_count;
+	view->slot_size = nn->slot_size;
+	view->backend = nn->backend;
+	view->priv = nn->priv;
+	for (int bdx = 0; bdx < ANE_MAX_TILE_COUNT; bdx++) {
+		struct ane_bo *bo = &view->chans[bdx];
+		if (args->handles[bdx] && args->handles[bdx] == nn->arena.handle) {
+			bo->map = (uint8_t *)nn->arena.map + args->offsets[bdx];
+			bo->size = nn->chans[bdx].size;
+			bo->handle = args->handles[bdx];
+			bo->parent = &view->arena;
+			bo->offset = args->offsets[bdx];
+		} else if (args->handles[bdx]) {
+			/* Shared with clones, and never moved */
+			*bo = nn->chans[bdx];
+		}
+	}
+	return view;
+}
+
+/*
+ * The device works through one request at a time, after a fixed cost per
+ * submission that a batch pays only once.
+ */
+static void mock_run(struct mock_device *dev, struct mock_job *job)
+{
+	const struct ane_mock_config *first = &job->reqs[0].ctx->config;
+	uint64_t start = job->submit_ns > dev->free_ns ? job->submit_ns : dev->free_ns;
+
+	dev->free_ns = start + (uint64_t)first->overhead_us * 1000u;
+	for (uint32_t i = 0; i < job->count; i++) {
+		struct mock_ctx *ctx = job->reqs[i].ctx;
+
+		dev->free_ns += (uint64_t)ctx->config.latency_us * 1000u;
+		if (job->submit_ns) {
+			mock_sleep_until(dev->free_ns);
+		}
+
+		if (ctx->config.run) {
+			ctx->config.run(mock_view(ctx, &job->reqs[i].args), ctx->config.arg);
+		}
+	}
+}
+
+static void mock_retire(struct mock_device *dev, struct mock_job *job)
+{
+	const uint64_t one = 1;
+	ssize_t n;
+
+	/* Counted before the fence fires, so waiters see it */
+	atomic_fetch_add(&mock_retired, job->count);
+	do {
+		n = write(job->efd, &one, sizeof(one));
+	} while (n < 0 && errno == EINTR);
+	close(job->efd);
+
+	pthread_mutex_lock(&dev->lock);
+	for (uint32_t i = 0; i < job->count; i++) {
+		job->reqs[i].ctx->inflight--;
+	}
+	pthread_cond_broadcast(&dev->idle);
+	pthread_mutex_unlock(&dev->lock);
+
+	free(job);
+}
+
+static void *mock_worker(void *arg)
+{
+	struct mock_device *dev = arg;
+
+	pthread_mutex_lock(&dev->lock);
+	for (;;) {
+		while (!dev->head && !dev->stopping) {
+			pthread_cond_wait(&dev->cond, &dev->lock);
+		}
+
+		struct mock_job *job = dev->head;
+		if (!job) {
+			break;
+		}
+		dev->head = job->next;
+		if (!dev->head) {
+			dev->tail = NULL;
+		}
+
+		pthread_mutex_unlock(&dev->lock);
+		mock_run(dev, job);
+		mock_retire(dev, job);
+		pthread_mutex_lock(&dev->lock);
+	}
+	pthread_mutex_unlock(&dev->lock);
+
+	return NULL;
+}
+
+static void mock_record(struct mock_ctx *ctx, const struct drm_ane_submit *args)
+{
+	struct ane_mock_request *last = &ctx->last;
+
+	last->seqno++;
+	last->tsk_size = args->tsk_size;
+	last->td_count = args->td_count;
+	last->td_size = args->td_size;
+	last->btsp_handle = args->btsp_handle;
+	last->btsp_offset = args->btsp_offset;
+	last->chan_count = 0;
+	for (int bdx = 0; bdx < ANE_MAX_TILE_COUNT; bdx++) {
+		last->chan_count += args->handles[bdx] != 0;
+	}
+}
+
+static int mock_queue(struct mock_device *dev, struct mock_job *job)
+{
+	pthread_mutex_lock(&dev->lock);
+
+	if (!dev->started) {
+		int err = pthread_create(&dev->worker, NULL, mock_worker, dev);
+		if (err) {
+			pthread_mutex_unlock(&dev->lock);
+			return -err;
+		}
+		dev->started = 1;
+	}
+
+	for (uint32_t i = 0; i < job->count; i++) {
+		mock_record(job->reqs[i].ctx, &job->reqs[i].args);
+		job->reqs[i].ctx->inflight++;
+	}
+	if (dev->tail) {
+		dev->tail->next = job;
+	} else {
+		dev->head = job;
+	}
+	dev->tail = job;
+
+	/* The worker may retire and free job as soon as the lock drops */
+	atomic_fetch_add(&mock_submitted, job->count);
+	atomic_fetch_add(&mock_submissions, 1);
+
+	pthread_cond_signal(&dev->cond);
+	pthread_mutex_unlock(&dev->lock);
+	return 0;
+}
+
+/* Same checks as the driver on what libane fills in */
+static int mock_check(const struct drm_ane_submit *args)
+{
+	if (args->pad || args->pad1 || !args->tsk_size || !args->td_count || !args->td_size ||
+	    !args->btsp_handle) {
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Mirrors DRM_IOCTL_ANE_SUBMIT_BATCH: every request is checked before any is
+ * queued, and they all go to the device as one job.
+ */
+static int mock_submit_batch(struct ane_nn *const *nns, const struct drm_ane_submit *args,
+			     uint32_t count, int *fence_fd)
+{
+	if (!count || count > ANE_MAX_BATCH) {
+		return -EINVAL;
+	}
+
+	struct mock_device *dev = ((struct mock_ctx *)nns[0]->priv)->dev;
+	for (uint32_t i = 0; i < count; i++) {
+		if (nns[i]->backend != &ane_mock_backend ||
+		    ((struct mock_ctx *)nns[i]->priv)->dev != dev) {
+			return -EXDEV;
+		}
+		if (mock_check(&args[i]) < 0) {
+			return -EINVAL;
+		}
+	}
+
+	struct mock_job *job = malloc(sizeof(*job) + count * sizeof(job->reqs[0]));
+	if (!job) {
+		return -ENOMEM;
+	}
+	job->next = NULL;
+	job->count = count;
+	job->submit_ns = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		job->reqs[i].ctx = nns[i]->priv;
+		job->reqs[i].args = args[i];
+		if (job->reqs[i].ctx->config.latency_us || job->reqs[i].ctx->config.overhead_us) {
+			job->submit_ns = mock_now_ns();
+		}
+	}
+
+	job->efd = eventfd(0, EFD_CLOEXEC);
+	if (job->efd < 0) {
+		int err = -errno;
+		free(job);
+		return err;
+	}
+
+	/* The caller's copy may be closed before the job retires */
+	struct ane_fence fence = { .fd = fcntl(job->efd, F_DUPFD_CLOEXEC, 0) };
+	if (fence.fd < 0) {
+		int err = -errno;
+		close(job->efd);
+		free(job);
+		return err;
+	}
+
+	int err = mock_queue(dev, job);
+	if (err < 0) {
+		ane_fence_close(&fence);
+		close(job->efd);
+		free(job);
+		return err;
+	}
+
+	if (fence_fd) {
+		*fence_fd = fence.fd;
+		return 0;
+	}
+
+	err = ane_fence_wait(&fence, -1);
+	ane_fence_close(&fence);
+	return err;
+}
+
+static int mock_submit(struct ane_nn *nn, const struct drm_ane_submit *args,
+		       int *fence_fd)
+{
+	return mock_submit_batch(&nn, args, 1, fence_fd);
+}
+
+const struct ane_backend ane_mock_backend = {
+	.name = "mock",
+	.device = mock_device,
+	.open = mock_open,
+	.close = mock_close,
+	.attach = mock_attach,
+	.bo_init = mock_bo_init,
+	.bo_free = mock_bo_free,
+	.submit = mock_submit,
+	.submit_batch = mock_submit_batch,
+};
@@ -0,0 +1,82 @@
+// SPDX-License-Identifier: MIT
+
+#include "ane_td.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include "td_v5.h"
+#include "td_v11.h"
+
+size_t ane_td_size(uint32_t td_version)
+{
+	switch (td_version) {
+	case 5:
+	case 7: // same layout as ane-disasm assumes
+		return sizeof(ane::TD_V5);
+	case 11:
+		return sizeof(ane::TD_V11);
+	default:
+		return 0;
+	}
+}
+
+static void td_dma(struct ane_td_dma *dma, bool enabled, uint32_t C, uint32_t H,
+		   uint32_t W, uint32_t row_stride, uint32_t plane_stride)
+{
+	std::memset(dma, 0, sizeof(*dma));
+	if (!enabled) {
+		return;
+	}
+	dma->C = C;
+	dma->H = H;
+	dma->W = W;
+	dma->row_stride = row_stride;
+	dma->plane_stride = plane_stride;
+}
+
+static void td_tile_dma_v5(const ane::TD_V5 &td, struct ane_td_dma *src, struct ane_td_dma *dst)
+{
+	const auto &common = td.common;
+	td_dma(src, static_cast<uint32_t>(td.tile_dma_src.DMAConfig.en) != 0,
+	       common.Cin_Cin, common.InDim_Hin, common.InDim_Win,
+	       td.tile_dma_src.RowStride, td.tile_dma_src.PlaneStride);
+	td_dma(dst, static_cast<uint32_t>(td.tile_dma_dst.DMAConfig.en) != 0,
+	       common.Cout_Cout, common.OutDim_Hout, common.OutDim_Wout,
+	       td.tile_dma_dst.RowStride, td.tile_dma_dst.PlaneStride);
+}
+
+// The enable bits of the V11 tile DMA are not mapped; unused sides have no strides
+static void td_tile_dma_v11(const ane::TD_V11 &td, struct ane_td_dma *src, struct ane_td_dma *dst)
+{
+	const auto &common = td.common;
+	td_dma(src, td.tile_dma_src.PlaneStride != 0,
+	       common.Cin_Cin, common.InDim_Hin, common.InDim_Win,
+	       td.tile_dma_src.RowStride, td.tile_dma_src.PlaneStride);
+	td_dma(dst, td.tile_dma_dst.PlaneStride != 0,
+	       common.Cout_Cout, common.OutDim_Hout, common.OutDim_Wout,
+	       td.tile_dma_dst.RowStride, td.tile_dma_dst.PlaneStride);
+}
+
+int ane_td_tile_dma(uint32_t td_version, const void *td,
+		    struct ane_td_dma *src, struct ane_td_dma *dst)
+{
+	// Decoded from a copy; TDs in a TSK are not necessarily aligned
+	switch (td_version) {
+	case 5:
+	case 7: {
+		ane::TD_V5 copy;
+		std::memcpy(&copy, td, sizeof(copy));
+		td_tile_dma_v5(copy, src, dst);
+		return 0;
+	}
+	case 11: {
+		ane::TD_V11 copy;
+		std::memcpy(&copy, td, sizeof(copy));
+		td_tile_dma_v11(copy, src, dst);
+		return 0;
+	}
+	default:
+		return -ENOTSUP;
+	}
+}
@@ -0,0 +1,33 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef ANE_TD_H_
+#define ANE_TD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Shape of one tile DMA side of a TD; C is zero if it is disabled */
+struct ane_td_dma {
+	uint32_t C;
+	uint32_t H;
+	uint32_t W;
+	uint32_t row_stride;
+	uint32_t plane_stride;
+};
+
+/* Size of one TD, or 0 if the layout for td_version is not known */
+size_t ane_td_size(uint32_t td_version);
+
+/* td holds ane_td_size(td_version) bytes; fails with -ENOTSUP otherwise */
+int ane_td_tile_dma(uint32_t td_version, const void *td,
+		    struct ane_td_dma *src, struct ane_td_dma *dst);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ANE_TD_H_
@@ -0,0 +1,303 @@
+// SPDX-License-Identifier: MIT
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ane.h"
+
+/* Bytes of destination per chunk a thread claims at a time */
+#define TILE_CHUNK (64 << 10)
+
+/*
+ * A job walks the N x C x H rows of a tensor. Threads claim consecutive
+ * chunks of rows off next, so each one streams through contiguous memory on
+ * both sides.
+ */
+struct tile_job {
+	uint8_t *data;
+	uint8_t *tile;
+	uint64_t C, H, W;
+	uint64_t new_H, new_W;
+	int untile;
+	uint32_t flags;
+	uint64_t rows;
+	uint64_t chunk; /* rows */
+	atomic_uint_fast64_t next;
+};
+
+static void tile_rows(const struct tile_job *job, uint64_t first, uint64_t last)
+{
+	const uint64_t row = job->W * sizeof(uint16_t);
+	const uint64_t new_row = job->new_W * sizeof(uint16_t);
+
+	if (job->H == job->new_H && job->W == job->new_W) {
+		/* Dense, the chunk is one run on both sides */
+		if (job->untile) {
+			memcpy(job->data + first * row, job->tile + first * row, (last - first) * row);
+		} else {
+			memcpy(job->tile + first * row, job->data + first * row, (last - first) * row);
+		}
+		return;
+	}
+
+	for (uint64_t i = first; i < last; i++) {
+		const uint64_t plane = i / job->H; /* n * C + c */
+		const uint64_t h = i % job->H;
+		uint8_t *data = job->data + i * row;
+		uint8_t *tile = job->tile + (plane * job->new_H + h) * new_row;
+
+		if (job->untile) {
+			memcpy(data, tile, row);
+			continue;
+		}
+
+		/* Zeroes go only where no data does: row tails, then plane tails */
+		memcpy(tile, data, row);
+		if (job->flags & ANE_TILE_NO_PAD) {
+			continue;
+		}
+		memset(tile + row, 0, new_row - row);
+		if (h == job->H - 1) {
+			memset(tile + new_row, 0, (job->new_H - job->H) * new_row);
+		}
+	}
+}
+
+static void tile_job_work(struct tile_job *job)
+{
+	for (;;) {
+		const uint64_t first = atomic_fetch_add(&job->next, job->chunk);
+		if (first >= job->rows) {
+			return;
+		}
+		tile_rows(job, first, first + job->chunk < job->rows ? first + job->chunk : job->rows);
+	}
+}
+
+/*
+ * Workers sleep until generation moves on, then help with job. The calling
+ * thread works too, so a pool of threads has threads - 1 workers. One job
+ * runs at a time; callers that find the pool busy work alone.
+ */
+static struct {
+	pthread_mutex_t run;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t idle;
+	pthread_t *workers;
+	int worker_count;
+	int stopping;
+	uint64_t generation;
+	struct tile_job *job;
+	int active;
+} tile_pool = {
+	.run = PTHREAD_MUTEX_INITIALIZER,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.idle = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_once_t tile_pool_once = PTHREAD_ONCE_INIT;
+
+static void *tile_worker(void *arg)
+{
+	uint64_t seen = 0;
+	(void)arg;
+
+	pthread_mutex_lock(&tile_pool.lock);
+	for (;;) {
+		while (tile_pool.generation == seen && !tile_pool.stopping) {
+			pthread_cond_wait(&tile_pool.wake, &tile_pool.lock);
+		}
+		if (tile_pool.stopping) {
+			break;
+		}
+		seen = tile_pool.generation;
+		struct tile_job *job = tile_pool.job;
+		pthread_mutex_unlock(&tile_pool.lock);
+
+		tile_job_work(job);
+
+		pthread_mutex_lock(&tile_pool.lock);
+		if (--tile_pool.active == 0) {
+			pthread_cond_signal(&tile_pool.idle);
+		}
+	}
+	pthread_mutex_unlock(&tile_pool.lock);
+
+	return NULL;
+}
+
+/* Called with run held */
+static void tile_pool_stop(void)
+{
+	pthread_mutex_lock(&tile_pool.lock);
+	tile_pool.stopping = 1;
+	pthread_cond_broadcast(&tile_pool.wake);
+	pthread_mutex_unlock(&tile_pool.lock);
+
+	for (int i = 0; i < tile_pool.worker_count; i++) {
+		pthread_join(tile_pool.workers[i], NULL);
+	}
+	free(tile_pool.workers);
+	tile_pool.workers = NULL;
+	tile_pool.worker_count = 0;
+	tile_pool.stopping = 0;
+	tile_pool.generation = 0;
+}
+
+/* Called with run held */
+static int tile_pool_start(int threads)
+{
+	if (threads <= 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? (int)cpus : 1;
+	}
+	if (threads == 1) {
+		return 0;
+	}
+
+	tile_pool.workers = calloc((size_t)threads - 1, sizeof(*tile_pool.workers));
+	if (!tile_pool.workers) {
+		return -ENOMEM;
+	}
+	for (; tile_pool.worker_count < threads - 1; tile_pool.worker_count++) {
+		if (pthread_create(&tile_pool.workers[tile_pool.worker_count], NULL, tile_worker,
+				   NULL)) {
+			tile_pool_stop();
+			return -EAGAIN;
+		}
+	}
+	return 0;
+}
+
+static void tile_pool_init(void)
+{
+	pthread_mutex_lock(&tile_pool.run);
+	tile_pool_start(0);
+	pthread_mutex_unlock(&tile_pool.run);
+}
+
+int ane_tile_set_threads(int threads)
+{
+	if (threads < 0) {
+		return -EINVAL;
+	}
+
+	pthread_once(&tile_pool_once, tile_pool_init);
+	pthread_mutex_lock(&tile_pool.run);
+	tile_pool_stop();
+	int err = tile_pool_start(threads);
+	pthread_mutex_unlock(&tile_pool.run);
+	return err;
+}
+
+static void tile_run(struct tile_job *job)
+{
+	pthread_once(&tile_pool_once, tile_pool_init);
+	if (pthread_mutex_trylock(&tile_pool.run)) {
+		tile_job_work(job);
+		return;
+	}
+
+	pthread_mutex_lock(&tile_pool.lock);
+	tile_pool.job = job;
+	tile_pool.active = tile_pool.worker_count;
+	tile_pool.generation++;
+	pthread_cond_broadcast(&tile_pool.wake);
+	pthread_mutex_unlock(&tile_pool.lock);
+
+	tile_job_work(job);
+
+	pthread_mutex_lock(&tile_pool.lock);
+	while (tile_pool.active) {
+		pthread_cond_wait(&tile_pool.idle, &tile_pool.lock);
+	}
+	tile_pool.job = NULL;
+	pthread_mutex_unlock(&tile_pool.lock);
+	pthread_mutex_unlock(&tile_pool.run);
+}
+
+static void tile_job_init(struct tile_job *job, void *data, void *tile, const uint64_t N,
+			  const uint64_t C, const uint64_t H, const uint64_t W,
+			  const uint64_t P, const uint64_t R, int untile, uint32_t flags)
+{
+	*job = (struct tile_job){
+		.data = data,
+		.tile = tile,
+		.C = C,
+		.H = H,
+		.W = W,
+		.new_H = P / R,
+		.new_W = R / sizeof(uint16_t),
+		.untile = untile,
+		.flags = flags,
+		.rows = N * C * H,
+	};
+	job->chunk = TILE_CHUNK / R ? TILE_CHUNK / R : 1;
+	atomic_init(&job->next, 0);
+}
+
+void ane_tile_flags(void *data, void *tile, const uint64_t N, const uint64_t C,
+		    const uint64_t H, const uint64_t W, const uint64_t P,
+		    const uint64_t R, const uint32_t flags)
+{
+	struct tile_job job;
+	tile_job_init(&job, data, tile, N, C, H, W, P, R, 0, flags);
+	tile_rows(&job, 0, job.rows);
+}
+
+void ane_tile(void *data, void *tile, const uint64_t N, const uint64_t C,
+	      const uint64_t H, const uint64_t W, const uint64_t P,
+	      const uint64_t R)
+{
+	ane_tile_flags(data, tile, N, C, H, W, P, R, 0);
+}
+
+/* The dense side has no padding, so untiling only copies */
+void ane_untile(void *data, void *tile, const uint64_t N, const uint64_t C,
+		const uint64_t H, const uint64_t W, const uint64_t P,
+		const uint64_t R)
+{
+	struct tile_job job;
+	tile_job_init(&job, data, tile, N, C, H, W, P, R, 1, 0);
+	tile_rows(&job, 0, job.rows);
+}
+
+void ane_tile_mt_flags(void *data, void *tile, const uint64_t N, const uint64_t C,
+		       const uint64_t H, const uint64_t W, const uint64_t P,
+		       const uint64_t R, const uint32_t flags)
+{
+	struct tile_job job;
+	tile_job_init(&job, data, tile, N, C, H, W, P, R, 0, flags);
+	if (N * C * P < ANE_TILE_MT_MIN) {
+		tile_rows(&job, 0, job.rows);
+		return;
+	}
+	tile_run(&job);
+}
+
+void ane_tile_mt(void *data, void *tile, const uint64_t N, const uint64_t C,
+		 const uint64_t H, const uint64_t W, const uint64_t P,
+		 const uint64_t R)
+{
+	ane_tile_mt_flags(data, tile, N, C, H, W, P, R, 0);
+}
+
+void ane_untile_mt(void *data, void *tile, const uint64_t N, const uint64_t C,
+		   const uint64_t H, const uint64_t W, const uint64_t P,
+		   const uint64_t R)
+{
+	struct tile_job job;
+	tile_job_init(&job, data, tile, N, C, H, W, P, R, 1, 0);
+	if (N * C * P < ANE_TILE_MT_MIN) {
+		tile_rows(&job, 0, job.rows);
+		return;
+	}
+	tile_run(&job);
+}
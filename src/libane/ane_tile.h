@@ -0,0 +1,15 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef ANE_TILE_H_
+#define ANE_TILE_H_
+
+#include <stdint.h>
+
+/* Channels are sized and placed in tiles; ane_model.tiles[] counts them */
+#define TILE_SHIFT    0xEUL
+#define TILE_SIZE     0x4000UL
+
+#define tile_shift(x) (((uint64_t)(x)) << TILE_SHIFT)
+#define tile_align(x) ((((uint64_t)(x)) + TILE_SIZE - 1) & -TILE_SIZE)
+
+#endif // ANE_TILE_H_
@@ -1,26 +1,49 @@
 // SPDX-License-Identifier: MIT
 
+#define _GNU_SOURCE /* O_TMPFILE */
+
 #include "hwx.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+struct hwx_section_entry {
+	const char *segment_name; /* name of the owning segment */
+	const struct hwx_section *section;
+};
+
 struct hwx_file {
 	int fd;
 	uint64_t file_size;
+	const uint8_t *map; /* read-only view of the whole file, if mapped */
+	int owns_map; /* map was created by us and must be unmapped */
+	uint8_t *cmds; /* load commands read from fd when not mapped */
+	int stream; /* fd is only read front to back and is not ours */
+	uint64_t stream_pos;
 	struct MachHeader64 header;
 	struct hwx_segment *segments;
 	uint32_t segment_count;
 	uint32_t td_version;
 	struct hwx_thread_state *thread_states;
 	uint32_t thread_state_count;
+	/* Open-addressed name tables; the first entry in file order wins */
+	const struct hwx_segment **segment_table;
+	struct hwx_section_entry *section_table;
+	uint32_t segment_mask;
+	uint32_t section_mask;
+	/* Resolved once at open; hit on every model init and submit */
+	const struct hwx_section *tsk_section;
+	const struct hwx_section *krn_section;
 };
 
 struct LoadCommand {
@@ -123,308 +146,609 @@ static uint32_t hwx_td_version_for_cpu(enum hwx_cpu_subtype subtype)
 	}
 }
 
-static void hwx_free_segments(struct hwx_segment *segments, uint32_t count)
+/*
+ * All parsed metadata (the hwx_file itself, segments, sections and thread
+ * state descriptors) lives in a single bump arena, so opening a file costs
+ * one allocation and closing it a single free. The load commands are walked
+ * twice: once to size the arena and once to fill it. Thread state payloads
+ * are not copied; they are views into the load command region.
+ */
+#define HWX_ARENA_ALIGN sizeof(uint64_t)
+
+struct hwx_arena {
+	uint8_t *base;
+	size_t size;
+	size_t used;
+};
+
+static size_t hwx_arena_align(size_t size)
 {
-	if (!segments) {
-		return;
+	return (size + HWX_ARENA_ALIGN - 1) & ~(HWX_ARENA_ALIGN - 1);
+}
+
+static void *hwx_arena_alloc(struct hwx_arena *arena, size_t size)
+{
+	size_t offset = hwx_arena_align(arena->used);
+	if (offset > arena->size || size > arena->size - offset) {
+		errno = ENOMEM;
+		return NULL;
 	}
 
-	for (uint32_t i = 0; i < count; ++i) {
-		free(segments[i].sections);
+	arena->used = offset + size;
+	return arena->base + offset;
+}
+
+struct hwx_parser {
+	uint64_t file_size;
+	uint32_t segment_count;
+	uint32_t section_count;
+	uint32_t thread_state_count;
+	/* Destinations inside the arena; NULL during the sizing pass */
+	struct hwx_segment *segments;
+	struct hwx_section *sections;
+	struct hwx_thread_state *thread_states;
+};
+
+/* Bounds what a stream can make us allocate before any section is read */
+#define HWX_STREAM_CMDS_MAX (16u << 20)
+#define HWX_STREAM_SKIP_CHUNK 4096u
+
+static int hwx_read_exact(int fd, void *buffer, size_t size)
+{
+	size_t total = 0;
+	char *dst = (char *)buffer;
+
+	while (total < size) {
+		ssize_t read_bytes = read(fd, dst + total, size - total);
+		if (read_bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if (read_bytes == 0) {
+			errno = EINVAL;
+			return -1;
+		}
+		total += (size_t)read_bytes;
 	}
-	free(segments);
+
+	return 0;
 }
 
-static void hwx_free_thread_states(struct hwx_thread_state *states, uint32_t count)
+/* Streams only move forward; anything before offset is read and dropped */
+static int hwx_stream_read(struct hwx_file *file, void *buffer, size_t size, uint64_t offset)
 {
-	if (!states) {
-		return;
+	if (offset < file->stream_pos) {
+		errno = ESPIPE;
+		return -1;
 	}
 
-	for (uint32_t i = 0; i < count; ++i) {
-		free(states[i].data);
+	uint8_t scratch[HWX_STREAM_SKIP_CHUNK];
+	while (file->stream_pos < offset) {
+		uint64_t skip = offset - file->stream_pos;
+		if (skip > sizeof(scratch)) {
+			skip = sizeof(scratch);
+		}
+		if (hwx_read_exact(file->fd, scratch, (size_t)skip) != 0) {
+			return -1;
+		}
+		file->stream_pos += skip;
 	}
-	free(states);
+
+	if (hwx_read_exact(file->fd, buffer, size) != 0) {
+		return -1;
+	}
+	file->stream_pos += size;
+
+	return 0;
 }
 
-struct hwx_file *hwx_open(const char *path)
+static int hwx_read_bytes(const struct hwx_file *file, void *buffer, size_t size, uint64_t offset)
 {
-	if (!path) {
-		errno = EINVAL;
-		return NULL;
+	if (file->map) {
+		memcpy(buffer, file->map + offset, size);
+		return 0;
 	}
 
-	int fd = open(path, O_RDONLY);
-	if (fd < 0) {
-		return NULL;
+	if (file->stream) {
+		/* The read position is the only state a stream mutates */
+		return hwx_stream_read((struct hwx_file *)file, buffer, size, offset);
 	}
 
-	struct stat st;
-	if (fstat(fd, &st) != 0) {
-		close(fd);
-		return NULL;
-	}
+	return hwx_pread_exact(file->fd, buffer, size, offset);
+}
 
-	if (!S_ISREG(st.st_mode)) {
-		close(fd);
+static int hwx_parse_segment(struct hwx_parser *parser, const uint8_t *cmd, uint32_t cmdsize)
+{
+	struct SegmentCommand64 seg_cmd;
+	if (cmdsize < sizeof(seg_cmd)) {
 		errno = EINVAL;
-		return NULL;
+		return -1;
 	}
+	memcpy(&seg_cmd, cmd, sizeof(seg_cmd));
 
-	uint64_t file_size = (uint64_t)st.st_size;
-	struct MachHeader64 header;
-	if (hwx_pread_exact(fd, &header, sizeof(header), 0) != 0) {
-		close(fd);
-		return NULL;
+	size_t expected = sizeof(struct SegmentCommand64) +
+			(size_t)seg_cmd.nsects * sizeof(struct Section64);
+	if (cmdsize < expected) {
+		errno = EINVAL;
+		return -1;
 	}
 
-	if (header.magic != HWX_MACHO_MAGIC_64) {
-		close(fd);
+	if (!hwx_within_file(parser->file_size, seg_cmd.fileoff, seg_cmd.filesize)) {
 		errno = EINVAL;
-		return NULL;
+		return -1;
 	}
 
-	if (!hwx_within_file(file_size, sizeof(struct MachHeader64), header.sizeofcmds)) {
-		close(fd);
+	struct hwx_segment *segment = NULL;
+	struct hwx_section *sections = NULL;
+	if (parser->segments) {
+		segment = &parser->segments[parser->segment_count];
+		memset(segment, 0, sizeof(*segment));
+		hwx_trim_name(seg_cmd.segname, sizeof(seg_cmd.segname), segment->name);
+		segment->vmaddr = seg_cmd.vmaddr;
+		segment->vmsize = seg_cmd.vmsize;
+		segment->fileoff = seg_cmd.fileoff;
+		segment->filesize = seg_cmd.filesize;
+		segment->maxprot = seg_cmd.maxprot;
+		segment->initprot = seg_cmd.initprot;
+		segment->flags = seg_cmd.flags;
+		segment->section_count = seg_cmd.nsects;
+		if (seg_cmd.nsects > 0) {
+			sections = &parser->sections[parser->section_count];
+			segment->sections = sections;
+		}
+	}
+
+	const uint8_t *src_sections = cmd + sizeof(struct SegmentCommand64);
+	for (uint32_t i = 0; i < seg_cmd.nsects; ++i) {
+		struct Section64 src;
+		memcpy(&src, src_sections + (size_t)i * sizeof(src), sizeof(src));
+
+		if (src.size && !hwx_within_file(parser->file_size, src.offset, src.size)) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		if (!sections) {
+			continue;
+		}
+
+		struct hwx_section *dst = &sections[i];
+		memset(dst, 0, sizeof(*dst));
+		hwx_trim_name(src.segname, sizeof(src.segname), dst->segment_name);
+		hwx_trim_name(src.sectname, sizeof(src.sectname), dst->section_name);
+		dst->addr = src.addr;
+		dst->size = src.size;
+		dst->offset = src.offset;
+		dst->align = src.align;
+		dst->reloff = src.reloff;
+		dst->nreloc = src.nreloc;
+		dst->flags = src.flags;
+		dst->reserved1 = src.reserved1;
+		dst->reserved2 = src.reserved2;
+		dst->reserved3 = src.reserved3;
+	}
+
+	parser->segment_count += 1;
+	parser->section_count += seg_cmd.nsects;
+	return 0;
+}
+
+static int hwx_parse_thread(struct hwx_parser *parser, const uint8_t *cmd, uint32_t cmdsize)
+{
+	if (cmdsize < sizeof(struct LoadCommand) + 2u * sizeof(uint32_t)) {
 		errno = EINVAL;
-		return NULL;
+		return -1;
 	}
 
-	struct hwx_file *file = calloc(1, sizeof(*file));
-	if (!file) {
-		close(fd);
-		return NULL;
+	size_t remaining = cmdsize - sizeof(struct LoadCommand);
+	const uint8_t *cursor = cmd + sizeof(struct LoadCommand);
+
+	while (remaining >= 2u * sizeof(uint32_t)) {
+		uint32_t flavor;
+		uint32_t count;
+		memcpy(&flavor, cursor, sizeof(flavor));
+		memcpy(&count, cursor + sizeof(flavor), sizeof(count));
+		cursor += 2u * sizeof(uint32_t);
+		remaining -= 2u * sizeof(uint32_t);
+
+		size_t byte_count = (size_t)count * sizeof(uint32_t);
+		if (count != 0 && byte_count / sizeof(uint32_t) != count) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (byte_count > remaining) {
+			byte_count = remaining;
+		}
+		if (byte_count > UINT32_MAX) {
+			byte_count = UINT32_MAX;
+		}
+
+		if (parser->thread_states) {
+			struct hwx_thread_state *state =
+				&parser->thread_states[parser->thread_state_count];
+			memset(state, 0, sizeof(*state));
+			state->flavor = flavor;
+			state->count = count;
+			state->byte_size = (uint32_t)byte_count;
+			state->data = byte_count > 0 ? cursor : NULL;
+		}
+
+		parser->thread_state_count += 1;
+
+		cursor += byte_count;
+		remaining -= byte_count;
 	}
 
-	file->fd = fd;
-	file->file_size = file_size;
-	file->header = header;
+	return 0;
+}
 
-	uint32_t remaining_cmds = header.ncmds;
-	uint64_t offset = sizeof(struct MachHeader64);
-	uint64_t remaining_bytes = header.sizeofcmds;
-	struct hwx_segment *segments = NULL;
-	uint32_t segment_count = 0;
-	struct hwx_thread_state *thread_states = NULL;
-	uint32_t thread_state_count = 0;
+static int hwx_parse_commands(const struct MachHeader64 *header, const uint8_t *cmds,
+			      struct hwx_parser *parser)
+{
+	uint32_t remaining_cmds = header->ncmds;
+	uint64_t offset = 0;
+	uint64_t remaining_bytes = header->sizeofcmds;
 
 	while (remaining_cmds--) {
 		if (remaining_bytes < sizeof(struct LoadCommand)) {
 			errno = EINVAL;
-			goto error;
+			return -1;
 		}
 
 		struct LoadCommand lc;
-		if (hwx_pread_exact(fd, &lc, sizeof(lc), offset) != 0) {
-			goto error;
-		}
+		memcpy(&lc, cmds + offset, sizeof(lc));
 
 		if (lc.cmdsize < sizeof(struct LoadCommand) || lc.cmdsize > remaining_bytes) {
 			errno = EINVAL;
-			goto error;
+			return -1;
 		}
 
 		if (lc.cmd == HWX_LOAD_COMMAND_SEGMENT_64) {
-			uint8_t *buffer = (uint8_t *)malloc(lc.cmdsize);
-			if (!buffer) {
-				goto error;
+			if (hwx_parse_segment(parser, cmds + offset, lc.cmdsize) != 0) {
+				return -1;
 			}
-
-			if (hwx_pread_exact(fd, buffer, lc.cmdsize, offset) != 0) {
-				free(buffer);
-				goto error;
+		} else if (lc.cmd == HWX_LOAD_COMMAND_THREAD) {
+			if (hwx_parse_thread(parser, cmds + offset, lc.cmdsize) != 0) {
+				return -1;
 			}
+		}
 
-			const struct SegmentCommand64 *seg_cmd = (const struct SegmentCommand64 *)buffer;
-			size_t expected = sizeof(struct SegmentCommand64) +
-					(size_t)seg_cmd->nsects * sizeof(struct Section64);
-			if (lc.cmdsize < expected) {
-				free(buffer);
-				errno = EINVAL;
-				goto error;
-			}
+		offset += lc.cmdsize;
+		remaining_bytes -= lc.cmdsize;
+	}
 
-			if (!hwx_within_file(file_size, seg_cmd->fileoff, seg_cmd->filesize)) {
-				free(buffer);
-				errno = EINVAL;
-				goto error;
-			}
+	if (remaining_bytes != 0) {
+		errno = EINVAL;
+		return -1;
+	}
 
-			struct hwx_segment segment;
-			memset(&segment, 0, sizeof(segment));
-			hwx_trim_name(seg_cmd->segname, sizeof(seg_cmd->segname), segment.name);
-			segment.vmaddr = seg_cmd->vmaddr;
-			segment.vmsize = seg_cmd->vmsize;
-			segment.fileoff = seg_cmd->fileoff;
-			segment.filesize = seg_cmd->filesize;
-			segment.maxprot = seg_cmd->maxprot;
-			segment.initprot = seg_cmd->initprot;
-			segment.flags = seg_cmd->flags;
-			segment.section_count = seg_cmd->nsects;
-			segment.sections = NULL;
-
-			if (segment.section_count > 0) {
-				const struct Section64 *src_sections =
-					(const struct Section64 *)(seg_cmd + 1);
-				struct hwx_section *sections = calloc(segment.section_count,
-								    sizeof(struct hwx_section));
-				if (!sections) {
-					free(buffer);
-					goto error;
-				}
+	return 0;
+}
 
-				for (uint32_t i = 0; i < segment.section_count; ++i) {
-					struct hwx_section *dst = &sections[i];
-					hwx_trim_name(src_sections[i].segname,
-						     sizeof(src_sections[i].segname),
-						     dst->segment_name);
-					hwx_trim_name(src_sections[i].sectname,
-						     sizeof(src_sections[i].sectname),
-						     dst->section_name);
-					dst->addr = src_sections[i].addr;
-					dst->size = src_sections[i].size;
-					dst->offset = src_sections[i].offset;
-					dst->align = src_sections[i].align;
-					dst->reloff = src_sections[i].reloff;
-					dst->nreloc = src_sections[i].nreloc;
-					dst->flags = src_sections[i].flags;
-					dst->reserved1 = src_sections[i].reserved1;
-					dst->reserved2 = src_sections[i].reserved2;
-					dst->reserved3 = src_sections[i].reserved3;
-					if (dst->size &&
-					    !hwx_within_file(file_size, dst->offset, dst->size)) {
-						free(buffer);
-						free(sections);
-						errno = EINVAL;
-						goto error;
-					}
-				}
+/* Power of two, at most half full; never zero so lookups need no guard */
+static uint32_t hwx_table_slots(uint32_t count)
+{
+	uint32_t slots = 1;
+	while (slots < 2u * (uint64_t)count) {
+		slots <<= 1;
+	}
+	return slots;
+}
 
-				segment.sections = sections;
-			}
+static uint32_t hwx_hash_name(uint32_t hash, const char *name)
+{
+	/* FNV-1a; names are at most 16 bytes */
+	for (; *name; ++name) {
+		hash ^= (uint8_t)*name;
+		hash *= 16777619u;
+	}
+	return hash;
+}
 
-			struct hwx_segment *new_segments = realloc(
-				segments, (segment_count + 1u) * sizeof(struct hwx_segment));
-			if (!new_segments) {
-				free(buffer);
-				free(segment.sections);
-				goto error;
-			}
+static uint32_t hwx_hash_section(const char *segment_name, const char *section_name)
+{
+	return hwx_hash_name(hwx_hash_name(2166136261u, segment_name) * 31u, section_name);
+}
 
-			segments = new_segments;
-			segments[segment_count] = segment;
-			segment_count += 1;
-			free(buffer);
-		} else if (lc.cmd == HWX_LOAD_COMMAND_THREAD) {
-			if (lc.cmdsize < sizeof(struct LoadCommand) + 2u * sizeof(uint32_t)) {
-				errno = EINVAL;
-				goto error;
-			}
+static const struct hwx_segment **hwx_segment_slot(const struct hwx_file *file, const char *name)
+{
+	uint32_t slot = hwx_hash_name(2166136261u, name) & file->segment_mask;
+	while (file->segment_table[slot] &&
+	       strcmp(file->segment_table[slot]->name, name) != 0) {
+		slot = (slot + 1u) & file->segment_mask;
+	}
+	return &file->segment_table[slot];
+}
 
-			uint8_t *buffer = (uint8_t *)malloc(lc.cmdsize);
-			if (!buffer) {
-				goto error;
-			}
+static struct hwx_section_entry *hwx_section_slot(const struct hwx_file *file,
+						  const char *segment_name,
+						  const char *section_name)
+{
+	uint32_t slot = hwx_hash_section(segment_name, section_name) & file->section_mask;
+	while (file->section_table[slot].section &&
+	       (strcmp(file->section_table[slot].segment_name, segment_name) != 0 ||
+		strcmp(file->section_table[slot].section->section_name, section_name) != 0)) {
+		slot = (slot + 1u) & file->section_mask;
+	}
+	return &file->section_table[slot];
+}
 
-			if (hwx_pread_exact(fd, buffer, lc.cmdsize, offset) != 0) {
-				free(buffer);
-				goto error;
-			}
+static void hwx_build_index(struct hwx_file *file)
+{
+	memset(file->segment_table, 0, (file->segment_mask + 1u) * sizeof(*file->segment_table));
+	memset(file->section_table, 0, (file->section_mask + 1u) * sizeof(*file->section_table));
 
-			size_t remaining = lc.cmdsize;
-			const uint8_t *cursor = buffer;
+	for (uint32_t i = 0; i < file->segment_count; ++i) {
+		const struct hwx_segment *segment = &file->segments[i];
+		const struct hwx_segment **segment_slot = hwx_segment_slot(file, segment->name);
+		if (!*segment_slot) {
+			*segment_slot = segment;
+		}
 
-			if (remaining < sizeof(struct LoadCommand)) {
-				free(buffer);
-				errno = EINVAL;
-				goto error;
+		for (uint32_t j = 0; j < segment->section_count; ++j) {
+			const struct hwx_section *section = &segment->sections[j];
+			struct hwx_section_entry *entry =
+				hwx_section_slot(file, segment->name, section->section_name);
+			if (!entry->section) {
+				entry->segment_name = segment->name;
+				entry->section = section;
 			}
-			cursor += sizeof(struct LoadCommand);
-			remaining -= sizeof(struct LoadCommand);
-
-			while (remaining >= 2u * sizeof(uint32_t)) {
-				uint32_t flavor;
-				uint32_t count;
-				memcpy(&flavor, cursor, sizeof(flavor));
-				memcpy(&count, cursor + sizeof(flavor), sizeof(count));
-				cursor += 2u * sizeof(uint32_t);
-				remaining -= 2u * sizeof(uint32_t);
-
-				size_t byte_count = (size_t)count * sizeof(uint32_t);
-				if (count != 0 && byte_count / sizeof(uint32_t) != count) {
-					free(buffer);
-					errno = EINVAL;
-					goto error;
-				}
-				if (byte_count > remaining) {
-					byte_count = remaining;
-				}
-				if (byte_count > UINT32_MAX) {
-					byte_count = UINT32_MAX;
-				}
+		}
+	}
+}
 
-				struct hwx_thread_state state;
-				memset(&state, 0, sizeof(state));
-				state.flavor = flavor;
-				state.count = count;
-				state.byte_size = (uint32_t)byte_count;
-				if (byte_count > 0) {
-					state.data = (uint8_t *)malloc(byte_count);
-					if (!state.data) {
-						free(buffer);
-						goto error;
-					}
-					memcpy(state.data, cursor, byte_count);
-				}
+static struct hwx_file *hwx_build(const struct hwx_file *source,
+				  const struct MachHeader64 *header,
+				  const uint8_t *cmds)
+{
+	struct hwx_parser parser;
+	memset(&parser, 0, sizeof(parser));
+	parser.file_size = source->file_size;
 
-				struct hwx_thread_state *new_states = realloc(
-					thread_states,
-					(thread_state_count + 1u) * sizeof(struct hwx_thread_state));
-				if (!new_states) {
-					free(state.data);
-					free(buffer);
-					goto error;
-				}
+	if (hwx_parse_commands(header, cmds, &parser) != 0) {
+		return NULL;
+	}
 
-				thread_states = new_states;
-				thread_states[thread_state_count] = state;
-				thread_state_count += 1;
+	const size_t segments_size = (size_t)parser.segment_count * sizeof(struct hwx_segment);
+	const size_t sections_size = (size_t)parser.section_count * sizeof(struct hwx_section);
+	const size_t states_size = (size_t)parser.thread_state_count * sizeof(struct hwx_thread_state);
+	const uint32_t segment_slots = hwx_table_slots(parser.segment_count);
+	const uint32_t section_slots = hwx_table_slots(parser.section_count);
+	const size_t segment_table_size = (size_t)segment_slots * sizeof(struct hwx_segment *);
+	const size_t section_table_size = (size_t)section_slots * sizeof(struct hwx_section_entry);
+
+	struct hwx_arena arena;
+	arena.size = hwx_arena_align(sizeof(struct hwx_file)) +
+		     hwx_arena_align(segments_size) + hwx_arena_align(sections_size) +
+		     hwx_arena_align(states_size) + hwx_arena_align(segment_table_size) +
+		     hwx_arena_align(section_table_size);
+	arena.used = 0;
+	arena.base = (uint8_t *)malloc(arena.size);
+	if (!arena.base) {
+		return NULL;
+	}
 
-				cursor += byte_count;
-				remaining -= byte_count;
-			}
+	struct hwx_file *file = hwx_arena_alloc(&arena, sizeof(struct hwx_file));
+	*file = *source;
+	file->header = *header;
+
+	parser.segments = hwx_arena_alloc(&arena, segments_size);
+	parser.sections = hwx_arena_alloc(&arena, sections_size);
+	parser.thread_states = hwx_arena_alloc(&arena, states_size);
+	file->segment_table = hwx_arena_alloc(&arena, segment_table_size);
+	file->section_table = hwx_arena_alloc(&arena, section_table_size);
+	file->segment_mask = segment_slots - 1u;
+	file->section_mask = section_slots - 1u;
+	parser.segment_count = 0;
+	parser.section_count = 0;
+	parser.thread_state_count = 0;
+
+	if (hwx_parse_commands(header, cmds, &parser) != 0) {
+		free(arena.base);
+		return NULL;
+	}
 
-			free(buffer);
+	file->segments = parser.segment_count ? parser.segments : NULL;
+	file->segment_count = parser.segment_count;
+	file->thread_states = parser.thread_state_count ? parser.thread_states : NULL;
+	file->thread_state_count = parser.thread_state_count;
+	file->td_version = hwx_td_version_for_cpu(hwx_cpu_subtype(file));
+	hwx_build_index(file);
+
+	file->tsk_section = hwx_section_by_name(file, "__TEXT", "__text");
+	file->krn_section = hwx_section_by_name(file, "__TEXT", "__const");
+	if (!file->tsk_section || !file->krn_section) {
+		free(arena.base);
+		errno = ENOENT;
+		return NULL;
+	}
+
+	return file;
+}
+
+static struct hwx_file *hwx_load(const struct hwx_file *source)
+{
+	struct MachHeader64 header;
+	if (source->file_size < sizeof(header)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (hwx_read_bytes(source, &header, sizeof(header), 0) != 0) {
+		return NULL;
+	}
+
+	if (header.magic != HWX_MACHO_MAGIC_64) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (!hwx_within_file(source->file_size, sizeof(struct MachHeader64),
+			     header.sizeofcmds)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/*
+	 * Mapped files are parsed in place. Otherwise the whole load command
+	 * region is fetched with a single read instead of one per command and
+	 * kept, since thread state payloads point into it.
+	 */
+	if (source->map) {
+		return hwx_build(source, &header, source->map + sizeof(struct MachHeader64));
+	}
+
+	if (source->stream && header.sizeofcmds > HWX_STREAM_CMDS_MAX) {
+		errno = EFBIG;
+		return NULL;
+	}
+
+	uint8_t *buffer = (uint8_t *)malloc(header.sizeofcmds ? header.sizeofcmds : 1u);
+	if (!buffer) {
+		return NULL;
+	}
+
+	struct hwx_file *file = NULL;
+	if (hwx_read_bytes(source, buffer, header.sizeofcmds,
+			   sizeof(struct MachHeader64)) == 0) {
+		file = hwx_build(source, &header, buffer);
+	}
+
+	if (file) {
+		file->cmds = buffer;
+		return file;
+	}
+
+	int saved_errno = errno;
+	free(buffer);
+	errno = saved_errno;
+	return NULL;
+}
+
+static struct hwx_file *hwx_open_descriptor(int fd, int mapped)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		return NULL;
+	}
+
+	if (!S_ISREG(st.st_mode)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	struct hwx_file source;
+	memset(&source, 0, sizeof(source));
+	source.fd = -1;
+	source.file_size = (uint64_t)st.st_size;
+
+	if (mapped) {
+		if (source.file_size < sizeof(struct MachHeader64) ||
+		    source.file_size > SIZE_MAX) {
+			errno = EINVAL;
+			return NULL;
 		}
 
-		offset += lc.cmdsize;
-		remaining_bytes -= lc.cmdsize;
+		void *map = mmap(NULL, (size_t)source.file_size, PROT_READ,
+				 MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			return NULL;
+		}
+
+		/* The mapping keeps the file referenced; the fd is no longer needed */
+		source.map = (const uint8_t *)map;
+		source.owns_map = 1;
+	} else {
+		source.fd = fd;
+	}
+
+	struct hwx_file *file = hwx_load(&source);
+	if (!file && source.owns_map) {
+		int saved_errno = errno;
+		munmap((void *)source.map, (size_t)source.file_size);
+		errno = saved_errno;
+	}
+
+	return file;
+}
+
+static struct hwx_file *hwx_open_path(const char *path, int mapped)
+{
+	if (!path) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	struct hwx_file *file = hwx_open_descriptor(fd, mapped);
+	if (!file || mapped) {
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+	}
+
+	return file;
+}
+
+struct hwx_file *hwx_open(const char *path)
+{
+	return hwx_open_path(path, 0);
+}
+
+struct hwx_file *hwx_open_mapped(const char *path)
+{
+	return hwx_open_path(path, 1);
+}
+
+struct hwx_file *hwx_open_fd(int fd)
+{
+	if (fd < 0) {
+		errno = EBADF;
+		return NULL;
+	}
+
+	return hwx_open_descriptor(fd, 1);
+}
+
+struct hwx_file *hwx_open_stream(int fd)
+{
+	if (fd < 0) {
+		errno = EBADF;
+		return NULL;
 	}
 
-	if (remaining_bytes != 0) {
-		errno = EINVAL;
-		goto error;
-	}
+	/* The size is unknown; reads past the end fail when the stream does */
+	struct hwx_file source;
+	memset(&source, 0, sizeof(source));
+	source.fd = fd;
+	source.file_size = UINT64_MAX;
+	source.stream = 1;
 
-	file->segments = segments;
-	file->segment_count = segment_count;
-	file->thread_states = thread_states;
-	file->thread_state_count = thread_state_count;
-	file->td_version = hwx_td_version_for_cpu(hwx_cpu_subtype(file));
+	return hwx_load(&source);
+}
 
-	if (!hwx_get_tsk_section(file) || !hwx_get_krn_section(file)) {
-		errno = ENOENT;
-		goto error;
+struct hwx_file *hwx_open_memory(const void *data, size_t size)
+{
+	if (!data) {
+		errno = EINVAL;
+		return NULL;
 	}
 
-	return file;
+	/* Borrowed from the caller; parsed in place and never copied */
+	struct hwx_file source;
+	memset(&source, 0, sizeof(source));
+	source.fd = -1;
+	source.file_size = (uint64_t)size;
+	source.map = (const uint8_t *)data;
+	source.owns_map = 0;
 
-error:
-	hwx_free_thread_states(thread_states, thread_state_count);
-	hwx_free_segments(segments, segment_count);
-	close(fd);
-	free(file);
-	return NULL;
+	return hwx_load(&source);
 }
 
 void hwx_close(struct hwx_file *file)
@@ -433,9 +757,15 @@ void hwx_close(struct hwx_file *file)
 		return;
 	}
 
-	hwx_free_segments(file->segments, file->segment_count);
-	hwx_free_thread_states(file->thread_states, file->thread_state_count);
-	close(file->fd);
+	if (file->map && file->owns_map) {
+		munmap((void *)file->map, (size_t)file->file_size);
+	}
+	if (file->fd >= 0 && !file->stream) {
+		close(file->fd);
+	}
+	free(file->cmds);
+
+	/* The file heads its own arena */
 	free(file);
 }
 
@@ -531,14 +861,7 @@ const struct hwx_segment *hwx_segment_by_name(const struct hwx_file *file, const
 		return NULL;
 	}
 
-	const struct hwx_segment *segments = file->segments;
-	for (uint32_t i = 0; i < file->segment_count; ++i) {
-		if (strcmp(segments[i].name, name) == 0) {
-			return &segments[i];
-		}
-	}
-
-	return NULL;
+	return *hwx_segment_slot(file, name);
 }
 
 const struct hwx_section *hwx_section_by_name(const struct hwx_file *file,
@@ -550,33 +873,40 @@ const struct hwx_section *hwx_section_by_name(const struct hwx_file *file,
 		return NULL;
 	}
 
-	const struct hwx_segment *segments = file->segments;
-	for (uint32_t i = 0; i < file->segment_count; ++i) {
-		const struct hwx_segment *segment = &segments[i];
-		if (segment_name && segment_name[0] != '\0' &&
-		    strcmp(segment->name, segment_name) != 0) {
-			continue;
-		}
-
-		for (uint32_t j = 0; j < segment->section_count; ++j) {
-			const struct hwx_section *section = &segment->sections[j];
-			if (strcmp(section->section_name, section_name) == 0) {
-				return section;
+	/* Any segment: rare enough to not warrant a second index */
+	if (!segment_name || segment_name[0] == '\0') {
+		const struct hwx_segment *segments = file->segments;
+		for (uint32_t i = 0; i < file->segment_count; ++i) {
+			const struct hwx_segment *segment = &segments[i];
+			for (uint32_t j = 0; j < segment->section_count; ++j) {
+				const struct hwx_section *section = &segment->sections[j];
+				if (strcmp(section->section_name, section_name) == 0) {
+					return section;
+				}
 			}
 		}
+		return NULL;
 	}
 
-	return NULL;
+	return hwx_section_slot(file, segment_name, section_name)->section;
 }
 
 const struct hwx_section *hwx_get_tsk_section(const struct hwx_file *file)
 {
-	return hwx_section_by_name(file, "__TEXT", "__text");
+	if (!file) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return file->tsk_section;
 }
 
 const struct hwx_section *hwx_get_krn_section(const struct hwx_file *file)
 {
-	return hwx_section_by_name(file, "__TEXT", "__const");
+	if (!file) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return file->krn_section;
 }
 
 uint32_t hwx_thread_state_count(const struct hwx_file *file)
@@ -666,7 +996,7 @@ int hwx_segment_read(const struct hwx_file *file,
 		return -1;
 	}
 
-	return hwx_pread_exact(file->fd, buffer, size, file_offset);
+	return hwx_read_bytes(file, buffer, size, file_offset);
 }
 
 int hwx_section_read(const struct hwx_file *file,
@@ -695,5 +1025,495 @@ int hwx_section_read(const struct hwx_file *file,
 		return -1;
 	}
 
-	return hwx_pread_exact(file->fd, buffer, size, file_offset);
+	return hwx_read_bytes(file, buffer, size, file_offset);
+}
+
+const void *hwx_segment_data(const struct hwx_file *file,
+			     const struct hwx_segment *segment)
+{
+	if (!file || !segment) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (!file->map) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+
+	if (hwx_validate_read(file, segment->fileoff, segment->filesize) != 0) {
+		return NULL;
+	}
+
+	return file->map + segment->fileoff;
+}
+
+const void *hwx_section_data(const struct hwx_file *file,
+			     const struct hwx_section *section)
+{
+	if (!file || !section) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (!file->map) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+
+	if (hwx_validate_read(file, section->offset, section->size) != 0) {
+		return NULL;
+	}
+
+	return file->map + section->offset;
+}
+
+/*
+ * Fingerprints: a non-cryptographic 128-bit hash. Each 64-byte stripe feeds
+ * eight independent 64-bit accumulators through 32x32->64 multiplies, which
+ * compilers turn into vector code (NEON umlal, SSE/AVX pmuludq) without
+ * intrinsics. Accumulators are scrambled every block so long inputs do not
+ * lose entropy.
+ */
+#define HWX_HASH_STRIPE 64u
+#define HWX_HASH_LANES (HWX_HASH_STRIPE / sizeof(uint64_t))
+#define HWX_HASH_BLOCK 16u /* stripes between scrambles */
+
+struct hwx_hash {
+	uint64_t acc[HWX_HASH_LANES];
+	uint8_t tail[HWX_HASH_STRIPE];
+	size_t tail_size;
+	uint64_t stripes;
+	uint64_t total;
+};
+
+static const uint64_t hwx_hash_secret[HWX_HASH_LANES] = {
+	0xBE4BA423396CFEB8ULL, 0x1CAD21F72C81017CULL, 0xDB979083E96DD4DEULL,
+	0x1F67B3B7A4A44072ULL, 0x78E5C0CC4EE679CBULL, 0x2172FFCC7DD05A82ULL,
+	0x8E2443F7744608B8ULL, 0x4C263A81E69035E0ULL,
+};
+
+static void hwx_hash_init(struct hwx_hash *hash)
+{
+	memset(hash, 0, sizeof(*hash));
+	for (uint32_t i = 0; i < HWX_HASH_LANES; i++) {
+		hash->acc[i] = hwx_hash_secret[(i + 4u) % HWX_HASH_LANES];
+	}
+}
+
+static inline void hwx_hash_stripe(uint64_t *acc, const uint8_t *data)
+{
+	uint64_t word[HWX_HASH_LANES];
+	memcpy(word, data, sizeof(word));
+	for (uint32_t i = 0; i < HWX_HASH_LANES; i++) {
+		const uint64_t key = word[i] ^ hwx_hash_secret[i];
+		acc[i] += word[i ^ 1u] + (key & 0xFFFFFFFFu) * (key >> 32);
+	}
+}
+
+static inline void hwx_hash_scramble(uint64_t *acc)
+{
+	for (uint32_t i = 0; i < HWX_HASH_LANES; i++) {
+		uint64_t x = acc[i];
+		x ^= x >> 47;
+		x ^= hwx_hash_secret[(i + 3u) % HWX_HASH_LANES];
+		acc[i] = x * 0x9E3779B1u;
+	}
+}
+
+static void hwx_hash_stripes(struct hwx_hash *hash, const uint8_t *data, size_t count)
+{
+	while (count > 0) {
+		/* Whole runs up to the next scramble, so the inner loop stays tight */
+		size_t run = HWX_HASH_BLOCK - (size_t)(hash->stripes % HWX_HASH_BLOCK);
+		if (run > count) {
+			run = count;
+		}
+		for (size_t i = 0; i < run; i++) {
+			hwx_hash_stripe(hash->acc, data + i * HWX_HASH_STRIPE);
+		}
+		hash->stripes += run;
+		if (hash->stripes % HWX_HASH_BLOCK == 0) {
+			hwx_hash_scramble(hash->acc);
+		}
+		data += run * HWX_HASH_STRIPE;
+		count -= run;
+	}
+}
+
+static void hwx_hash_update(struct hwx_hash *hash, const void *data, size_t size)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	hash->total += size;
+
+	if (hash->tail_size) {
+		size_t take = HWX_HASH_STRIPE - hash->tail_size;
+		if (take > size) {
+			take = size;
+		}
+		memcpy(hash->tail + hash->tail_size, p, take);
+		hash->tail_size += take;
+		p += take;
+		size -= take;
+		if (hash->tail_size < HWX_HASH_STRIPE) {
+			return;
+		}
+		hwx_hash_stripes(hash, hash->tail, 1);
+		hash->tail_size = 0;
+	}
+
+	hwx_hash_stripes(hash, p, size / HWX_HASH_STRIPE);
+	p += size - size % HWX_HASH_STRIPE;
+	size %= HWX_HASH_STRIPE;
+
+	memcpy(hash->tail, p, size);
+	hash->tail_size = size;
+}
+
+static inline uint64_t hwx_hash_fold(uint64_t a, uint64_t b)
+{
+	const unsigned __int128 product = (unsigned __int128)a * b;
+	return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static inline uint64_t hwx_hash_avalanche(uint64_t h)
+{
+	h ^= h >> 37;
+	h *= 0x165667919E3779F9ULL;
+	h ^= h >> 32;
+	return h;
+}
+
+static void hwx_hash_final(const struct hwx_hash *hash, struct hwx_fingerprint *fingerprint)
+{
+	uint64_t acc[HWX_HASH_LANES];
+	memcpy(acc, hash->acc, sizeof(acc));
+
+	/* Zero padding is disambiguated by the total length below */
+	if (hash->tail_size) {
+		uint8_t last[HWX_HASH_STRIPE] = { 0 };
+		memcpy(last, hash->tail, hash->tail_size);
+		hwx_hash_stripe(acc, last);
+	}
+
+	uint64_t lo = hash->total * 0x9E3779B185EBCA87ULL;
+	uint64_t hi = ~hash->total * 0xC2B2AE3D27D4EB4FULL;
+	for (uint32_t i = 0; i < HWX_HASH_LANES; i += 2) {
+		lo += hwx_hash_fold(acc[i] ^ hwx_hash_secret[i],
+				    acc[i + 1] ^ hwx_hash_secret[i + 1]);
+		hi += hwx_hash_fold(acc[i] ^ hwx_hash_secret[(i + 5u) % HWX_HASH_LANES],
+				    acc[i + 1] ^ hwx_hash_secret[(i + 2u) % HWX_HASH_LANES]);
+	}
+
+	fingerprint->lo = hwx_hash_avalanche(lo);
+	fingerprint->hi = hwx_hash_avalanche(hi ^ fingerprint->lo);
+}
+
+void hwx_fingerprint(const void *data, size_t size, struct hwx_fingerprint *fingerprint)
+{
+	struct hwx_hash hash;
+	hwx_hash_init(&hash);
+	hwx_hash_update(&hash, data, size);
+	hwx_hash_final(&hash, fingerprint);
+}
+
+#define HWX_READ_CHUNK 0x10000u
+
+int hwx_section_fingerprint(const struct hwx_file *file,
+			    const struct hwx_section *section,
+			    struct hwx_fingerprint *fingerprint)
+{
+	if (!file || !section || !fingerprint) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (hwx_validate_read(file, section->offset, section->size) != 0) {
+		return -1;
+	}
+
+	if (file->map) {
+		hwx_fingerprint(file->map + section->offset, (size_t)section->size, fingerprint);
+		return 0;
+	}
+
+	/* Hashed as it is read, in chunks, without holding the whole section */
+	uint8_t *buffer = (uint8_t *)malloc(HWX_READ_CHUNK);
+	if (!buffer) {
+		return -1;
+	}
+
+	struct hwx_hash hash;
+	hwx_hash_init(&hash);
+	for (uint64_t done = 0; done < section->size;) {
+		size_t chunk = HWX_READ_CHUNK;
+		if (chunk > section->size - done) {
+			chunk = (size_t)(section->size - done);
+		}
+		if (hwx_section_read(file, section, done, buffer, chunk) != 0) {
+			int saved_errno = errno;
+			free(buffer);
+			errno = saved_errno;
+			return -1;
+		}
+		hwx_hash_update(&hash, buffer, chunk);
+		done += chunk;
+	}
+	free(buffer);
+
+	hwx_hash_final(&hash, fingerprint);
+	return 0;
+}
+
+#define HWX_SHARED_MODE 0400 /* read-only, and private to its owner */
+
+static int hwx_shared_name(char *path, size_t len, const char *dir,
+			   const struct hwx_fingerprint *fingerprint, uint64_t size)
+{
+	int n = snprintf(path, len, "%s/hwx-%016" PRIx64 "%016" PRIx64 "-%" PRIx64,
+			 dir, fingerprint->hi, fingerprint->lo, size);
+	if (n < 0 || (size_t)n >= len) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Names are predictable and anyone can create one first, so only regular
+ * files of ours with HWX_SHARED_MODE are mapped; anything else is EACCES.
+ */
+static void *hwx_map_shared_object(const char *path, uint64_t size)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (fstat(fd, &st) == 0) {
+		if (!S_ISREG(st.st_mode) || st.st_uid != geteuid() ||
+		    (st.st_mode & 0777) != HWX_SHARED_MODE) {
+			errno = EACCES;
+		} else if ((uint64_t)st.st_size != size) {
+			errno = EEXIST;
+		} else {
+			map = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, fd, 0);
+		}
+	}
+
+	int saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return map == MAP_FAILED ? NULL : map;
+}
+
+/*
+ * The object is filled anonymously (O_TMPFILE) and linked under its final
+ * name only once complete, so other processes never map a partial copy. If
+ * another process wins the race, its object is used and ours is dropped.
+ * Unmapped files are fingerprinted from the filled object, so each section
+ * byte is read once, which is what lets streams be shared too.
+ */
+static void *hwx_create_shared_object(const struct hwx_file *file,
+				      const struct hwx_section *section,
+				      const char *dir, const char *known_path)
+{
+	const size_t size = (size_t)section->size;
+	int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, HWX_SHARED_MODE);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	void *map = MAP_FAILED;
+	if (ftruncate(fd, (off_t)size) == 0) {
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	if (map == MAP_FAILED) {
+		goto err;
+	}
+
+	if (hwx_section_read(file, section, 0, map, size) != 0) {
+		goto err;
+	}
+
+	char path[PATH_MAX];
+	if (known_path) {
+		snprintf(path, sizeof(path), "%s", known_path);
+	} else {
+		struct hwx_fingerprint fingerprint;
+		hwx_fingerprint(map, size, &fingerprint);
+		if (hwx_shared_name(path, sizeof(path), dir, &fingerprint, size) != 0) {
+			goto err;
+		}
+	}
+
+	char proc[32];
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+	if (linkat(AT_FDCWD, proc, AT_FDCWD, path, AT_SYMLINK_FOLLOW) != 0) {
+		if (errno != EEXIST) {
+			goto err;
+		}
+		munmap(map, size);
+		close(fd);
+		return hwx_map_shared_object(path, size);
+	}
+
+	close(fd);
+	if (mprotect(map, size, PROT_READ) != 0) {
+		munmap(map, size);
+		return NULL;
+	}
+	return map;
+
+err:;
+	int saved_errno = errno;
+	if (map != MAP_FAILED) {
+		munmap(map, size);
+	}
+	close(fd);
+	errno = saved_errno;
+	return NULL;
+}
+
+const void *hwx_section_map_shared(const struct hwx_file *file,
+				   const struct hwx_section *section,
+				   const char *dir)
+{
+	if (!file || !section || !dir || section->size == 0 || section->size > SIZE_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (hwx_validate_read(file, section->offset, section->size) != 0) {
+		return NULL;
+	}
+
+	if (!file->map) {
+		return hwx_create_shared_object(file, section, dir, NULL);
+	}
+
+	/* Mapped sections are cheap to hash up front; a hit needs no copy */
+	struct hwx_fingerprint fingerprint;
+	char path[PATH_MAX];
+	hwx_fingerprint(file->map + section->offset, (size_t)section->size, &fingerprint);
+	if (hwx_shared_name(path, sizeof(path), dir, &fingerprint, section->size) != 0) {
+		return NULL;
+	}
+
+	void *map = hwx_map_shared_object(path, section->size);
+	if (map || errno != ENOENT) {
+		return map;
+	}
+
+	return hwx_create_shared_object(file, section, dir, path);
+}
+
+static int hwx_write_exact(int fd, const void *buffer, size_t size)
+{
+	size_t total = 0;
+	const char *src = (const char *)buffer;
+
+	while (total < size) {
+		ssize_t written = write(fd, src + total, size - total);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		total += (size_t)written;
+	}
+
+	return 0;
+}
+
+static int hwx_validate_patch(const struct hwx_file *file, const struct hwx_patch *patch)
+{
+	const struct hwx_section *section = patch->section;
+	if (!section || (!patch->data && patch->size > 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (patch->offset > section->size || patch->size > section->size - patch->offset) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return hwx_validate_read(file, section->offset, section->size);
+}
+
+/* Copies the part of patch that overlaps [offset, offset + size) into buffer */
+static void hwx_apply_patch(const struct hwx_patch *patch, uint8_t *buffer,
+			    uint64_t offset, size_t size)
+{
+	const uint64_t start = (uint64_t)patch->section->offset + patch->offset;
+	const uint64_t end = start + patch->size;
+	if (end <= offset || start >= offset + size) {
+		return;
+	}
+
+	const uint64_t from = start > offset ? start : offset;
+	const uint64_t to = end < offset + size ? end : offset + size;
+	memcpy(buffer + (from - offset),
+	       (const uint8_t *)patch->data + (from - start), (size_t)(to - from));
+}
+
+/*
+ * The image is copied through chunk by chunk rather than re-emitted from the
+ * parsed load commands, so padding, unknown commands and anything else libane
+ * does not model come out exactly as they went in.
+ */
+int hwx_write(const struct hwx_file *file, int fd,
+	      const struct hwx_patch *patches, uint32_t patch_count)
+{
+	if (!file || fd < 0 || (!patches && patch_count > 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* The header and load commands have already been consumed */
+	if (file->stream) {
+		errno = ESPIPE;
+		return -1;
+	}
+
+	for (uint32_t i = 0; i < patch_count; ++i) {
+		if (hwx_validate_patch(file, &patches[i]) != 0) {
+			return -1;
+		}
+	}
+
+	uint8_t *buffer = (uint8_t *)malloc(HWX_READ_CHUNK);
+	if (!buffer) {
+		return -1;
+	}
+
+	for (uint64_t done = 0; done < file->file_size;) {
+		size_t chunk = HWX_READ_CHUNK;
+		if (chunk > file->file_size - done) {
+			chunk = (size_t)(file->file_size - done);
+		}
+		if (hwx_read_bytes(file, buffer, chunk, done) != 0) {
+			goto err;
+		}
+		for (uint32_t i = 0; i < patch_count; ++i) {
+			hwx_apply_patch(&patches[i], buffer, done, chunk);
+		}
+		if (hwx_write_exact(fd, buffer, chunk) != 0) {
+			goto err;
+		}
+		done += chunk;
+	}
+
+	free(buffer);
+	return 0;
+
+err:;
+	int saved_errno = errno;
+	free(buffer);
+	errno = saved_errno;
+	return -1;
 }
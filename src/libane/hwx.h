@@ -73,7 +73,7 @@ struct hwx_thread_state {
 	uint32_t flavor;
 	uint32_t count;
 	uint32_t byte_size;
-	uint8_t *data;
+	const uint8_t *data; /* view into the load commands, valid until hwx_close() */
 };
 
 enum hwx_thread_flavor {
@@ -113,6 +113,16 @@ struct hwx_ane_seg_state {
 struct hwx_file;
 
 struct hwx_file *hwx_open(const char *path);
+struct hwx_file *hwx_open_mapped(const char *path);
+// Maps the whole file behind fd; the descriptor is not consumed.
+struct hwx_file *hwx_open_fd(int fd);
+// Reads a pipe, socket or other non-seekable fd front to back; the descriptor
+// is not consumed. Only the load commands are kept in memory. Segment and
+// section reads must come in increasing file order; gaps are skipped and
+// earlier offsets fail with ESPIPE.
+struct hwx_file *hwx_open_stream(int fd);
+// Parses data in place; it must stay valid until hwx_close().
+struct hwx_file *hwx_open_memory(const void *data, size_t size);
 void hwx_close(struct hwx_file *file);
 
 const struct MachHeader64 *hwx_header(const struct hwx_file *file);
@@ -135,6 +145,43 @@ const struct hwx_thread_state *hwx_thread_state_next(const struct hwx_file *file
 int hwx_segment_read(const struct hwx_file *file, const struct hwx_segment *segment, uint64_t offset, void *buffer, size_t size);
 int hwx_section_read(const struct hwx_file *file, const struct hwx_section *section, uint64_t offset, void *buffer, size_t size);
 
+// Only available for files opened with hwx_open_mapped(), hwx_open_fd() or
+// hwx_open_memory(); the returned pointers stay valid until hwx_close().
+// Fails with ENOTSUP otherwise.
+const void *hwx_segment_data(const struct hwx_file *file, const struct hwx_segment *segment);
+const void *hwx_section_data(const struct hwx_file *file, const struct hwx_section *section);
+
+// Non-cryptographic 128-bit content hash. Equal bytes give equal fingerprints
+// in every process, so callers can use it to dedupe sections across models.
+struct hwx_fingerprint {
+	uint64_t lo;
+	uint64_t hi;
+};
+
+void hwx_fingerprint(const void *data, size_t size, struct hwx_fingerprint *fingerprint);
+// Streams are hashed as they are read, which consumes the section.
+int hwx_section_fingerprint(const struct hwx_file *file, const struct hwx_section *section, struct hwx_fingerprint *fingerprint);
+
+// Maps the section read-only from a file in dir (normally a tmpfs such as
+// /dev/shm) named after its fingerprint, creating it if no process has yet.
+// Every process of one user mapping the same bytes then shares one copy. A file
+// under that name that is not ours with mode 0400 fails with EACCES. The file
+// outlives the process; release the mapping with munmap(ptr, section->size).
+const void *hwx_section_map_shared(const struct hwx_file *file, const struct hwx_section *section, const char *dir);
+
+// Replaces size bytes at offset within section when the image is written.
+struct hwx_patch {
+	const struct hwx_section *section;
+	uint64_t offset;
+	const void *data;
+	size_t size;
+};
+
+// Writes the whole image to fd with patches applied in order; every other
+// byte is copied unchanged, so no patches gives back the input exactly.
+// Fails with ESPIPE for files opened with hwx_open_stream().
+int hwx_write(const struct hwx_file *file, int fd, const struct hwx_patch *patches, uint32_t patch_count);
+
 #ifdef __cplusplus
 }
 #endif
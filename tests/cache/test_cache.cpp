@@ -0,0 +1,258 @@
+// SPDX-License-Identifier: MIT
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <libane/ane.h>
+#include <libane/ane_cache.h>
+#include <libane/hwx.h>
+
+/* Models with a SEG_STATE, the only ones ane_model_load() resolves */
+static const char *const HWX_PATHS[] = {
+	"data/matmul_h14.hwx",
+	"data/matmul_h15.hwx",
+};
+
+static std::vector<uint8_t> read_file(const char *path)
+{
+	std::vector<uint8_t> data;
+	FILE *fp = fopen(path, "rb");
+	if (!fp) {
+		return data;
+	}
+	uint8_t buffer[4096];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+		data.insert(data.end(), buffer, buffer + n);
+	}
+	fclose(fp);
+	return data;
+}
+
+class test_cache : public ::testing::Test {
+protected:
+	void SetUp() override {
+		char tmpl[] = "/tmp/ane-cache-XXXXXX";
+		ASSERT_NE(mkdtemp(tmpl), nullptr);
+		dir = tmpl;
+		ASSERT_EQ(ane_cache_set_dir(dir.c_str()), 0);
+		ane_cache_reset_stats();
+	}
+
+	void TearDown() override {
+		ane_cache_set_dir(NULL);
+		std::filesystem::remove_all(dir);
+	}
+
+	std::string dir;
+};
+
+static void expect_same_model(const struct ane_model *a, const struct ane_model *b)
+{
+	EXPECT_EQ(a->size, b->size);
+	EXPECT_EQ(a->td_size, b->td_size);
+	EXPECT_EQ(a->td_count, b->td_count);
+	EXPECT_EQ(a->tsk_size, b->tsk_size);
+	EXPECT_EQ(a->krn_size, b->krn_size);
+	EXPECT_EQ(a->src_count, b->src_count);
+	EXPECT_EQ(a->dst_count, b->dst_count);
+	EXPECT_EQ(std::memcmp(a->tiles, b->tiles, sizeof(a->tiles)), 0);
+	EXPECT_EQ(std::memcmp(a->nchw, b->nchw, sizeof(a->nchw)), 0);
+	EXPECT_EQ(std::memcmp(a->src_plans, b->src_plans, sizeof(a->src_plans)), 0);
+	EXPECT_EQ(std::memcmp(a->dst_plans, b->dst_plans, sizeof(a->dst_plans)), 0);
+	ASSERT_EQ(a->btsp_size, b->btsp_size);
+	EXPECT_EQ(std::memcmp(a->btsp, b->btsp, a->btsp_size), 0);
+}
+
+TEST_F(test_cache, test_warm_matches_cold) {
+	for (const char *path : HWX_PATHS) {
+		std::vector<uint8_t> image = read_file(path);
+		ASSERT_FALSE(image.empty()) << path;
+
+		struct ane_model cold, stored, warm;
+		ASSERT_EQ(ane_cache_set_dir(NULL), 0);
+		ASSERT_EQ(ane_model_load(&cold, image.data(), image.size()), 0) << path;
+		EXPECT_NE(cold.hwx, nullptr);
+
+		ASSERT_EQ(ane_cache_set_dir(dir.c_str()), 0);
+		ASSERT_EQ(ane_model_load(&stored, image.data(), image.size()), 0) << path;
+		ASSERT_EQ(ane_model_load(&warm, image.data(), image.size()), 0) << path;
+		EXPECT_NE(stored.hwx, nullptr);
+		/* Warm loads never touch the HWX parser */
+		EXPECT_EQ(warm.hwx, nullptr);
+		EXPECT_NE(warm.cache, nullptr);
+
+		expect_same_model(&cold, &warm);
+
+		ane_model_unload(&warm);
+		ane_model_unload(&stored);
+		ane_model_unload(&cold);
+	}
+
+	struct ane_cache_stats stats;
+	ane_cache_get_stats(&stats);
+	EXPECT_EQ(stats.hits, std::size(HWX_PATHS));
+	EXPECT_EQ(stats.misses, std::size(HWX_PATHS));
+}
+
+TEST_F(test_cache, test_stale_entry) {
+	std::vector<uint8_t> image = read_file("data/matmul_h14.hwx");
+	ASSERT_FALSE(image.empty());
+
+	struct ane_model model;
+	ASSERT_EQ(ane_model_load(&model, image.data(), image.size()), 0);
+	ane_model_unload(&model);
+
+	/* Corrupt every entry; lookups must miss and rewrite them */
+	for (const auto &entry : std::filesystem::directory_iterator(dir)) {
+		std::filesystem::resize_file(entry.path(), 16);
+	}
+	ASSERT_EQ(ane_model_load(&model, image.data(), image.size()), 0);
+	EXPECT_NE(model.hwx, nullptr);
+	ane_model_unload(&model);
+
+	/* A different image must not pick up this entry */
+	std::vector<uint8_t> other = read_file("data/matmul_h15.hwx");
+	ASSERT_EQ(ane_model_load(&model, other.data(), other.size()), 0);
+	EXPECT_NE(model.hwx, nullptr);
+	ane_model_unload(&model);
+
+	ASSERT_EQ(ane_model_load(&model, image.data(), image.size()), 0);
+	EXPECT_EQ(model.hwx, nullptr);
+	ane_model_unload(&model);
+
+	struct ane_cache_stats stats;
+	ane_cache_get_stats(&stats);
+	EXPECT_EQ(stats.hits, 1u);
+	EXPECT_EQ(stats.misses, 3u);
+}
+
+/* Entries whose plans or shapes leave their channel are misses */
+TEST_F(test_cache, test_entry_out_of_bounds) {
+	std::vector<uint8_t> image = read_file("data/matmul_h14.hwx");
+	ASSERT_FALSE(image.empty());
+
+	struct ane_model model;
+	ASSERT_EQ(ane_model_load(&model, image.data(), image.size()), 0);
+	ane_model_unload(&model);
+
+	auto entries = std::filesystem::directory_iterator(dir);
+	const std::filesystem::path path = entries->path();
+	std::vector<uint8_t> original = read_file(path.c_str());
+	ASSERT_GE(original.size(), sizeof(struct ane_cache_header));
+
+	const std::function<void(struct ane_cache_header *)> tampers[] = {
+		[](struct ane_cache_header *h) { h->tiles[h->src_plans[0].bdx] = 0; },
+		[](struct ane_cache_header *h) { h->src_plans[0].copies[0].tile_offset += 1 << 14; },
+		[](struct ane_cache_header *h) { h->dst_plans[0].copies[0].data_offset += 2; },
+		[](struct ane_cache_header *h) { h->dst_plans[0].copies[0].planes = 0; },
+		[](struct ane_cache_header *h) { h->src_plans[0].clear = UINT32_MAX; },
+		[](struct ane_cache_header *h) { h->nchw[h->dst_plans[0].bdx][1] <<= 20; },
+		[](struct ane_cache_header *h) { h->nchw[h->src_plans[0].bdx][4] = 2; },
+	};
+	for (size_t i = 0; i < std::size(tampers); i++) {
+		SCOPED_TRACE(i);
+		std::vector<uint8_t> entry = original;
+		tampers[i](reinterpret_cast<struct ane_cache_header *>(entry.data()));
+		FILE *fp = fopen(path.c_str(), "wb");
+		ASSERT_NE(fp, nullptr);
+		ASSERT_EQ(fwrite(entry.data(), 1, entry.size(), fp), entry.size());
+		fclose(fp);
+
+		ane_cache_reset_stats();
+		ASSERT_EQ(ane_model_load(&model, image.data(), image.size()), 0);
+		EXPECT_NE(model.hwx, nullptr);
+		ane_model_unload(&model);
+
+		struct ane_cache_stats stats;
+		ane_cache_get_stats(&stats);
+		EXPECT_EQ(stats.hits, 0u);
+		EXPECT_EQ(stats.misses, 1u);
+	}
+
+	/* The rewritten entry is sound again */
+	ASSERT_EQ(ane_model_load(&model, image.data(), image.size()), 0);
+	EXPECT_EQ(model.hwx, nullptr);
+	ane_model_unload(&model);
+}
+
+TEST_F(test_cache, test_key_covers_layout) {
+	std::vector<uint8_t> image = read_file("data/matmul_h14.hwx");
+	ASSERT_FALSE(image.empty());
+
+	struct hwx_file *hwx = hwx_open_memory(image.data(), image.size());
+	ASSERT_NE(hwx, nullptr);
+	const uint64_t tsk_offset = hwx_get_tsk_section(hwx)->offset;
+	const uint64_t krn_offset = hwx_get_krn_section(hwx)->offset;
+	hwx_close(hwx);
+
+	struct ane_model model;
+	ASSERT_EQ(ane_model_load(&model, image.data(), image.size()), 0);
+	ane_model_unload(&model);
+
+	/* Weights do not change the resolved model */
+	image[krn_offset] ^= 0xFF;
+	ASSERT_EQ(ane_model_load(&model, image.data(), image.size()), 0);
+	EXPECT_EQ(model.hwx, nullptr);
+	ane_model_unload(&model);
+
+	/* A TD tuned in place, as ane-opt does, does */
+	image[tsk_offset + 4] ^= 0xFF;
+	ASSERT_EQ(ane_model_load(&model, image.data(), image.size()), 0);
+	EXPECT_NE(model.hwx, nullptr);
+	EXPECT_EQ(std::memcmp(model.btsp, image.data() + tsk_offset, model.btsp_size), 0);
+	ane_model_unload(&model);
+
+	/* The rewritten entry holds the tuned TD */
+	ASSERT_EQ(ane_model_load(&model, image.data(), image.size()), 0);
+	EXPECT_EQ(model.hwx, nullptr);
+	EXPECT_EQ(std::memcmp(model.btsp, image.data() + tsk_offset, model.btsp_size), 0);
+	ane_model_unload(&model);
+
+	/* So do the header and load commands */
+	image[offsetof(struct MachHeader64, reserved)] ^= 0xFF;
+	ASSERT_EQ(ane_model_load(&model, image.data(), image.size()), 0);
+	EXPECT_NE(model.hwx, nullptr);
+	ane_model_unload(&model);
+
+	struct ane_cache_stats stats;
+	ane_cache_get_stats(&stats);
+	EXPECT_EQ(stats.hits, 2u);
+	EXPECT_EQ(stats.misses, 3u);
+}
+
+TEST_F(test_cache, bench_cold_warm) {
+	const int iterations = 20000;
+
+	for (const char *path : HWX_PATHS) {
+		std::vector<uint8_t> image = read_file(path);
+		ASSERT_FALSE(image.empty()) << path;
+
+		double us[2];
+		for (int warm = 0; warm < 2; warm++) {
+			ASSERT_EQ(ane_cache_set_dir(warm ? dir.c_str() : NULL), 0);
+			struct ane_model model;
+			/* Populates the cache in the warm pass */
+			ASSERT_EQ(ane_model_load(&model, image.data(), image.size()), 0);
+			ane_model_unload(&model);
+
+			const auto start = std::chrono::steady_clock::now();
+			for (int i = 0; i < iterations; i++) {
+				ASSERT_EQ(ane_model_load(&model, image.data(), image.size()), 0);
+				ane_model_unload(&model);
+			}
+			const auto elapsed = std::chrono::steady_clock::now() - start;
+			us[warm] = std::chrono::duration<double, std::micro>(elapsed).count() / iterations;
+		}
+		printf("model init %s (%zu bytes): cold %8.2f us, warm %8.2f us\n",
+		       path, image.size(), us[0], us[1]);
+	}
+}
@@ -0,0 +1,136 @@
+// SPDX-License-Identifier: MIT
+
+#include <cerrno>
+#include <vector>
+
+#include <poll.h>
+
+#include <gtest/gtest.h>
+
+#include <libane/ane.h>
+
+class test_exec : public ::testing::Test {
+protected:
+	void SetUp() override {
+		ASSERT_EQ(ane_set_backend(ANE_BACKEND_MOCK), 0);
+	}
+
+	void TearDown() override {
+		ane_set_backend(ANE_BACKEND_DRM);
+	}
+};
+
+TEST_F(test_exec, test_exec_sync) {
+	struct ane_nn *nn = ane_init("data/matmul_h14.hwx");
+	ASSERT_NE(nn, nullptr);
+
+	EXPECT_EQ(ane_exec(nn), 0);
+	EXPECT_EQ(ane_exec(nn), 0);
+
+	ane_free(nn);
+}
+
+TEST_F(test_exec, test_exec_async) {
+	const int count = 4;
+	std::vector<struct ane_nn *> nns(count);
+	std::vector<struct ane_fence> fences(count);
+
+	for (int i = 0; i < count; i++) {
+		nns[i] = ane_init("data/matmul_h14.hwx");
+		ASSERT_NE(nns[i], nullptr);
+	}
+
+	/* One thread keeps every request in flight */
+	for (int i = 0; i < count; i++) {
+		ASSERT_EQ(ane_exec_async(nns[i], &fences[i]), 0);
+		EXPECT_GE(fences[i].fd, 0);
+	}
+
+	std::vector<struct pollfd> pfds(count);
+	for (int i = 0; i < count; i++) {
+		pfds[i] = { .fd = fences[i].fd, .events = POLLIN, .revents = 0 };
+	}
+	int ready = 0;
+	while (ready < count) {
+		int n = poll(pfds.data(), count, 5000);
+		ASSERT_GT(n, 0);
+		ready = 0;
+		for (const auto &pfd : pfds) {
+			ready += (pfd.revents & POLLIN) != 0;
+		}
+	}
+
+	for (int i = 0; i < count; i++) {
+		EXPECT_EQ(ane_fence_wait(&fences[i], 0), 0);
+		/* Waiting again on a signaled fence is fine */
+		EXPECT_EQ(ane_fence_wait(&fences[i], -1), 0);
+		ane_fence_close(&fences[i]);
+		EXPECT_EQ(fences[i].fd, -1);
+		EXPECT_EQ(ane_fence_wait(&fences[i], 0), -EINVAL);
+	}
+
+	for (struct ane_nn *nn : nns) {
+		ane_free(nn);
+	}
+}
+
+TEST_F(test_exec, test_free_in_flight) {
+	struct ane_nn *nn = ane_init("data/matmul_h14.hwx");
+	ASSERT_NE(nn, nullptr);
+
+	/* Requests are ordered, so the last fence covers every earlier one */
+	struct ane_fence fences[8];
+	for (auto &fence : fences) {
+		ASSERT_EQ(ane_exec_async(nn, &fence), 0);
+	}
+	EXPECT_EQ(ane_fence_wait(&fences[7], -1), 0);
+	for (int i = 0; i < 7; i++) {
+		EXPECT_EQ(ane_fence_wait(&fences[i], 0), 0);
+	}
+
+	/* Closing a fence early or freeing nn with requests queued is fine */
+	struct ane_fence pending;
+	ASSERT_EQ(ane_exec_async(nn, &pending), 0);
+	ane_fence_close(&pending);
+	ASSERT_EQ(ane_exec_async(nn, &pending), 0);
+	ane_free(nn);
+
+	EXPECT_EQ(ane_fence_wait(&pending, -1), 0);
+	ane_fence_close(&pending);
+	for (auto &fence : fences) {
+		ane_fence_close(&fence);
+	}
+}
+
+TEST_F(test_exec, test_device) {
+	ASSERT_EQ(ane_device_count(), 2);
+	EXPECT_EQ(ane_device_get(2), nullptr);
+	EXPECT_EQ(ane_device_get(-1), nullptr);
+
+	/* Enumeration is cached: the same device every time */
+	const struct ane_device *device = ane_device_get(1);
+	ASSERT_NE(device, nullptr);
+	EXPECT_EQ(ane_device_get(1), device);
+	EXPECT_EQ(device->dev_id, 1);
+	EXPECT_STREQ(device->node, "mock1");
+
+	struct ane_nn *nns[2];
+	for (auto &nn : nns) {
+		nn = ane_init_on(device, "data/matmul_h14.hwx");
+		ASSERT_NE(nn, nullptr);
+	}
+	EXPECT_EQ(ane_init_on(NULL, "data/matmul_h14.hwx"), nullptr);
+
+	/* Both share the device, so they can go in one batch */
+	EXPECT_EQ(ane_exec_batch(nns, 2), 0);
+
+	struct ane_nn *other = ane_init("data/matmul_h14.hwx");
+	ASSERT_NE(other, nullptr);
+	struct ane_nn *mixed[] = { nns[0], other };
+	EXPECT_EQ(ane_exec_batch(mixed, 2), -EXDEV);
+
+	ane_free(other);
+	for (auto &nn : nns) {
+		ane_free(nn);
+	}
+}
@@ -0,0 +1,198 @@
+// SPDX-License-Identifier: MIT
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <libane/ane.h>
+#include <libane/ane_f16.h>
+
+class test_executor : public ::testing::Test {
+protected:
+	void SetUp() override {
+		ASSERT_EQ(ane_set_backend(ANE_BACKEND_MOCK), 0);
+		ane_mock_set_config(NULL);
+	}
+
+	void TearDown() override {
+		ane_mock_set_config(NULL);
+		ane_set_backend(ANE_BACKEND_DRM);
+	}
+};
+
+/* CPU reference of matmul_h14 through channel views: C = A (2x3) * B (3x2) */
+static void matmul_reference(struct ane_nn *nn, void *arg)
+{
+	struct ane_map A, B, C;
+	ASSERT_EQ(ane_src_map(nn, 0, &A), 0);
+	ASSERT_EQ(ane_src_map(nn, 1, &B), 0);
+	ASSERT_EQ(ane_dst_map(nn, 0, &C), 0);
+
+	for (uint32_t i = 0; i < 2; i++) {
+		for (uint32_t j = 0; j < 2; j++) {
+			float sum = 0;
+			for (uint32_t k = 0; k < 3; k++) {
+				sum += ane_compute_f16_to_f32(*ane_map_at(&A, 0, i, 0, k)) *
+				       ane_compute_f16_to_f32(*ane_map_at(&B, 0, k, 0, j));
+			}
+			*ane_map_at(&C, 0, i, 0, j) = ane_compute_f32_to_f16(sum);
+		}
+	}
+	(void)arg;
+}
+
+/* One request: A = [1 2 3; 4 5 6], B = [b 0; 0 1; 0 0] */
+struct matmul_infer {
+	uint16_t A[6], B[6], C[4];
+	void *inputs[2];
+	void *outputs[1];
+	struct ane_infer infer;
+
+	void init(uint32_t model, float b) {
+		const float a[6] = { 1, 2, 3, 4, 5, 6 };
+		const float bb[6] = { b, 0, 0, 1, 0, 0 };
+		ane_f32_to_f16_row(a, A, 6);
+		ane_f32_to_f16_row(bb, B, 6);
+		inputs[0] = A;
+		inputs[1] = B;
+		outputs[0] = C;
+		infer = {};
+		infer.model = model;
+		infer.inputs = inputs;
+		infer.outputs = outputs;
+	}
+};
+
+TEST_F(test_executor, test_concurrent_clients) {
+	const struct ane_mock_config config = { 50, matmul_reference, NULL, 0 };
+	ane_mock_set_config(&config);
+
+	struct ane_executor *ex = ane_executor_create(3, 0);
+	ASSERT_NE(ex, nullptr);
+	struct ane_nn *nn = ane_init("data/matmul_h14.hwx");
+	ASSERT_NE(nn, nullptr);
+	ASSERT_EQ(ane_executor_add(ex, nn, 3), 0);
+
+	const int clients = 4;
+	const int requests = 50;
+	std::atomic<int> failures = 0;
+	std::vector<std::thread> threads;
+	for (int t = 0; t < clients; t++) {
+		threads.emplace_back([&, t] {
+			matmul_infer r;
+			for (int i = 0; i < requests; i++) {
+				const float b = (float)(t * requests + i % 8);
+				r.init(0, b);
+				if (ane_executor_submit(ex, &r.infer) != 0 ||
+				    ane_executor_wait(&r.infer) != 0 ||
+				    ane_compute_f16_to_f32(r.C[0]) != b ||
+				    ane_compute_f16_to_f32(r.C[2]) != 4 * b ||
+				    ane_compute_f16_to_f32(r.C[3]) != 5 ||
+				    r.infer.latency_ns < r.infer.queue_ns ||
+				    r.infer.latency_ns < 50000) {
+					failures++;
+				}
+			}
+		});
+	}
+	for (auto &thread : threads) {
+		thread.join();
+	}
+	EXPECT_EQ(failures, 0);
+
+	ane_executor_destroy(ex);
+}
+
+TEST_F(test_executor, test_submit) {
+	const struct ane_mock_config config = { 20000, NULL, NULL, 0 };
+	ane_mock_set_config(&config);
+
+	struct ane_executor *ex = ane_executor_create(1, 2);
+	ASSERT_NE(ex, nullptr);
+
+	matmul_infer r[4];
+	r[0].init(0, 1);
+	EXPECT_EQ(ane_executor_submit(ex, &r[0].infer), -EINVAL);
+	EXPECT_EQ(ane_executor_add(ex, NULL, 1), -EINVAL);
+
+	struct ane_nn *nn = ane_init("data/matmul_h14.hwx");
+	ASSERT_NE(nn, nullptr);
+	EXPECT_EQ(ane_executor_add(ex, nn, 0), -EINVAL);
+	ASSERT_EQ(ane_executor_add(ex, nn, 1), 0);
+
+	/* Two fit in the queue, plus the one the worker may have taken */
+	std::atomic<int> done = 0;
+	int accepted = 0;
+	for (auto &req : r) {
+		req.init(0, 1);
+		req.infer.done = [](struct ane_infer *infer, void *arg) {
+			EXPECT_EQ(infer->status, 0);
+			(*(std::atomic<int> *)arg)++;
+		};
+		req.infer.arg = &done;
+		int err = ane_executor_submit(ex, &req.infer);
+		if (err == -EAGAIN) {
+			break;
+		}
+		ASSERT_EQ(err, 0);
+		accepted++;
+	}
+	EXPECT_GE(accepted, 2);
+	EXPECT_LE(accepted, 3);
+
+	/* Queued requests finish before the executor goes */
+	ane_executor_destroy(ex);
+	EXPECT_EQ(done, accepted);
+}
+
+TEST_F(test_executor, bench_executor) {
+	const uint32_t latency_us = 100;
+	const int requests = 400;
+	const struct ane_mock_config config = { latency_us, NULL, NULL, 0 };
+	ane_mock_set_config(&config);
+
+	for (uint32_t instances : { 1u, 2u, 4u }) {
+		struct ane_executor *ex = ane_executor_create((int)instances, 0);
+		ASSERT_NE(ex, nullptr);
+		struct ane_nn *nn = ane_init("data/matmul_h14.hwx");
+		ASSERT_NE(nn, nullptr);
+		ASSERT_EQ(ane_executor_add(ex, nn, instances), 0);
+
+		const int clients = 4;
+		std::vector<std::vector<uint64_t>> latencies(clients);
+		std::vector<std::thread> threads;
+		const auto start = std::chrono::steady_clock::now();
+		for (int t = 0; t < clients; t++) {
+			threads.emplace_back([&, t] {
+				matmul_infer r;
+				for (int i = 0; i < requests / clients; i++) {
+					r.init(0, 1);
+					ASSERT_EQ(ane_executor_submit(ex, &r.infer), 0);
+					ASSERT_EQ(ane_executor_wait(&r.infer), 0);
+					latencies[t].push_back(r.infer.latency_ns);
+				}
+			});
+		}
+		for (auto &thread : threads) {
+			thread.join();
+		}
+		const auto elapsed = std::chrono::steady_clock::now() - start;
+
+		std::vector<uint64_t> all;
+		for (const auto &l : latencies) {
+			all.insert(all.end(), l.begin(), l.end());
+		}
+		std::sort(all.begin(), all.end());
+		const double s = std::chrono::duration<double>(elapsed).count();
+		printf("%u instance(s), %d clients: %8.0f req/s, latency p50 %7.1f us, p99 %7.1f us (device %u us)\n",
+		       instances, clients, all.size() / s, all[all.size() / 2] / 1e3,
+		       all[all.size() * 99 / 100] / 1e3, latency_us);
+
+		ane_executor_destroy(ex);
+	}
+}
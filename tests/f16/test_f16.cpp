@@ -0,0 +1,161 @@
+// SPDX-License-Identifier: MIT
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <libane/ane_f16.h>
+
+static const enum ane_f16_isa isas[] = {
+	ANE_F16_ISA_SCALAR,
+	ANE_F16_ISA_NEON,
+	ANE_F16_ISA_F16C,
+	ANE_F16_ISA_AVX512,
+};
+
+static const char *isa_name(enum ane_f16_isa isa)
+{
+	switch (isa) {
+	case ANE_F16_ISA_SCALAR: return "scalar";
+	case ANE_F16_ISA_NEON: return "neon";
+	case ANE_F16_ISA_F16C: return "f16c";
+	case ANE_F16_ISA_AVX512: return "avx512";
+	default: return "auto";
+	}
+}
+
+static uint32_t f32_bits(float f)
+{
+	uint32_t bits;
+	std::memcpy(&bits, &f, sizeof(bits));
+	return bits;
+}
+
+class test_f16 : public ::testing::Test {
+protected:
+	void TearDown() override {
+		ane_f16_set_isa(ANE_F16_ISA_AUTO);
+	}
+};
+
+TEST_F(test_f16, test_dispatch) {
+	EXPECT_EQ(ane_f16_set_isa(ANE_F16_ISA_SCALAR), 0);
+	EXPECT_EQ(ane_f16_get_isa(), ANE_F16_ISA_SCALAR);
+	EXPECT_EQ(ane_f16_set_isa((enum ane_f16_isa)99), -ENOTSUP);
+	EXPECT_EQ(ane_f16_get_isa(), ANE_F16_ISA_SCALAR);
+
+	ASSERT_EQ(ane_f16_set_isa(ANE_F16_ISA_AUTO), 0);
+	EXPECT_NE(ane_f16_get_isa(), ANE_F16_ISA_AUTO);
+#if defined(__aarch64__)
+	EXPECT_EQ(ane_f16_get_isa(), ANE_F16_ISA_NEON);
+#endif
+}
+
+/* Every converter matches the scalar code, at every length around a vector */
+TEST_F(test_f16, test_matches_scalar) {
+	/* Every fp16 value */
+	std::vector<uint16_t> h(65536);
+	for (uint32_t i = 0; i < h.size(); i++) {
+		h[i] = (uint16_t)i;
+	}
+	std::vector<float> expected(h.size());
+	ane_f16_to_f32_row_scalar(h.data(), expected.data(), h.size());
+
+	/* Random floats over the fp16 range and beyond, and rounding edges */
+	std::mt19937 rng(1);
+	std::vector<float> f;
+	for (int i = 0; i < 65536; i++) {
+		f.push_back(std::ldexp(std::uniform_real_distribution<float>(-1, 1)(rng),
+				       std::uniform_int_distribution<int>(-30, 20)(rng)));
+	}
+	/* Exactly halfway between neighbouring fp16s, which is exact in fp32 */
+	for (uint32_t i = 0; i < 0x7bff; i++) {
+		const float mid = (expected[i] + expected[i + 1]) * 0.5f;
+		f.push_back(mid);
+		f.push_back(-mid);
+	}
+	f.push_back(65520.0f);
+	f.push_back(65519.0f);
+	f.push_back(1e-8f);
+	f.push_back(-0.0f);
+	f.push_back(INFINITY);
+	std::vector<uint16_t> expected_h(f.size());
+	ane_f32_to_f16_row_scalar(f.data(), expected_h.data(), f.size());
+
+	for (enum ane_f16_isa isa : isas) {
+		if (ane_f16_set_isa(isa) < 0) {
+			continue;
+		}
+
+		std::vector<float> y(h.size());
+		ane_f16_to_f32_row(h.data(), y.data(), h.size());
+		for (uint32_t i = 0; i < h.size(); i++) {
+			if (std::isnan(expected[i])) {
+				EXPECT_TRUE(std::isnan(y[i])) << isa_name(isa) << " " << i;
+			} else {
+				ASSERT_EQ(f32_bits(y[i]), f32_bits(expected[i])) << isa_name(isa) << " " << i;
+			}
+		}
+
+		std::vector<uint16_t> yh(f.size());
+		ane_f32_to_f16_row(f.data(), yh.data(), f.size());
+		for (uint32_t i = 0; i < f.size(); i++) {
+			ASSERT_EQ(yh[i], expected_h[i]) << isa_name(isa) << " " << f[i];
+		}
+
+		/* Tails must not touch what follows the row */
+		for (uint64_t n = 0; n <= 40; n++) {
+			std::vector<float> row(n + 1, 123.0f);
+			ane_f16_to_f32_row(h.data() + 0x3c00, row.data(), n);
+			EXPECT_EQ(row[n], 123.0f) << isa_name(isa) << " " << n;
+			for (uint64_t i = 0; i < n; i++) {
+				EXPECT_EQ(row[i], expected[0x3c00 + i]) << isa_name(isa) << " " << n;
+			}
+
+			std::vector<uint16_t> rowh(n + 1, 0xabcd);
+			ane_f32_to_f16_row(f.data(), rowh.data(), n);
+			EXPECT_EQ(rowh[n], 0xabcd) << isa_name(isa) << " " << n;
+			for (uint64_t i = 0; i < n; i++) {
+				EXPECT_EQ(rowh[i], expected_h[i]) << isa_name(isa) << " " << n;
+			}
+		}
+	}
+}
+
+TEST_F(test_f16, bench_f16) {
+	for (uint64_t n : { 1ull << 10, 1ull << 14, 1ull << 18, 1ull << 22 }) {
+		std::vector<uint16_t> h(n, 0x3c00);
+		std::vector<float> f(n, 1.0f);
+		const int reps = (int)std::max<uint64_t>(1, (1ull << 26) / n);
+
+		for (enum ane_f16_isa isa : isas) {
+			if (ane_f16_set_isa(isa) < 0) {
+				continue;
+			}
+
+			/* Bytes read plus bytes written */
+			const double bytes = (double)n * (sizeof(uint16_t) + sizeof(float)) * reps;
+			auto start = std::chrono::steady_clock::now();
+			for (int r = 0; r < reps; r++) {
+				ane_f16_to_f32_row(h.data(), f.data(), n);
+			}
+			const double to_f32 = bytes / std::chrono::duration<double>(
+				std::chrono::steady_clock::now() - start).count() / 1e9;
+
+			start = std::chrono::steady_clock::now();
+			for (int r = 0; r < reps; r++) {
+				ane_f32_to_f16_row(f.data(), h.data(), n);
+			}
+			const double to_f16 = bytes / std::chrono::duration<double>(
+				std::chrono::steady_clock::now() - start).count() / 1e9;
+
+			printf("%8llu elements %-7s f16->f32 %7.2f GB/s, f32->f16 %7.2f GB/s\n",
+			       (unsigned long long)n, isa_name(isa), to_f32, to_f16);
+		}
+	}
+}
@@ -0,0 +1,546 @@
+// SPDX-License-Identifier: MIT
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <thread>
+#include <vector>
+
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include <libane/hwx.h>
+#include <libane/td_v5.h>
+
+static const char *const HWX_PATHS[] = {
+	"data/matmul_h11.hwx",
+	"data/matmul_h12.hwx",
+	"data/matmul_h13.hwx",
+	"data/matmul_h14.hwx",
+	"data/matmul_h15.hwx",
+	"data/matmul_m10.hwx",
+	"data/matmul_t0.hwx",
+};
+
+TEST(test_hwx, test_mapped_matches_read) {
+	for (const char *path : HWX_PATHS) {
+		struct hwx_file *file = hwx_open(path);
+		struct hwx_file *mapped = hwx_open_mapped(path);
+		ASSERT_NE(file, nullptr) << path;
+		ASSERT_NE(mapped, nullptr) << path;
+
+		EXPECT_EQ(std::memcmp(hwx_header(file), hwx_header(mapped), sizeof(struct MachHeader64)), 0);
+		ASSERT_EQ(hwx_segment_count(file), hwx_segment_count(mapped));
+		ASSERT_EQ(hwx_thread_state_count(file), hwx_thread_state_count(mapped));
+
+		const struct hwx_section *tsk = hwx_get_tsk_section(mapped);
+		ASSERT_NE(tsk, nullptr);
+		const void *data = hwx_section_data(mapped, tsk);
+		ASSERT_NE(data, nullptr);
+
+		std::vector<uint8_t> copy(tsk->size);
+		ASSERT_EQ(hwx_section_read(file, hwx_get_tsk_section(file), 0, copy.data(), copy.size()), 0);
+		EXPECT_EQ(std::memcmp(copy.data(), data, copy.size()), 0);
+
+		/* Unmapped files have no stable pointers to hand out */
+		EXPECT_EQ(hwx_section_data(file, hwx_get_tsk_section(file)), nullptr);
+
+		hwx_close(mapped);
+		hwx_close(file);
+	}
+}
+
+TEST(test_hwx, test_open_memory_and_fd) {
+	FILE *fp = fopen("data/matmul_h14.hwx", "rb");
+	ASSERT_NE(fp, nullptr);
+	std::vector<uint8_t> image(49152);
+	image.resize(fread(image.data(), 1, image.size(), fp));
+	fclose(fp);
+
+	struct hwx_file *memory = hwx_open_memory(image.data(), image.size());
+	ASSERT_NE(memory, nullptr);
+	const struct hwx_section *tsk = hwx_get_tsk_section(memory);
+	ASSERT_NE(tsk, nullptr);
+	/* Parsed in place, no copy of the section bytes */
+	EXPECT_EQ(hwx_section_data(memory, tsk), image.data() + tsk->offset);
+
+	int fd = memfd_create("hwx", MFD_CLOEXEC);
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(write(fd, image.data(), image.size()), (ssize_t)image.size());
+	struct hwx_file *file = hwx_open_fd(fd);
+	close(fd);
+	ASSERT_NE(file, nullptr);
+
+	const struct hwx_section *krn = hwx_get_krn_section(file);
+	ASSERT_NE(krn, nullptr);
+	EXPECT_EQ(std::memcmp(hwx_section_data(file, krn), image.data() + krn->offset, krn->size), 0);
+
+	/* Truncated images are rejected */
+	EXPECT_EQ(hwx_open_memory(image.data(), 64), nullptr);
+
+	hwx_close(file);
+	hwx_close(memory);
+}
+
+/*
+ * Synthetic HWX with a configurable number of segments and SEG_STATE
+ * thread states, laid out like the compiler output.
+ */
+static void append(std::vector<uint8_t> &image, const void *data, size_t size)
+{
+	const uint8_t *bytes = static_cast<const uint8_t *>(data);
+	image.insert(image.end(), bytes, bytes + size);
+}
+
+static void append_u32(std::vector<uint8_t> &image, uint32_t value)
+{
+	append(image, &value, sizeof(value));
+}
+
+static void append_u64(std::vector<uint8_t> &image, uint64_t value)
+{
+	append(image, &value, sizeof(value));
+}
+
+static void append_name(std::vector<uint8_t> &image, const char *name)
+{
+	char buffer[16] = {};
+	std::strncpy(buffer, name, sizeof(buffer));
+	append(image, buffer, sizeof(buffer));
+}
+
+static void append_section(std::vector<uint8_t> &image, const char *segname, const char *sectname,
+			   uint64_t size, uint32_t offset)
+{
+	append_name(image, sectname);
+	append_name(image, segname);
+	append_u64(image, 0x30000000);
+	append_u64(image, size);
+	append_u32(image, offset);
+	for (int i = 0; i < 7; i++) {
+		append_u32(image, 0);
+	}
+}
+
+static void append_segment(std::vector<uint8_t> &image, const char *segname, uint32_t nsects,
+			   uint64_t fileoff, uint64_t filesize)
+{
+	append_u32(image, HWX_LOAD_COMMAND_SEGMENT_64);
+	append_u32(image, 72 + nsects * 80);
+	append_name(image, segname);
+	append_u64(image, 0x30000000);
+	append_u64(image, filesize);
+	append_u64(image, fileoff);
+	append_u64(image, filesize);
+	append_u32(image, 5);
+	append_u32(image, 5);
+	append_u32(image, nsects);
+	append_u32(image, 0);
+}
+
+static std::vector<uint8_t> make_commands(uint32_t segment_count, uint32_t state_count,
+					  uint32_t data_offset, uint32_t text_size, uint32_t const_size)
+{
+	std::vector<uint8_t> cmds;
+	append_segment(cmds, "__TEXT", 2, data_offset, text_size + const_size);
+	append_section(cmds, "__TEXT", "__text", text_size, data_offset);
+	append_section(cmds, "__TEXT", "__const", const_size, data_offset + text_size);
+	for (uint32_t i = 1; i < segment_count; i++) {
+		append_segment(cmds, "__FVMLIB", 1, 0, 0);
+		append_section(cmds, "__FVMLIB", (i & 1) ? "__const" : "__data", 0x80, 0);
+	}
+
+	struct hwx_ane_seg_state seg = {};
+	seg.seg_words = text_size / 4;
+	seg.td_count = 1;
+	const uint32_t words = sizeof(seg) / sizeof(uint32_t);
+	for (uint32_t i = 0; i < state_count; i++) {
+		append_u32(cmds, HWX_LOAD_COMMAND_THREAD);
+		append_u32(cmds, 8 + 8 + sizeof(seg));
+		append_u32(cmds, HWX_ANE_SEG_STATE);
+		append_u32(cmds, words);
+		seg.seg_id = i;
+		append(cmds, &seg, sizeof(seg));
+	}
+	return cmds;
+}
+
+static std::vector<uint8_t> make_hwx(uint32_t segment_count, uint32_t state_count)
+{
+	const uint32_t text_size = 0x100;
+	const uint32_t const_size = 0x4000;
+
+	/* Section data goes on the first 16K boundary past the load commands */
+	uint32_t data_offset = 0x4000;
+	std::vector<uint8_t> cmds = make_commands(segment_count, state_count, data_offset,
+						  text_size, const_size);
+	const size_t cmds_end = sizeof(struct MachHeader64) + cmds.size();
+	if (cmds_end > data_offset) {
+		data_offset = (cmds_end + 0x3FFF) & ~0x3FFFu;
+		cmds = make_commands(segment_count, state_count, data_offset, text_size,
+				     const_size);
+	}
+
+	struct MachHeader64 header = {};
+	header.magic = HWX_MACHO_MAGIC_64;
+	header.cputype = 0x80;
+	header.cpusubtype = HWX_CPU_SUBTYPE_H14;
+	header.filetype = 2;
+	header.ncmds = segment_count + state_count;
+	header.sizeofcmds = cmds.size();
+
+	std::vector<uint8_t> image;
+	append(image, &header, sizeof(header));
+	append(image, cmds.data(), cmds.size());
+	image.resize(data_offset + text_size + const_size);
+	for (size_t i = data_offset; i < image.size(); i++) {
+		image[i] = (uint8_t)(i * 31u);
+	}
+	return image;
+}
+
+TEST(test_hwx, test_synthetic) {
+	std::vector<uint8_t> image = make_hwx(16, 8);
+	struct hwx_file *file = hwx_open_memory(image.data(), image.size());
+	ASSERT_NE(file, nullptr);
+	EXPECT_EQ(hwx_segment_count(file), 16u);
+	EXPECT_EQ(hwx_thread_state_count(file), 8u);
+
+	uint32_t seen = 0;
+	const struct hwx_thread_state *state = nullptr;
+	while ((state = hwx_thread_state_next(file, HWX_ANE_SEG_STATE, state)) != nullptr) {
+		struct hwx_ane_seg_state seg;
+		ASSERT_GE(state->byte_size, sizeof(seg));
+		std::memcpy(&seg, state->data, sizeof(seg));
+		EXPECT_EQ(seg.seg_id, seen++);
+	}
+	EXPECT_EQ(seen, 8u);
+	hwx_close(file);
+}
+
+TEST(test_hwx, bench_open_close) {
+	const struct {
+		uint32_t segments;
+		uint32_t states;
+	} shapes[] = { { 5, 8 }, { 64, 64 }, { 512, 512 }, { 4096, 2048 } };
+
+	for (const auto &shape : shapes) {
+		std::vector<uint8_t> image = make_hwx(shape.segments, shape.states);
+		const int iterations = 200000 / (shape.segments + shape.states);
+
+		const auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < iterations; i++) {
+			struct hwx_file *file = hwx_open_memory(image.data(), image.size());
+			ASSERT_NE(file, nullptr);
+			hwx_close(file);
+		}
+		const auto elapsed = std::chrono::steady_clock::now() - start;
+		const double us = std::chrono::duration<double, std::micro>(elapsed).count() / iterations;
+		printf("hwx open/close: %5u segments, %5u thread states: %10.2f us\n",
+		       shape.segments, shape.states, us);
+	}
+}
+
+TEST(test_hwx, test_lookup_by_name) {
+	std::vector<uint8_t> image = make_hwx(64, 1);
+	struct hwx_file *file = hwx_open_memory(image.data(), image.size());
+	ASSERT_NE(file, nullptr);
+	const struct hwx_segment *segments = hwx_segments(file);
+
+	/* Duplicate names resolve to the first one in file order */
+	EXPECT_EQ(hwx_segment_by_name(file, "__FVMLIB"), &segments[1]);
+	EXPECT_EQ(hwx_section_by_name(file, "__FVMLIB", "__const"), &segments[1].sections[0]);
+	EXPECT_EQ(hwx_section_by_name(file, "__FVMLIB", "__data"), &segments[2].sections[0]);
+	EXPECT_EQ(hwx_section_by_name(file, "", "__const"), &segments[0].sections[1]);
+
+	EXPECT_EQ(hwx_get_tsk_section(file), &segments[0].sections[0]);
+	EXPECT_EQ(hwx_get_krn_section(file), &segments[0].sections[1]);
+
+	EXPECT_EQ(hwx_segment_by_name(file, "__DATA"), nullptr);
+	EXPECT_EQ(hwx_section_by_name(file, "__TEXT", "__data"), nullptr);
+	hwx_close(file);
+}
+
+TEST(test_hwx, test_thread_state_views) {
+	std::vector<uint8_t> image = make_hwx(4, 16);
+	struct hwx_file *memory = hwx_open_memory(image.data(), image.size());
+	ASSERT_NE(memory, nullptr);
+
+	int fd = memfd_create("hwx", MFD_CLOEXEC);
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(write(fd, image.data(), image.size()), (ssize_t)image.size());
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	struct hwx_file *file = hwx_open(path);
+	close(fd);
+	ASSERT_NE(file, nullptr);
+
+	ASSERT_EQ(hwx_thread_state_count(memory), 16u);
+	ASSERT_EQ(hwx_thread_state_count(file), 16u);
+	const struct hwx_thread_state *views = hwx_thread_states(memory);
+	const struct hwx_thread_state *states = hwx_thread_states(file);
+	for (uint32_t i = 0; i < 16; i++) {
+		/* Payloads are views into the image, not copies */
+		EXPECT_GE(views[i].data, image.data());
+		EXPECT_LE(views[i].data + views[i].byte_size, image.data() + image.size());
+		ASSERT_EQ(states[i].byte_size, views[i].byte_size);
+		EXPECT_EQ(std::memcmp(states[i].data, views[i].data, views[i].byte_size), 0);
+	}
+
+	hwx_close(file);
+	hwx_close(memory);
+}
+
+TEST(test_hwx, test_open_stream) {
+	std::vector<uint8_t> image = make_hwx(512, 512);
+	int fds[2];
+	ASSERT_EQ(pipe(fds), 0);
+
+	/* Larger than a pipe buffer, so the reader has to keep up */
+	std::thread writer([&] {
+		size_t done = 0;
+		while (done < image.size()) {
+			ssize_t n = write(fds[1], image.data() + done, image.size() - done);
+			if (n <= 0) {
+				break;
+			}
+			done += (size_t)n;
+		}
+		close(fds[1]);
+	});
+
+	struct hwx_file *file = hwx_open_stream(fds[0]);
+	ASSERT_NE(file, nullptr);
+	EXPECT_EQ(hwx_segment_count(file), 512u);
+	EXPECT_EQ(hwx_thread_state_count(file), 512u);
+
+	const struct hwx_section *tsk = hwx_get_tsk_section(file);
+	const struct hwx_section *krn = hwx_get_krn_section(file);
+	EXPECT_EQ(hwx_section_data(file, tsk), nullptr);
+
+	std::vector<uint8_t> data(krn->size);
+	ASSERT_EQ(hwx_section_read(file, tsk, 0, data.data(), tsk->size), 0);
+	EXPECT_EQ(std::memcmp(data.data(), image.data() + tsk->offset, tsk->size), 0);
+
+	/* Streams cannot go back */
+	EXPECT_EQ(hwx_section_read(file, tsk, 0, data.data(), tsk->size), -1);
+	EXPECT_EQ(errno, ESPIPE);
+
+	ASSERT_EQ(hwx_section_read(file, krn, 0, data.data(), krn->size), 0);
+	EXPECT_EQ(std::memcmp(data.data(), image.data() + krn->offset, krn->size), 0);
+
+	hwx_close(file);
+	close(fds[0]);
+	writer.join();
+}
+
+TEST(test_hwx, test_fingerprint) {
+	std::vector<uint8_t> image = make_hwx(4, 4);
+	struct hwx_file *memory = hwx_open_memory(image.data(), image.size());
+	ASSERT_NE(memory, nullptr);
+	const struct hwx_section *krn = hwx_get_krn_section(memory);
+	const struct hwx_section *tsk = hwx_get_tsk_section(memory);
+
+	struct hwx_fingerprint expected, fingerprint;
+	hwx_fingerprint(image.data() + krn->offset, krn->size, &expected);
+	ASSERT_EQ(hwx_section_fingerprint(memory, krn, &fingerprint), 0);
+	EXPECT_EQ(fingerprint.lo, expected.lo);
+	EXPECT_EQ(fingerprint.hi, expected.hi);
+
+	/* Files read in chunks hash the same as mapped ones */
+	int fd = memfd_create("hwx", MFD_CLOEXEC);
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(write(fd, image.data(), image.size()), (ssize_t)image.size());
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	struct hwx_file *file = hwx_open(path);
+	close(fd);
+	ASSERT_NE(file, nullptr);
+	ASSERT_EQ(hwx_section_fingerprint(file, hwx_get_krn_section(file), &fingerprint), 0);
+	EXPECT_EQ(fingerprint.lo, expected.lo);
+	EXPECT_EQ(fingerprint.hi, expected.hi);
+	hwx_close(file);
+
+	/* Any byte, and the length, change both halves */
+	struct hwx_fingerprint other;
+	ASSERT_EQ(hwx_section_fingerprint(memory, tsk, &other), 0);
+	EXPECT_NE(other.lo, expected.lo);
+	image[krn->offset + krn->size - 1] ^= 1;
+	ASSERT_EQ(hwx_section_fingerprint(memory, krn, &other), 0);
+	EXPECT_NE(other.lo, expected.lo);
+	EXPECT_NE(other.hi, expected.hi);
+	hwx_fingerprint(image.data() + krn->offset, krn->size - 1, &other);
+	EXPECT_NE(other.lo, expected.lo);
+
+	hwx_close(memory);
+}
+
+TEST(test_hwx, test_map_shared) {
+	char dir[] = "/tmp/hwx-shared-XXXXXX";
+	ASSERT_NE(mkdtemp(dir), nullptr);
+
+	std::vector<uint8_t> first = make_hwx(4, 4);
+	std::vector<uint8_t> second = first;
+	struct hwx_file *a = hwx_open_memory(first.data(), first.size());
+	struct hwx_file *b = hwx_open_memory(second.data(), second.size());
+	ASSERT_NE(a, nullptr);
+	ASSERT_NE(b, nullptr);
+	const struct hwx_section *krn = hwx_get_krn_section(a);
+
+	const void *shared_a = hwx_section_map_shared(a, krn, dir);
+	const void *shared_b = hwx_section_map_shared(b, hwx_get_krn_section(b), dir);
+	ASSERT_NE(shared_a, nullptr);
+	ASSERT_NE(shared_b, nullptr);
+	EXPECT_EQ(std::memcmp(shared_a, first.data() + krn->offset, krn->size), 0);
+
+	/* Both copies are backed by one object */
+	size_t objects = 0;
+	for (const auto &entry : std::filesystem::directory_iterator(dir)) {
+		EXPECT_EQ(entry.file_size(), krn->size);
+		objects++;
+	}
+	EXPECT_EQ(objects, 1u);
+
+	munmap((void *)shared_b, krn->size);
+	munmap((void *)shared_a, krn->size);
+	hwx_close(b);
+	hwx_close(a);
+	std::filesystem::remove_all(dir);
+}
+
+/* Objects someone else could have written are refused */
+TEST(test_hwx, test_map_shared_untrusted) {
+	char dir[] = "/tmp/hwx-shared-XXXXXX";
+	ASSERT_NE(mkdtemp(dir), nullptr);
+
+	std::vector<uint8_t> image = make_hwx(4, 4);
+	struct hwx_file *file = hwx_open_memory(image.data(), image.size());
+	ASSERT_NE(file, nullptr);
+	const struct hwx_section *krn = hwx_get_krn_section(file);
+
+	const void *shared = hwx_section_map_shared(file, krn, dir);
+	ASSERT_NE(shared, nullptr);
+	munmap((void *)shared, krn->size);
+	const std::filesystem::path object = std::filesystem::directory_iterator(dir)->path();
+
+	ASSERT_EQ(chmod(object.c_str(), 0644), 0);
+	errno = 0;
+	EXPECT_EQ(hwx_section_map_shared(file, krn, dir), nullptr);
+	EXPECT_EQ(errno, EACCES);
+
+	if (geteuid() == 0) {
+		ASSERT_EQ(chmod(object.c_str(), 0400), 0);
+		ASSERT_EQ(chown(object.c_str(), 1, (gid_t)-1), 0);
+		errno = 0;
+		EXPECT_EQ(hwx_section_map_shared(file, krn, dir), nullptr);
+		EXPECT_EQ(errno, EACCES);
+	}
+
+	hwx_close(file);
+	std::filesystem::remove_all(dir);
+}
+
+static std::vector<uint8_t> read_fd(int fd)
+{
+	std::vector<uint8_t> data;
+	uint8_t buffer[4096];
+	ssize_t n;
+	for (off_t offset = 0; (n = pread(fd, buffer, sizeof(buffer), offset)) > 0; offset += n) {
+		data.insert(data.end(), buffer, buffer + n);
+	}
+	return data;
+}
+
+TEST(test_hwx, test_write_round_trip) {
+	for (const char *path : HWX_PATHS) {
+		int source = open(path, O_RDONLY | O_CLOEXEC);
+		ASSERT_GE(source, 0) << path;
+		std::vector<uint8_t> image = read_fd(source);
+		close(source);
+
+		for (int mapped = 0; mapped < 2; mapped++) {
+			struct hwx_file *file = mapped ? hwx_open_mapped(path) : hwx_open(path);
+			ASSERT_NE(file, nullptr) << path;
+
+			int fd = memfd_create("hwx", MFD_CLOEXEC);
+			ASSERT_GE(fd, 0);
+			ASSERT_EQ(hwx_write(file, fd, nullptr, 0), 0) << path;
+			EXPECT_EQ(read_fd(fd), image) << path;
+			close(fd);
+			hwx_close(file);
+		}
+	}
+}
+
+TEST(test_hwx, test_write_patch) {
+	struct hwx_file *file = hwx_open_mapped("data/matmul_h13.hwx");
+	ASSERT_NE(file, nullptr);
+	const struct hwx_section *tsk = hwx_get_tsk_section(file);
+	ASSERT_NE(tsk, nullptr);
+	ASSERT_GE(tsk->size, sizeof(ane::TD_V5));
+
+	ane::TD_V5 td;
+	ASSERT_EQ(hwx_section_read(file, tsk, 0, &td, sizeof(td)), 0);
+	auto &config = td.tile_dma_src.DMAConfig;
+	config.cache_hint_noreuse = (ane::U32)(config.cache_hint_noreuse ^ 0xF);
+
+	int fd = memfd_create("hwx", MFD_CLOEXEC);
+	ASSERT_GE(fd, 0);
+	const struct hwx_patch patch = { tsk, 0, &td, sizeof(td) };
+	ASSERT_EQ(hwx_write(file, fd, &patch, 1), 0);
+	std::vector<uint8_t> written = read_fd(fd);
+	close(fd);
+
+	/* Only the rewritten field differs */
+	fd = open("data/matmul_h13.hwx", O_RDONLY | O_CLOEXEC);
+	ASSERT_GE(fd, 0);
+	std::vector<uint8_t> image = read_fd(fd);
+	close(fd);
+	ASSERT_EQ(written.size(), image.size());
+
+	const size_t field = tsk->offset + offsetof(ane::TD_V5, tile_dma_src);
+	uint32_t diff = 0;
+	for (size_t i = 0; i < image.size(); i++) {
+		if (i >= field && i < field + sizeof(uint32_t)) {
+			diff |= (uint32_t)(written[i] ^ image[i]) << ((i - field) * 8);
+		} else {
+			ASSERT_EQ(written[i], image[i]) << i;
+		}
+	}
+	EXPECT_EQ(diff, decltype(config.cache_hint_noreuse)::mask);
+
+	/* Patches must stay within their section */
+	const struct hwx_patch outside = { tsk, tsk->size, &td, 1 };
+	fd = memfd_create("hwx", MFD_CLOEXEC);
+	ASSERT_GE(fd, 0);
+	errno = 0;
+	EXPECT_EQ(hwx_write(file, fd, &outside, 1), -1);
+	EXPECT_EQ(errno, EINVAL);
+	close(fd);
+	hwx_close(file);
+}
+
+TEST(test_hwx, bench_fingerprint) {
+	std::vector<uint8_t> data(4u << 20);
+	for (size_t i = 0; i < data.size(); i++) {
+		data[i] = (uint8_t)(i * 131u);
+	}
+
+	struct hwx_fingerprint fingerprint;
+	const int iterations = 128;
+	const auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < iterations; i++) {
+		hwx_fingerprint(data.data(), data.size(), &fingerprint);
+	}
+	const auto elapsed = std::chrono::steady_clock::now() - start;
+	const double s = std::chrono::duration<double>(elapsed).count();
+	printf("hwx fingerprint: %.2f GB/s\n", (double)data.size() * iterations / s / 1e9);
+}
@@ -0,0 +1,739 @@
+// SPDX-License-Identifier: MIT
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <libane/ane.h>
+#include <libane/ane_backend.h>
+#include <libane/ane_f16.h>
+
+class test_mock : public ::testing::Test {
+protected:
+	void SetUp() override {
+		ASSERT_EQ(ane_set_backend(ANE_BACKEND_MOCK), 0);
+		ane_mock_set_config(NULL);
+		ane_mock_reset_stats();
+	}
+
+	void TearDown() override {
+		ane_mock_set_config(NULL);
+		ane_set_backend(ANE_BACKEND_DRM);
+	}
+};
+
+/* Moves a dense tensor in or out of its channel along the plan */
+static void plan_copy(const struct ane_plan *plan, uint8_t *tile, uint8_t *data, bool to_tile)
+{
+	for (uint32_t i = 0; i < plan->copy_count; i++) {
+		const struct ane_copy *copy = &plan->copies[i];
+		for (uint32_t p = 0; p < copy->planes; p++) {
+			for (uint32_t r = 0; r < copy->rows; r++) {
+				uint8_t *t = tile + copy->tile_offset + p * copy->tile_plane + r * copy->tile_row;
+				uint8_t *d = data + copy->data_offset + p * copy->data_plane + r * copy->data_row;
+				std::memcpy(to_tile ? t : d, to_tile ? d : t, copy->size);
+			}
+		}
+	}
+}
+
+/* CPU reference of matmul_h14: C (2x2) = A (2x3) * B (3x2) */
+static void matmul_reference(struct ane_nn *nn, void *arg)
+{
+	const struct ane_model *model = ane_model(nn);
+	uint16_t Ah[6], Bh[6], Ch[4];
+	float A[6], B[6], C[4];
+
+	plan_copy(&model->src_plans[0], (uint8_t *)nn->chans[model->src_plans[0].bdx].map,
+		  (uint8_t *)Ah, false);
+	plan_copy(&model->src_plans[1], (uint8_t *)nn->chans[model->src_plans[1].bdx].map,
+		  (uint8_t *)Bh, false);
+	ane_f16_to_f32_row(Ah, A, 6);
+	ane_f16_to_f32_row(Bh, B, 6);
+
+	for (int i = 0; i < 2; i++) {
+		for (int j = 0; j < 2; j++) {
+			C[i * 2 + j] = 0;
+			for (int k = 0; k < 3; k++) {
+				C[i * 2 + j] += A[i * 3 + k] * B[k * 2 + j];
+			}
+		}
+	}
+
+	ane_f32_to_f16_row(C, Ch, 4);
+	plan_copy(&model->dst_plans[0], (uint8_t *)nn->chans[model->dst_plans[0].bdx].map,
+		  (uint8_t *)Ch, true);
+	(*(int *)arg)++;
+}
+
+TEST_F(test_mock, test_records_request) {
+	struct ane_nn *nn = ane_init("data/matmul_h14.hwx");
+	ASSERT_NE(nn, nullptr);
+
+	struct ane_mock_request request;
+	EXPECT_EQ(ane_mock_last_request(nn, &request), -ENOENT);
+
+	ASSERT_EQ(ane_exec(nn), 0);
+	ASSERT_EQ(ane_exec(nn), 0);
+	ASSERT_EQ(ane_mock_last_request(nn, &request), 0);
+	EXPECT_EQ(request.seqno, 2u);
+	EXPECT_EQ(request.tsk_size, ane_model(nn)->tsk_size);
+	EXPECT_EQ(request.td_count, ane_model(nn)->td_count);
+	EXPECT_EQ(request.td_size, ane_model(nn)->td_size);
+	EXPECT_EQ(request.btsp_handle, nn->btsp_chan.handle);
+	EXPECT_EQ(request.btsp_offset, nn->btsp_chan.offset);
+
+	uint32_t chans = 0;
+	for (uint32_t bdx = 0; bdx < TILE_COUNT; bdx++) {
+		chans += ane_model(nn)->tiles[bdx] != 0;
+	}
+	EXPECT_EQ(request.chan_count, chans);
+
+	struct ane_mock_stats stats;
+	ane_mock_get_stats(&stats);
+	EXPECT_EQ(stats.submitted, 2u);
+	EXPECT_EQ(stats.retired, 2u);
+	EXPECT_EQ(stats.bo_allocs, 1u);
+
+	ane_free(nn);
+}
+
+TEST_F(test_mock, test_one_bo_per_model) {
+	struct ane_nn *nn = ane_init("data/matmul_h14.hwx");
+	ASSERT_NE(nn, nullptr);
+
+	/* Channels are disjoint, tile-aligned ranges of the arena */
+	std::vector<const struct ane_bo *> bos = { &nn->btsp_chan };
+	for (uint32_t bdx = 0; bdx < TILE_COUNT; bdx++) {
+		if (ane_model(nn)->tiles[bdx]) {
+			bos.push_back(&nn->chans[bdx]);
+		}
+	}
+	uint64_t used = 0;
+	for (const struct ane_bo *bo : bos) {
+		EXPECT_EQ(bo->parent, &nn->arena);
+		EXPECT_EQ(bo->handle, nn->arena.handle);
+		EXPECT_EQ(bo->offset % 0x4000, 0u);
+		EXPECT_LE(bo->offset + bo->size, nn->arena.size);
+		EXPECT_EQ(bo->map, (uint8_t *)nn->arena.map + bo->offset);
+		for (const struct ane_bo *other : bos) {
+			if (other != bo) {
+				EXPECT_TRUE(bo->offset + bo->size <= other->offset ||
+					    other->offset + other->size <= bo->offset);
+			}
+		}
+		used += bo->size;
+	}
+	EXPECT_EQ(used, nn->arena.size);
+
+	struct ane_mock_stats stats;
+	ane_mock_get_stats(&stats);
+	EXPECT_EQ(stats.bo_allocs, 1u);
+
+	ane_free(nn);
+}
+
+TEST_F(test_mock, test_cpu_reference) {
+	int runs = 0;
+	const struct ane_mock_config config = { 0, matmul_reference, &runs, 0 };
+	ane_mock_set_config(&config);
+
+	struct ane_nn *nn = ane_init("data/matmul_h14.hwx");
+	ASSERT_NE(nn, nullptr);
+
+	float A[] = { 0.11, 0.12, 0.13,
+		      0.21, 0.22, 0.23 };
+	float B[] = { 1011, 1012,
+		      1021, 1022,
+		      1031, 1032 };
+	uint16_t Ah[6], Bh[6], Ch[4];
+	float C[4];
+	ane_f32_to_f16_row(A, Ah, 6);
+	ane_f32_to_f16_row(B, Bh, 6);
+
+	ane_tile_send(nn, Ah, 0);
+	ane_tile_send(nn, Bh, 1);
+	ASSERT_EQ(ane_exec(nn), 0);
+	ane_tile_read(nn, Ch, 0);
+	ane_f16_to_f32_row(Ch, C, 4);
+
+	/* Against the fp16-rounded inputs; outputs near 700 are 0.5 apart */
+	float Ar[6], Br[6];
+	ane_f16_to_f32_row(Ah, Ar, 6);
+	ane_f16_to_f32_row(Bh, Br, 6);
+	EXPECT_EQ(runs, 1);
+	for (int i = 0; i < 2; i++) {
+		for (int j = 0; j < 2; j++) {
+			float expected = 0;
+			for (int k = 0; k < 3; k++) {
+				expected += Ar[i * 3 + k] * Br[k * 2 + j];
+			}
+			EXPECT_NEAR(C[i * 2 + j], expected, 0.5) << i << "," << j;
+		}
+	}
+
+	ane_free(nn);
+}
+
+TEST_F(test_mock, test_latency) {
+	const uint32_t latency_us = 2000;
+	const struct ane_mock_config config = { latency_us, NULL, NULL, 0 };
+	ane_mock_set_config(&config);
+
+	struct ane_nn *nn = ane_init("data/matmul_h14.hwx");
+	ASSERT_NE(nn, nullptr);
+
+	auto start = std::chrono::steady_clock::now();
+	ASSERT_EQ(ane_exec(nn), 0);
+	EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::microseconds(latency_us));
+
+	/* Submits return at once; the device serializes the requests */
+	struct ane_fence fences[4];
+	start = std::chrono::steady_clock::now();
+	for (auto &fence : fences) {
+		ASSERT_EQ(ane_exec_async(nn, &fence), 0);
+	}
+	EXPECT_EQ(ane_fence_wait(&fences[0], 0), -ETIMEDOUT);
+	for (auto &fence : fences) {
+		EXPECT_EQ(ane_fence_wait(&fence, -1), 0);
+		ane_fence_close(&fence);
+	}
+	EXPECT_GE(std::chrono::steady_clock::now() - start,
+		  std::chrono::microseconds(std::size(fences) * latency_us));
+
+	ane_free(nn);
+}
+
+TEST_F(test_mock, test_slots) {
+	int runs = 0;
+	const struct ane_mock_config config = { 200, matmul_reference, &runs, 0 };
+	ane_mock_set_config(&config);
+
+	struct ane_nn *nn = ane_init("data/matmul_h14.hwx");
+	ASSERT_NE(nn, nullptr);
+	const uint64_t arena_size = nn->arena.size;
+	const uint64_t btsp_offset = nn->btsp_chan.offset;
+
+	EXPECT_EQ(ane_set_slots(nn, 0), -EINVAL);
+	EXPECT_EQ(ane_set_slots(nn, ANE_MAX_SLOTS + 1), -EINVAL);
+	ASSERT_EQ(ane_set_slots(nn, 3), 0);
+	EXPECT_EQ(nn->slot_count, 3u);
+	/* Only the three I/O channels are duplicated */
+	EXPECT_EQ(nn->slot_size, 3u * 0x4000);
+	EXPECT_EQ(nn->arena.size, arena_size + 2 * nn->slot_size);
+	EXPECT_EQ(nn->btsp_chan.offset, btsp_offset);
+	EXPECT_EQ(ane_select_slot(nn, 3), -EINVAL);
+	EXPECT_EQ(ane_exec_slot(nn, 3), -EINVAL);
+
+	/* Stage and queue a different B in every slot, then read them all back */
+	uint16_t Ah[6], Bh[3][6];
+	const float A[6] = { 1, 2, 3, 4, 5, 6 };
+	ane_f32_to_f16_row(A, Ah, 6);
+	struct ane_fence fences[3];
+	for (uint32_t slot = 0; slot < 3; slot++) {
+		ASSERT_EQ(ane_select_slot(nn, slot), 0);
+		const float B[6] = { 1.0f + slot, 0, 0, 1, 0, 0 };
+		ane_f32_to_f16_row(B, Bh[slot], 6);
+		ane_tile_send(nn, Ah, 0);
+		ane_tile_send(nn, Bh[slot], 1);
+		ASSERT_EQ(ane_exec_async(nn, &fences[slot]), 0);
+	}
+	for (uint32_t slot = 0; slot < 3; slot++) {
+		ASSERT_EQ(ane_fence_wait(&fences[slot], -1), 0);
+		ane_fence_close(&fences[slot]);
+		ASSERT_EQ(ane_select_slot(nn, slot), 0);
+		uint16_t Ch[4];
+		float C[4];
+		ane_tile_read(nn, Ch, 0);
+		ane_f16_to_f32_row(Ch, C, 4);
+		/* C = [A[0][0] * b, A[0][1]; A[1][0] * b, A[1][1]] */
+		EXPECT_EQ(C[0], 1.0f * (1 + slot)) << slot;
+		EXPECT_EQ(C[1], 2.0f) << slot;
+		EXPECT_EQ(C[2], 4.0f * (1 + slot)) << slot;
+		EXPECT_EQ(C[3], 5.0f) << slot;
+	}
+	EXPECT_EQ(runs, 3);
+
+	/* Explicit slots leave the selection alone */
+	ASSERT_EQ(ane_exec_slot(nn, 0), 0);
+	EXPECT_EQ(nn->slot, 2u);
+
+	/* Shrinking keeps slot 0 */
+	ASSERT_EQ(ane_set_slots(nn, 1), 0);
+	EXPECT_EQ(nn->arena.size, arena_size);
+	uint16_t Ch[4];
+	ane_tile_read(nn, Ch, 0);
+	EXPECT_EQ(ane_compute_f16_to_f32(Ch[0]), 1.0f);
+
+	ane_free(nn);
+}
+
+TEST_F(test_mock, test_batch) {
+	int runs = 0;
+	const struct ane_mock_config config = { 0, matmul_reference, &runs, 0 };
+	ane_mock_set_config(&config);
+
+	/* Different models, selected slots and in-flight state in one batch */
+	const uint32_t count = 4;
+	struct ane_nn *nns[count];
+	uint16_t Ah[6], Bh[count][6];
+	const float A[6] = { 1, 2, 3, 4, 5, 6 };
+	ane_f32_to_f16_row(A, Ah, 6);
+	for (uint32_t i = 0; i < count; i++) {
+		nns[i] = ane_init("data/matmul_h14.hwx");
+		ASSERT_NE(nns[i], nullptr);
+		ASSERT_EQ(ane_set_slots(nns[i], 2), 0);
+		ASSERT_EQ(ane_select_slot(nns[i], i % 2), 0);
+		const float B[6] = { 1.0f + i, 0, 0, 1, 0, 0 };
+		ane_f32_to_f16_row(B, Bh[i], 6);
+		ane_tile_send(nns[i], Ah, 0);
+		ane_tile_send(nns[i], Bh[i], 1);
+	}
+
+	ASSERT_EQ(ane_exec_batch(nns, count), 0);
+	EXPECT_EQ(runs, (int)count);
+	for (uint32_t i = 0; i < count; i++) {
+		uint16_t Ch[4];
+		ane_tile_read(nns[i], Ch, 0);
+		EXPECT_EQ(ane_compute_f16_to_f32(Ch[0]), 1.0f * (1 + i)) << i;
+		EXPECT_EQ(ane_compute_f16_to_f32(Ch[3]), 5.0f) << i;
+
+		struct ane_mock_request request;
+		ASSERT_EQ(ane_mock_last_request(nns[i], &request), 0);
+		EXPECT_EQ(request.seqno, 1u);
+	}
+
+	/* One fence for the whole batch; a model may appear more than once */
+	struct ane_nn *again[] = { nns[0], nns[1], nns[0] };
+	struct ane_fence fence;
+	ASSERT_EQ(ane_exec_batch_async(again, 3, &fence), 0);
+	EXPECT_EQ(ane_fence_wait(&fence, -1), 0);
+	ane_fence_close(&fence);
+	EXPECT_EQ(runs, (int)count + 3);
+
+	struct ane_mock_stats stats;
+	ane_mock_get_stats(&stats);
+	EXPECT_EQ(stats.submitted, count + 3);
+	EXPECT_EQ(stats.retired, count + 3);
+	EXPECT_EQ(stats.submissions, 2u);
+
+	for (auto &nn : nns) {
+		ane_free(nn);
+	}
+}
+
+TEST_F(test_mock, test_batch_rejected) {
+	struct ane_nn *nn = ane_init("data/matmul_h14.hwx");
+	ASSERT_NE(nn, nullptr);
+	struct ane_nn *other = __ane_init("data/matmul_h14.hwx", 1);
+	ASSERT_NE(other, nullptr);
+
+	struct ane_nn *nns[ANE_MAX_BATCH + 1];
+	for (auto &n : nns) {
+		n = nn;
+	}
+	struct ane_fence fence;
+	EXPECT_EQ(ane_exec_batch(nns, 0), -EINVAL);
+	EXPECT_EQ(ane_exec_batch(nns, ANE_MAX_BATCH + 1), -EINVAL);
+	EXPECT_EQ(ane_exec_batch_async(nns, ANE_MAX_BATCH + 1, &fence), -EINVAL);
+	EXPECT_EQ(fence.fd, -1);
+
+	/* Requests of another device cannot ride along */
+	nns[1] = other;
+	EXPECT_EQ(ane_exec_batch(nns, 2), -EXDEV);
+
+	/* Nothing was queued */
+	struct ane_mock_request request;
+	EXPECT_EQ(ane_mock_last_request(nn, &request), -ENOENT);
+	struct ane_mock_stats stats;
+	ane_mock_get_stats(&stats);
+	EXPECT_EQ(stats.submitted, 0u);
+
+	ASSERT_EQ(ane_exec_batch(nns, 1), 0);
+	ASSERT_EQ(ane_exec_batch(&nns[1], 1), 0);
+
+	ane_free(other);
+	ane_free(nn);
+}
+
+TEST_F(test_mock, test_clone) {
+	int runs = 0;
+	const struct ane_mock_config config = { 0, matmul_reference, &runs, 0 };
+	ane_mock_set_config(&config);
+
+	struct ane_nn *nn = ane_init("data/matmul_h14.hwx");
+	ASSERT_NE(nn, nullptr);
+	const uint32_t count = 3;
+	struct ane_nn *nns[count] = { nn };
+	for (uint32_t i = 1; i < count; i++) {
+		nns[i] = ane_nn_clone(nns[i - 1]);
+		ASSERT_NE(nns[i], nullptr);
+	}
+
+	/* Clones allocate their three I/O channels and nothing else */
+	struct ane_mock_stats stats;
+	ane_mock_get_stats(&stats);
+	EXPECT_EQ(stats.bo_allocs, count);
+	for (uint32_t i = 1; i < count; i++) {
+		EXPECT_EQ(nns[i]->arena.size, 3u * 0x4000);
+		EXPECT_EQ(nns[i]->btsp_chan.map, nn->btsp_chan.map);
+		for (uint32_t bdx = 0; bdx < TILE_COUNT; bdx++) {
+			if (!ane_model(nn)->tiles[bdx]) {
+				continue;
+			}
+			const bool io = bdx == 8 || bdx == 10 || bdx == 12;
+			EXPECT_EQ(nns[i]->chans[bdx].map == nn->chans[bdx].map, !io) << bdx;
+		}
+	}
+
+	/* The model that was cloned cannot move its arena; clones can */
+	EXPECT_EQ(ane_set_slots(nn, 2), -EBUSY);
+	ASSERT_EQ(ane_set_slots(nns[2], 2), 0);
+	ASSERT_EQ(ane_select_slot(nns[2], 1), 0);
+
+	uint16_t Ah[6], Bh[count][6];
+	const float A[6] = { 1, 2, 3, 4, 5, 6 };
+	ane_f32_to_f16_row(A, Ah, 6);
+	for (uint32_t i = 0; i < count; i++) {
+		const float B[6] = { 1.0f + i, 0, 0, 1, 0, 0 };
+		ane_f32_to_f16_row(B, Bh[i], 6);
+		ane_tile_send(nns[i], Ah, 0);
+		ane_tile_send(nns[i], Bh[i], 1);
+	}
+	ASSERT_EQ(ane_exec_batch(nns, count), 0);
+	EXPECT_EQ(runs, (int)count);
+	for (uint32_t i = 0; i < count; i++) {
+		uint16_t Ch[4];
+		ane_tile_read(nns[i], Ch, 0);
+		EXPECT_EQ(ane_compute_f16_to_f32(Ch[0]), 1.0f * (1 + i)) << i;
+	}
+
+	/* Clones keep working after the model they came from is gone */
+	ane_free(nn);
+	ASSERT_EQ(ane_exec(nns[1]), 0);
+	struct ane_nn *late = ane_nn_clone(nns[2]);
+	ASSERT_NE(late, nullptr);
+	ane_tile_send(late, Ah, 0);
+	ane_tile_send(late, Bh[0], 1);
+	ASSERT_EQ(ane_exec(late), 0);
+	uint16_t Ch[4];
+	ane_tile_read(late, Ch, 0);
+	EXPECT_EQ(ane_compute_f16_to_f32(Ch[3]), 5.0f);
+
+	ane_free(nns[1]);
+	ane_free(late);
+	ane_free(nns[2]);
+}
+
+TEST_F(test_mock, test_init_many) {
+	int runs = 0;
+	const struct ane_mock_config config = { 0, matmul_reference, &runs, 0 };
+	ane_mock_set_config(&config);
+
+	const char *const paths[] = {
+		"data/matmul_h14.hwx",
+		"data/matmul_h14.hwx",
+		"data/missing.hwx",
+		"data/matmul_h14.hwx",
+		"data/matmul_h14.hwx",
+		"data/matmul_h14.hwx",
+	};
+	const uint32_t count = std::size(paths);
+	const float A[6] = { 1, 2, 3, 4, 5, 6 };
+	uint16_t Ah[6];
+	ane_f32_to_f16_row(A, Ah, 6);
+
+	/* More models than threads, one per CPU, and more threads than models */
+	for (int threads : { 2, 0, -1, 16 }) {
+		struct ane_nn *nns[count];
+		ASSERT_EQ(ane_init_many(paths, count, nns, threads), (int)count - 1) << threads;
+		EXPECT_EQ(nns[2], nullptr) << threads;
+
+		runs = 0;
+		for (uint32_t i = 0; i < count; i++) {
+			if (i == 2) {
+				continue;
+			}
+			ASSERT_NE(nns[i], nullptr) << threads << " " << i;
+			const float B[6] = { 1.0f + i, 0, 0, 1, 0, 0 };
+			uint16_t Bh[6], Ch[4];
+			ane_f32_to_f16_row(B, Bh, 6);
+			ane_tile_send(nns[i], Ah, 0);
+			ane_tile_send(nns[i], Bh, 1);
+			ASSERT_EQ(ane_exec(nns[i]), 0);
+			ane_tile_read(nns[i], Ch, 0);
+			EXPECT_EQ(ane_compute_f16_to_f32(Ch[0]), 1.0f + i) << threads << " " << i;
+			EXPECT_EQ(ane_compute_f16_to_f32(Ch[3]), 5.0f) << threads << " " << i;
+			ane_free(nns[i]);
+		}
+		EXPECT_EQ(runs, (int)count - 1) << threads;
+	}
+
+	struct ane_nn *nn = nullptr;
+	EXPECT_EQ(ane_init_many(paths, 0, &nn, 1), 0);
+	EXPECT_EQ(ane_init_many(nullptr, 1, &nn, 1), -EINVAL);
+	EXPECT_EQ(__ane_init_many(paths, 1, &nn, 1, 99), -ENODEV);
+	EXPECT_EQ(nn, nullptr);
+}
+
+/* Once its clones are gone, nn can change its slot count again */
+TEST_F(test_mock, test_set_slots_after_clone) {
+	int runs = 0;
+	const struct ane_mock_config config = { 0, matmul_reference, &runs, 0 };
+	ane_mock_set_config(&config);
+
+	struct ane_nn *nn = ane_init("data/matmul_h14.hwx");
+	ASSERT_NE(nn, nullptr);
+	struct ane_nn *clones[2];
+	for (struct ane_nn *&clone : clones) {
+		clone = ane_nn_clone(nn);
+		ASSERT_NE(clone, nullptr);
+	}
+
+	EXPECT_EQ(ane_set_slots(nn, 2), -EBUSY);
+	ane_free(clones[0]);
+	EXPECT_EQ(ane_set_slots(nn, 2), -EBUSY);
+	ane_free(clones[1]);
+	ASSERT_EQ(ane_set_slots(nn, 2), 0);
+	EXPECT_EQ(nn->shared, nullptr);
+	EXPECT_EQ(nn->btsp_chan.parent, &nn->arena);
+	ASSERT_EQ(ane_select_slot(nn, 1), 0);
+
+	uint16_t Ah[6], Bh[6], Ch[4];
+	const float A[6] = { 1, 2, 3, 4, 5, 6 };
+	const float B[6] = { 2, 0, 0, 1, 0, 0 };
+	ane_f32_to_f16_row(A, Ah, 6);
+	ane_f32_to_f16_row(B, Bh, 6);
+	ane_tile_send(nn, Ah, 0);
+	ane_tile_send(nn, Bh, 1);
+	ASSERT_EQ(ane_exec(nn), 0);
+	EXPECT_EQ(runs, 1);
+	ane_tile_read(nn, Ch, 0);
+	EXPECT_EQ(ane_compute_f16_to_f32(Ch[0]), 2.0f);
+
+	/* It can be cloned again, and freed before its clone */
+	struct ane_nn *clone = ane_nn_clone(nn);
+	ASSERT_NE(clone, nullptr);
+	ane_free(nn);
+	ASSERT_EQ(ane_exec(clone), 0);
+	ane_free(clone);
+}
+
+static int attach_fails(struct ane_nn *, const struct ane_nn *)
+{
+	return -ENODEV;
+}
+
+/* A clone that fails leaves the model it came from as it was */
+TEST_F(test_mock, test_clone_fails) {
+	struct ane_nn *nn = ane_init("data/matmul_h14.hwx");
+	ASSERT_NE(nn, nullptr);
+	const struct ane_backend *backend = nn->backend;
+	struct ane_backend failing = *backend;
+	failing.attach = attach_fails;
+
+	nn->backend = &failing;
+	EXPECT_EQ(ane_nn_clone(nn), nullptr);
+	nn->backend = backend;
+
+	EXPECT_EQ(nn->shared, nullptr);
+	EXPECT_EQ(nn->btsp_chan.parent, &nn->arena);
+	for (uint32_t bdx = 0; bdx < TILE_COUNT; bdx++) {
+		if (ane_model(nn)->tiles[bdx]) {
+			EXPECT_EQ(nn->chans[bdx].parent, &nn->arena) << bdx;
+		}
+	}
+	ASSERT_EQ(ane_set_slots(nn, 2), 0);
+
+	struct ane_nn *clone = ane_nn_clone(nn);
+	ASSERT_NE(clone, nullptr);
+	ane_free(nn);
+	ASSERT_EQ(ane_exec(clone), 0);
+	ane_free(clone);
+}
+
+static void spin_for(std::chrono::microseconds us)
+{
+	const auto end = std::chrono::steady_clock::now() + us;
+	while (std::chrono::steady_clock::now() < end) {
+	}
+}
+
+TEST_F(test_mock, bench_slots) {
+	/* Staging takes half as long as the device does */
+	const uint32_t latency_us = 200;
+	const std::chrono::microseconds staging(100);
+	const int iterations = 200;
+	const struct ane_mock_config config = { latency_us, NULL, NULL, 0 };
+	ane_mock_set_config(&config);
+	std::vector<uint16_t> A(6), B(6), C(4);
+
+	for (uint32_t slots = 1; slots <= 3; slots++) {
+		struct ane_nn *nn = ane_init("data/matmul_h14.hwx");
+		ASSERT_NE(nn, nullptr);
+		ASSERT_EQ(ane_set_slots(nn, slots), 0);
+
+		std::vector<struct ane_fence> fences(slots);
+		const auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < iterations + (int)slots; i++) {
+			const uint32_t slot = i % slots;
+			ASSERT_EQ(ane_select_slot(nn, slot), 0);
+			if (i >= (int)slots) {
+				ASSERT_EQ(ane_fence_wait(&fences[slot], -1), 0);
+				ane_fence_close(&fences[slot]);
+				ane_tile_read(nn, C.data(), 0);
+			}
+			if (i < iterations) {
+				spin_for(staging);
+				ane_tile_send(nn, A.data(), 0);
+				ane_tile_send(nn, B.data(), 1);
+				ASSERT_EQ(ane_exec_async(nn, &fences[slot]), 0);
+			}
+		}
+		const auto elapsed = std::chrono::steady_clock::now() - start;
+		const double us = std::chrono::duration<double, std::micro>(elapsed).count() / iterations;
+		printf("%u slot(s): %8.2f us per inference (device %u us, staging %lld us)\n",
+		       slots, us, latency_us, (long long)staging.count());
+
+		ane_free(nn);
+	}
+}
+
+TEST_F(test_mock, bench_throughput) {
+	const int iterations = 2000;
+	std::vector<uint16_t> A(6), B(6), C(4);
+
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < 200; i++) {
+		struct ane_nn *nn = ane_init("data/matmul_h14.hwx");
+		ASSERT_NE(nn, nullptr);
+		ane_free(nn);
+	}
+	auto elapsed = std::chrono::steady_clock::now() - start;
+	printf("ane_init + ane_free : %8.2f us\n",
+	       std::chrono::duration<double, std::micro>(elapsed).count() / 200);
+
+	for (uint32_t latency_us : { 0u, 100u }) {
+		const struct ane_mock_config config = { latency_us, NULL, NULL, 0 };
+		ane_mock_set_config(&config);
+
+		struct ane_nn *nns[4];
+		for (auto &nn : nns) {
+			nn = ane_init("data/matmul_h14.hwx");
+			ASSERT_NE(nn, nullptr);
+		}
+
+		start = std::chrono::steady_clock::now();
+		for (int i = 0; i < iterations; i++) {
+			ane_tile_send(nns[0], A.data(), 0);
+			ane_tile_send(nns[0], B.data(), 1);
+			ASSERT_EQ(ane_exec(nns[0]), 0);
+			ane_tile_read(nns[0], C.data(), 0);
+		}
+		elapsed = std::chrono::steady_clock::now() - start;
+		const double sync_us = std::chrono::duration<double, std::micro>(elapsed).count() / iterations;
+
+		/* One thread keeps a request in flight on every nn */
+		struct ane_fence fences[4];
+		start = std::chrono::steady_clock::now();
+		for (int i = 0; i < iterations; i++) {
+			const int n = i % 4;
+			if (i >= 4) {
+				ASSERT_EQ(ane_fence_wait(&fences[n], -1), 0);
+				ane_fence_close(&fences[n]);
+				ane_tile_read(nns[n], C.data(), 0);
+			}
+			ane_tile_send(nns[n], A.data(), 0);
+			ane_tile_send(nns[n], B.data(), 1);
+			ASSERT_EQ(ane_exec_async(nns[n], &fences[n]), 0);
+		}
+		for (auto &fence : fences) {
+			ASSERT_EQ(ane_fence_wait(&fence, -1), 0);
+			ane_fence_close(&fence);
+		}
+		elapsed = std::chrono::steady_clock::now() - start;
+		const double async_us = std::chrono::duration<double, std::micro>(elapsed).count() / iterations;
+
+		printf("latency %4u us: send+exec+read %8.2f us (%8.0f/s), async x4 %8.2f us (%8.0f/s)\n",
+		       latency_us, sync_us, 1e6 / sync_us, async_us, 1e6 / async_us);
+
+		for (auto &nn : nns) {
+			ane_free(nn);
+		}
+	}
+}
+
+TEST_F(test_mock, bench_batch) {
+	/* A fixed cost per trip into the device, as with power-up and locking */
+	const uint32_t latency_us = 50;
+	const uint32_t overhead_us = 100;
+	const int iterations = 32;
+	const struct ane_mock_config config = { latency_us, NULL, NULL, overhead_us };
+	ane_mock_set_config(&config);
+
+	struct ane_nn *nns[ANE_MAX_BATCH];
+	for (auto &nn : nns) {
+		nn = ane_init("data/matmul_h14.hwx");
+		ASSERT_NE(nn, nullptr);
+	}
+
+	for (uint32_t batch : { 1u, 4u, 16u }) {
+		const auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < iterations; i++) {
+			for (uint32_t n = 0; n < ANE_MAX_BATCH; n += batch) {
+				ASSERT_EQ(ane_exec_batch(&nns[n], batch), 0);
+			}
+		}
+		const auto elapsed = std::chrono::steady_clock::now() - start;
+		const double us = std::chrono::duration<double, std::micro>(elapsed).count() /
+				  (iterations * ANE_MAX_BATCH);
+		printf("batch %2u: %8.2f us per request (device %u us, overhead %u us)\n",
+		       batch, us, latency_us, overhead_us);
+	}
+
+	for (auto &nn : nns) {
+		ane_free(nn);
+	}
+}
+
+TEST_F(test_mock, bench_clone) {
+	const int iterations = 200;
+	struct ane_nn *nn = ane_init("data/matmul_h14.hwx");
+	ASSERT_NE(nn, nullptr);
+	std::vector<struct ane_nn *> nns(iterations);
+
+	auto start = std::chrono::steady_clock::now();
+	for (auto &other : nns) {
+		other = ane_init("data/matmul_h14.hwx");
+		ASSERT_NE(other, nullptr);
+	}
+	const double init_us = std::chrono::duration<double, std::micro>(
+		std::chrono::steady_clock::now() - start).count() / iterations;
+	const uint64_t init_bytes = nns[0]->arena.size;
+	for (auto &other : nns) {
+		ane_free(other);
+	}
+
+	start = std::chrono::steady_clock::now();
+	for (auto &other : nns) {
+		other = ane_nn_clone(nn);
+		ASSERT_NE(other, nullptr);
+	}
+	const double clone_us = std::chrono::duration<double, std::micro>(
+		std::chrono::steady_clock::now() - start).count() / iterations;
+	const uint64_t clone_bytes = nns[0]->arena.size;
+	for (auto &other : nns) {
+		ane_free(other);
+	}
+
+	printf("ane_init     : %8.2f us, %8llu bytes of channels\n", init_us,
+	       (unsigned long long)init_bytes);
+	printf("ane_nn_clone : %8.2f us, %8llu bytes of channels\n", clone_us,
+	       (unsigned long long)clone_bytes);
+
+	ane_free(nn);
+}
@@ -0,0 +1,418 @@
+// SPDX-License-Identifier: MIT
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <libane/ane.h>
+#include <libane/ane_f16.h>
+
+static std::vector<uint8_t> read_file(const char *path)
+{
+	std::vector<uint8_t> data;
+	FILE *fp = fopen(path, "rb");
+	if (!fp) {
+		return data;
+	}
+	uint8_t buffer[4096];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+		data.insert(data.end(), buffer, buffer + n);
+	}
+	fclose(fp);
+	return data;
+}
+
+TEST(test_plan, test_matmul_plans) {
+	std::vector<uint8_t> image = read_file("data/matmul_h14.hwx");
+	ASSERT_FALSE(image.empty());
+
+	struct ane_model model;
+	ASSERT_EQ(ane_model_load(&model, image.data(), image.size()), 0);
+
+	/* Two read-only __FVMLIB segments in, one writable out */
+	ASSERT_EQ(model.src_count, 2u);
+	ASSERT_EQ(model.dst_count, 1u);
+	EXPECT_EQ(model.src_plans[0].bdx, 8u);
+	EXPECT_EQ(model.src_plans[1].bdx, 10u);
+	EXPECT_EQ(model.dst_plans[0].bdx, 12u);
+	EXPECT_EQ(model.tiles[8], 1u);
+	EXPECT_EQ(model.tiles[10], 1u);
+	EXPECT_EQ(model.tiles[12], 1u);
+
+	/* A (2x3) is the kernel: one 64-byte plane per output channel */
+	const uint64_t kernel[6] = { 1, 2, 1, 3, 64, 64 };
+	EXPECT_EQ(std::memcmp(model.nchw[8], kernel, sizeof(kernel)), 0);
+	/* B (3x2) goes through the tile DMA: Cin planes of Win elements */
+	const uint64_t source[6] = { 1, 3, 1, 2, 64, 192 };
+	EXPECT_EQ(std::memcmp(model.nchw[10], source, sizeof(source)), 0);
+	const uint64_t result[6] = { 1, 2, 1, 2, 64, 128 };
+	EXPECT_EQ(std::memcmp(model.nchw[12], result, sizeof(result)), 0);
+
+	const struct ane_plan *plan = &model.src_plans[1];
+	EXPECT_EQ(plan->size, 12u);
+	EXPECT_EQ(plan->clear, 192u);
+	ASSERT_EQ(plan->copy_count, 1u);
+	EXPECT_EQ(plan->copies[0].size, 4u);
+	EXPECT_EQ(plan->copies[0].rows, 1u);
+	EXPECT_EQ(plan->copies[0].planes, 3u);
+	EXPECT_EQ(plan->copies[0].data_plane, 4u);
+	EXPECT_EQ(plan->copies[0].tile_plane, 64u);
+
+	ane_model_unload(&model);
+}
+
+TEST(test_plan, test_unknown_layout_is_dense) {
+	std::vector<uint8_t> image = read_file("data/matmul_h15.hwx");
+	ASSERT_FALSE(image.empty());
+
+	struct ane_model model;
+	ASSERT_EQ(ane_model_load(&model, image.data(), image.size()), 0);
+	ASSERT_GT(model.src_count + model.dst_count, 0u);
+
+	for (uint32_t i = 0; i < model.src_count; i++) {
+		const struct ane_plan *plan = &model.src_plans[i];
+		EXPECT_EQ(plan->clear, 0u);
+		ASSERT_EQ(plan->copy_count, 1u);
+		EXPECT_EQ(plan->copies[0].size, plan->size);
+		EXPECT_EQ(plan->copies[0].rows * plan->copies[0].planes, 1u);
+	}
+
+	ane_model_unload(&model);
+}
+
+TEST(test_plan, test_send_read) {
+	std::vector<uint8_t> image = read_file("data/matmul_h14.hwx");
+	ASSERT_FALSE(image.empty());
+
+	/* Channels are plain buffers; plans never look at the device */
+	auto nn = std::make_unique<struct ane_nn>();
+	std::memset(nn.get(), 0, sizeof(*nn));
+	ASSERT_EQ(ane_model_load(&nn->model, image.data(), image.size()), 0);
+
+	std::vector<std::vector<uint8_t>> chans(TILE_COUNT);
+	for (int bdx = 0; bdx < TILE_COUNT; bdx++) {
+		if (nn->model.tiles[bdx]) {
+			chans[bdx].assign(nn->model.tiles[bdx] * 0x4000u, 0xAA);
+			nn->chans[bdx].map = chans[bdx].data();
+		}
+	}
+
+	const uint16_t B[6] = { 1, 2, 3, 4, 5, 6 };
+	ane_tile_send(nn.get(), (void *)B, 1);
+	const std::vector<uint8_t> &tile = chans[10];
+	for (int c = 0; c < 3; c++) {
+		EXPECT_EQ(std::memcmp(&tile[c * 64], &B[c * 2], 4), 0) << c;
+		for (int i = 4; i < 64; i++) {
+			ASSERT_EQ(tile[c * 64 + i], 0) << c << " " << i;
+		}
+	}
+	/* Bytes past the plan are left alone */
+	EXPECT_EQ(tile[192], 0xAA);
+
+	/* Padding is left alone when the model never reads it */
+	EXPECT_EQ(ane_set_tile_flags(nn.get(), 0x2), -EINVAL);
+	ASSERT_EQ(ane_set_tile_flags(nn.get(), ANE_TILE_NO_PAD), 0);
+	std::fill(chans[10].begin(), chans[10].end(), 0xAA);
+	ane_tile_send(nn.get(), (void *)B, 1);
+	for (int c = 0; c < 3; c++) {
+		EXPECT_EQ(std::memcmp(&tile[c * 64], &B[c * 2], 4), 0) << c;
+		for (int i = 4; i < 64; i++) {
+			ASSERT_EQ(tile[c * 64 + i], 0xAA) << c << " " << i;
+		}
+	}
+	ASSERT_EQ(ane_set_tile_flags(nn.get(), 0), 0);
+
+	std::vector<uint8_t> &out = chans[12];
+	const uint16_t C[4] = { 7, 8, 9, 10 };
+	std::memcpy(&out[0], &C[0], 4);
+	std::memcpy(&out[64], &C[2], 4);
+	uint16_t Ch[4] = {};
+	ane_tile_read(nn.get(), Ch, 0);
+	EXPECT_EQ(std::memcmp(Ch, C, sizeof(C)), 0);
+
+	ane_model_unload(&nn->model);
+}
+
+TEST(test_plan, test_send_read_f32) {
+	std::vector<uint8_t> image = read_file("data/matmul_h14.hwx");
+	ASSERT_FALSE(image.empty());
+
+	auto nn = std::make_unique<struct ane_nn>();
+	std::memset(nn.get(), 0, sizeof(*nn));
+	ASSERT_EQ(ane_model_load(&nn->model, image.data(), image.size()), 0);
+
+	std::vector<std::vector<uint8_t>> chans(TILE_COUNT);
+	for (int bdx = 0; bdx < TILE_COUNT; bdx++) {
+		if (nn->model.tiles[bdx]) {
+			chans[bdx].assign(nn->model.tiles[bdx] * 0x4000u, 0xAA);
+			nn->chans[bdx].map = chans[bdx].data();
+		}
+	}
+
+	/* Same bytes as converting first and sending fp16 */
+	const float B[6] = { 1.0f, -2.5f, 3.0f, 0.125f, 65504.0f, -0.0f };
+	uint16_t Bh[6];
+	ane_f32_to_f16_row(B, Bh, 6);
+	ane_tile_send_f32(nn.get(), B, 1);
+	const std::vector<uint8_t> sent = chans[10];
+	std::fill(chans[10].begin(), chans[10].end(), 0xAA);
+	ane_tile_send(nn.get(), Bh, 1);
+	EXPECT_EQ(sent, chans[10]);
+	EXPECT_EQ(sent[192], 0xAA);
+
+	/* Padding left by an earlier send is cleared again */
+	std::fill(chans[10].begin(), chans[10].begin() + 192, 0xAA);
+	ane_tile_send_f32(nn.get(), B, 1);
+	EXPECT_EQ(sent, chans[10]);
+
+	/* A is 2x3 in a 64x64 plane per channel */
+	const float A[6] = { 1, 2, 3, 4, 5, 6 };
+	uint16_t Ah[6];
+	ane_f32_to_f16_row(A, Ah, 6);
+	ane_tile_send(nn.get(), Ah, 0);
+	const std::vector<uint8_t> expected = chans[8];
+	std::fill(chans[8].begin(), chans[8].end(), 0xAA);
+	ane_tile_send_f32(nn.get(), A, 0);
+	const std::vector<uint8_t> &tile = chans[8];
+	EXPECT_EQ(tile, expected);
+	const size_t clear = nn->model.src_plans[0].clear;
+	size_t nonzero = 0;
+	for (size_t i = 0; i < clear; i++) {
+		nonzero += tile[i] != 0;
+	}
+	EXPECT_LE(nonzero, sizeof(A) / 2);
+	if (clear < tile.size()) {
+		EXPECT_EQ(tile[clear], 0xAA);
+	}
+
+	std::vector<uint8_t> &out = chans[12];
+	const float C[4] = { 7, -8, 0.5f, 1024 };
+	uint16_t Ch[4];
+	ane_f32_to_f16_row(C, Ch, 4);
+	std::memcpy(&out[0], &Ch[0], 4);
+	std::memcpy(&out[64], &Ch[2], 4);
+	float Cf[5] = { 0, 0, 0, 0, 123 };
+	ane_tile_read_f32(nn.get(), Cf, 0);
+	EXPECT_EQ(std::memcmp(Cf, C, sizeof(C)), 0);
+	EXPECT_EQ(Cf[4], 123);
+
+	ane_model_unload(&nn->model);
+}
+
+/* Converting then sending walks the tensor twice and the channel twice */
+TEST(test_plan, bench_send_f32) {
+	const uint32_t C = 64, H = 224, W = 224, stride = 512;
+	auto nn = std::make_unique<struct ane_nn>();
+	std::memset(nn.get(), 0, sizeof(*nn));
+
+	struct ane_plan *plan = &nn->model.src_plans[0];
+	nn->model.src_count = 1;
+	plan->bdx = 0;
+	plan->copy_count = 1;
+	plan->size = (uint64_t)C * H * W * 2;
+	plan->clear = (uint64_t)C * H * stride;
+	plan->copies[0] = { W * 2, H, C, 0, W * 2, H * W * 2, 0, stride, H * stride };
+	nn->model.dst_count = 1;
+	nn->model.dst_plans[0] = *plan;
+
+	std::vector<uint8_t> chan(plan->clear);
+	nn->chans[0].map = chan.data();
+	std::vector<float> x((size_t)C * H * W, 1.0f);
+	std::vector<uint16_t> h(x.size());
+	const int reps = 20;
+
+	auto start = std::chrono::steady_clock::now();
+	for (int r = 0; r < reps; r++) {
+		ane_f32_to_f16_row(x.data(), h.data(), x.size());
+		ane_tile_send(nn.get(), h.data(), 0);
+	}
+	const double two_pass = std::chrono::duration<double, std::micro>(
+		std::chrono::steady_clock::now() - start).count() / reps;
+
+	start = std::chrono::steady_clock::now();
+	for (int r = 0; r < reps; r++) {
+		ane_tile_send_f32(nn.get(), x.data(), 0);
+	}
+	const double fused = std::chrono::duration<double, std::micro>(
+		std::chrono::steady_clock::now() - start).count() / reps;
+
+	start = std::chrono::steady_clock::now();
+	for (int r = 0; r < reps; r++) {
+		ane_tile_read_f32(nn.get(), x.data(), 0);
+	}
+	const double read = std::chrono::duration<double, std::micro>(
+		std::chrono::steady_clock::now() - start).count() / reps;
+
+	printf("%ux%ux%u send: convert+send %8.1f us, fused %8.1f us; fused read %8.1f us\n",
+	       C, H, W, two_pass, fused, read);
+	EXPECT_EQ(x[x.size() - 1], 1.0f);
+}
+
+/* A 1 x C x H x W input whose rows are R bytes apart and planes P */
+static void image_input(struct ane_nn *nn, std::vector<uint8_t> &chan, uint32_t C,
+			uint32_t H, uint32_t W, uint64_t P, uint64_t R)
+{
+	std::memset(nn, 0, sizeof(*nn));
+	nn->model.src_count = 1;
+	nn->model.src_plans[0].bdx = 0;
+	const uint64_t nchw[6] = { 1, C, H, W, P, R };
+	std::memcpy(nn->model.nchw[0], nchw, sizeof(nchw));
+	chan.assign(C * P + 64, 0xAA);
+	nn->chans[0].map = chan.data();
+}
+
+/* Pixels go where de-interleaving, normalizing, converting and tiling put them */
+static std::vector<uint8_t> image_reference(const std::vector<uint8_t> &hwc, uint32_t C,
+					    uint32_t H, uint32_t W, uint64_t P, uint64_t R,
+					    float scale, float bias)
+{
+	std::vector<float> planar((size_t)C * H * W);
+	for (uint32_t c = 0; c < C; c++) {
+		for (uint64_t i = 0; i < (uint64_t)H * W; i++) {
+			planar[c * H * W + i] = hwc[i * C + c] * scale + bias;
+		}
+	}
+	std::vector<uint16_t> h(planar.size());
+	ane_f32_to_f16_row(planar.data(), h.data(), h.size());
+	std::vector<uint8_t> tile(C * P + 64, 0xAA);
+	ane_tile(h.data(), tile.data(), 1, C, H, W, P, R);
+	return tile;
+}
+
+TEST(test_plan, test_send_image) {
+	auto nn = std::make_unique<struct ane_nn>();
+	std::vector<uint8_t> chan;
+
+	/* Widths around a block, rows padded, planes padded and not */
+	const struct { uint32_t C, H, W; uint64_t P, R; } shapes[] = {
+		{ 3, 5, 7, 8 * 64, 64 },
+		{ 3, 17, 300, 17 * 640, 640 },
+		{ 4, 3, 512, 3 * 1024, 1024 },
+		{ 1, 9, 513, 16 * 1088, 1088 },
+	};
+	for (const auto &s : shapes) {
+		std::vector<uint8_t> hwc((size_t)s.H * s.W * s.C);
+		for (size_t i = 0; i < hwc.size(); i++) {
+			hwc[i] = (uint8_t)(i * 37 + i / 7);
+		}
+
+		image_input(nn.get(), chan, s.C, s.H, s.W, s.P, s.R);
+		ASSERT_EQ(ane_send_image(nn.get(), 0, hwc.data(), s.H, s.W, s.C, 2.0f / 255, -1), 0);
+		EXPECT_EQ(chan, image_reference(hwc, s.C, s.H, s.W, s.P, s.R, 2.0f / 255, -1))
+			<< s.C << "x" << s.H << "x" << s.W;
+
+		/* Padding stays as it was */
+		std::fill(chan.begin(), chan.end(), 0xAA);
+		ASSERT_EQ(ane_set_tile_flags(nn.get(), ANE_TILE_NO_PAD), 0);
+		ASSERT_EQ(ane_send_image(nn.get(), 0, hwc.data(), s.H, s.W, s.C, 1, 0), 0);
+		struct ane_map map;
+		ASSERT_EQ(ane_src_map(nn.get(), 0, &map), 0);
+		EXPECT_EQ(ane_compute_f16_to_f32(*ane_map_at(&map, 0, s.C - 1, s.H - 1, s.W - 1)),
+			  hwc.back());
+		if (s.R > s.W * 2) {
+			EXPECT_EQ(chan[s.W * 2], 0xAA);
+		}
+	}
+
+	/* The image must match the input */
+	const uint8_t px[3 * 5 * 7] = {};
+	EXPECT_EQ(ane_send_image(nn.get(), 0, px, 5, 7, 3, 1, 0), -EINVAL);
+	EXPECT_EQ(ane_send_image(nn.get(), 1, px, 9, 513, 1, 1, 0), -EINVAL);
+	image_input(nn.get(), chan, 5, 1, 1, 64, 64);
+	EXPECT_EQ(ane_send_image(nn.get(), 0, px, 1, 1, 5, 1, 0), -EINVAL);
+}
+
+/* What a numpy pre-processing pass amounts to, against the fused one */
+TEST(test_plan, bench_send_image) {
+	const uint32_t C = 3, H = 512, W = 512;
+	const uint64_t R = 1024 + 64, P = H * R;
+	auto nn = std::make_unique<struct ane_nn>();
+	std::vector<uint8_t> chan;
+	image_input(nn.get(), chan, C, H, W, P, R);
+
+	std::vector<uint8_t> hwc((size_t)H * W * C, 128);
+	std::vector<float> planar((size_t)C * H * W);
+	std::vector<uint16_t> h(planar.size());
+	const int reps = 20;
+
+	auto start = std::chrono::steady_clock::now();
+	for (int r = 0; r < reps; r++) {
+		for (uint32_t c = 0; c < C; c++) {
+			for (uint64_t i = 0; i < (uint64_t)H * W; i++) {
+				planar[c * H * W + i] = hwc[i * C + c] * (2.0f / 255) - 1;
+			}
+		}
+		ane_f32_to_f16_row(planar.data(), h.data(), h.size());
+		ane_tile(h.data(), chan.data(), 1, C, H, W, P, R);
+	}
+	const double passes = std::chrono::duration<double, std::micro>(
+		std::chrono::steady_clock::now() - start).count() / reps;
+
+	start = std::chrono::steady_clock::now();
+	for (int r = 0; r < reps; r++) {
+		ane_send_image(nn.get(), 0, hwc.data(), H, W, C, 2.0f / 255, -1);
+	}
+	const double fused = std::chrono::duration<double, std::micro>(
+		std::chrono::steady_clock::now() - start).count() / reps;
+
+	printf("%ux%ux%u image: separate passes %8.1f us, ane_send_image %8.1f us\n",
+	       H, W, C, passes, fused);
+}
+
+TEST(test_plan, test_map) {
+	std::vector<uint8_t> image = read_file("data/matmul_h14.hwx");
+	ASSERT_FALSE(image.empty());
+
+	auto nn = std::make_unique<struct ane_nn>();
+	std::memset(nn.get(), 0, sizeof(*nn));
+	ASSERT_EQ(ane_model_load(&nn->model, image.data(), image.size()), 0);
+
+	std::vector<std::vector<uint8_t>> chans(TILE_COUNT);
+	for (int bdx = 0; bdx < TILE_COUNT; bdx++) {
+		if (nn->model.tiles[bdx]) {
+			chans[bdx].assign(nn->model.tiles[bdx] * 0x4000u, 0);
+			nn->chans[bdx].map = chans[bdx].data();
+		}
+	}
+
+	struct ane_map map;
+	EXPECT_EQ(ane_src_map(nn.get(), 2, &map), -EINVAL);
+	EXPECT_EQ(ane_dst_map(nn.get(), 1, &map), -EINVAL);
+
+	/* Writing B (3x2) in place lays it out exactly like ane_tile_send() */
+	const uint16_t B[6] = { 1, 2, 3, 4, 5, 6 };
+	ASSERT_EQ(ane_src_map(nn.get(), 1, &map), 0);
+	EXPECT_EQ((void *)map.data, (void *)chans[10].data());
+	EXPECT_EQ(map.N, 1u);
+	EXPECT_EQ(map.C, 3u);
+	EXPECT_EQ(map.H, 1u);
+	EXPECT_EQ(map.W, 2u);
+	EXPECT_EQ(map.plane_stride, 32u);
+	for (uint32_t c = 0; c < map.C; c++) {
+		for (uint32_t w = 0; w < map.W; w++) {
+			*ane_map_at(&map, 0, c, 0, w) = B[c * 2 + w];
+		}
+	}
+	const std::vector<uint8_t> mapped = chans[10];
+	ane_tile_send(nn.get(), (void *)B, 1);
+	EXPECT_EQ(mapped, chans[10]);
+
+	/* Results are read where the engine left them */
+	const uint16_t C[4] = { 7, 8, 9, 10 };
+	std::memcpy(&chans[12][0], &C[0], 4);
+	std::memcpy(&chans[12][64], &C[2], 4);
+	ASSERT_EQ(ane_dst_map(nn.get(), 0, &map), 0);
+	ASSERT_EQ(map.C * map.W, 4u);
+	for (uint32_t c = 0; c < map.C; c++) {
+		for (uint32_t w = 0; w < map.W; w++) {
+			EXPECT_EQ(*ane_map_at(&map, 0, c, 0, w), C[c * map.W + w]);
+		}
+	}
+
+	ane_model_unload(&nn->model);
+}
@@ -5,14 +5,8 @@ import ane
 import cv2
 import numpy as np
 
-def rescale(a, low, high):
-	return np.interp(a, (a.min(), a.max()), (low, high))
-
-def preprocess(img): # (any, any, 3) RGB -> (1, 3, 512, 512)
-	resized = cv2.resize(img, (512, 512), interpolation=cv2.INTER_AREA)
-	transposed = np.expand_dims(resized.swapaxes(0, -1).swapaxes(1, -1), 0)
-	normed = rescale(transposed, -1, +1).astype(np.float16)
-	return normed
+def preprocess(img): # (any, any, 3) RGB -> (512, 512, 3), which libane rescales to [-1, 1]
+	return cv2.resize(img, (512, 512), interpolation=cv2.INTER_AREA)
 
 def postprocess(outarrs):# (1, 3, 2048, 2048) -> (2048, 2048, 3) RGB
 	reshaped = np.swapaxes(outarrs[0].squeeze(), 0, -1).swapaxes(0, 1)
@@ -29,7 +23,6 @@ if __name__ == "__main__":
 
 	model = ane.model(args.lib)
 	img = cv2.imread(args.input)[:,:,::-1]
-	inarr = preprocess(img)
-	outarrs = model.predict([inarr])
+	outarrs = model.predict_image(preprocess(img))
 	pred = postprocess(outarrs)
 	cv2.imwrite(args.output, pred[:,:,::-1])
@@ -0,0 +1,182 @@
+// SPDX-License-Identifier: MIT
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <libane/ane.h>
+
+struct tile_shape {
+	uint64_t N, C, H, W, P, R;
+
+	uint64_t data_size() const { return N * C * H * W * sizeof(uint16_t); }
+	uint64_t tile_size() const { return N * C * P; }
+};
+
+static const tile_shape shapes[] = {
+	/* Padded rows and planes, above the threshold */
+	{ 1, 3, 500, 500, 512 * 1024, 1024 },
+	{ 2, 8, 100, 30, 128 * 64, 64 },
+	/* Dense */
+	{ 1, 4, 256, 512, 256 * 1024, 1024 },
+	/* Small enough for the serial path */
+	{ 1, 3, 7, 5, 8 * 64, 64 },
+};
+
+/* What tiling always meant: clear everything, then copy rows over it */
+static void tile_reference(const uint16_t *data, uint8_t *tile, const tile_shape &s)
+{
+	const uint64_t new_H = s.P / s.R;
+	std::fill(tile, tile + s.tile_size(), 0);
+	for (uint64_t plane = 0; plane < s.N * s.C; plane++) {
+		for (uint64_t h = 0; h < s.H; h++) {
+			std::memcpy(tile + (plane * new_H + h) * s.R, data + (plane * s.H + h) * s.W,
+				    s.W * sizeof(uint16_t));
+		}
+	}
+}
+
+class test_tile : public ::testing::Test {
+protected:
+	void TearDown() override {
+		ane_tile_set_threads(0);
+	}
+};
+
+TEST_F(test_tile, test_matches_serial) {
+	EXPECT_EQ(ane_tile_set_threads(-1), -EINVAL);
+
+	for (const tile_shape &s : shapes) {
+		std::vector<uint16_t> data(s.data_size() / sizeof(uint16_t));
+		for (size_t i = 0; i < data.size(); i++) {
+			data[i] = (uint16_t)(i * 2654435761u >> 7);
+		}
+
+		std::vector<uint8_t> expected(s.tile_size());
+		tile_reference(data.data(), expected.data(), s);
+
+		std::vector<uint8_t> serial(s.tile_size(), 0xAA);
+		ane_tile(data.data(), serial.data(), s.N, s.C, s.H, s.W, s.P, s.R);
+		EXPECT_EQ(serial, expected) << s.H << "x" << s.W;
+
+		for (int threads : { 1, 2, 3, 4 }) {
+			ASSERT_EQ(ane_tile_set_threads(threads), 0);
+
+			std::vector<uint8_t> tile(s.tile_size(), 0xAA);
+			ane_tile_mt(data.data(), tile.data(), s.N, s.C, s.H, s.W, s.P, s.R);
+			EXPECT_EQ(tile, expected) << s.H << "x" << s.W << " " << threads;
+
+			std::vector<uint16_t> back(data.size(), 0xAAAA);
+			ane_untile_mt(back.data(), tile.data(), s.N, s.C, s.H, s.W, s.P, s.R);
+			EXPECT_EQ(back, data) << s.H << "x" << s.W << " " << threads;
+		}
+	}
+}
+
+/* Without padding writes, data lands where it did and nothing else moves */
+TEST_F(test_tile, test_no_pad) {
+	for (const tile_shape &s : shapes) {
+		std::vector<uint16_t> data(s.data_size() / sizeof(uint16_t), 0x3c00);
+		std::vector<uint8_t> expected(s.tile_size());
+		tile_reference(data.data(), expected.data(), s);
+
+		std::vector<uint8_t> tile(s.tile_size(), 0xAA);
+		ane_tile_flags(data.data(), tile.data(), s.N, s.C, s.H, s.W, s.P, s.R,
+			       ANE_TILE_NO_PAD);
+		std::vector<uint8_t> tile_mt(s.tile_size(), 0xAA);
+		ane_tile_mt_flags(data.data(), tile_mt.data(), s.N, s.C, s.H, s.W, s.P, s.R,
+				  ANE_TILE_NO_PAD);
+		EXPECT_EQ(tile, tile_mt) << s.H << "x" << s.W;
+
+		uint64_t data_bytes = 0;
+		for (uint64_t i = 0; i < tile.size(); i++) {
+			if (tile[i] == 0xAA) {
+				ASSERT_EQ(expected[i], 0) << s.H << "x" << s.W << " " << i;
+			} else {
+				ASSERT_EQ(tile[i], expected[i]) << s.H << "x" << s.W << " " << i;
+				data_bytes++;
+			}
+		}
+		EXPECT_EQ(data_bytes, s.data_size()) << s.H << "x" << s.W;
+	}
+}
+
+/* Callers racing for the pool get the same bytes */
+TEST_F(test_tile, test_concurrent_callers) {
+	const tile_shape s = shapes[0];
+	ASSERT_EQ(ane_tile_set_threads(3), 0);
+
+	std::vector<uint16_t> data(s.data_size() / sizeof(uint16_t), 0x3c00);
+	std::vector<uint8_t> expected(s.tile_size());
+	ane_tile(data.data(), expected.data(), s.N, s.C, s.H, s.W, s.P, s.R);
+
+	std::vector<std::thread> threads;
+	std::vector<int> failures(4);
+	for (int t = 0; t < 4; t++) {
+		threads.emplace_back([&, t] {
+			std::vector<uint8_t> tile(s.tile_size(), 0xAA);
+			for (int i = 0; i < 10; i++) {
+				ane_tile_mt(data.data(), tile.data(), s.N, s.C, s.H, s.W, s.P, s.R);
+				failures[t] += tile != expected;
+			}
+		});
+	}
+	for (auto &thread : threads) {
+		thread.join();
+	}
+	for (int t = 0; t < 4; t++) {
+		EXPECT_EQ(failures[t], 0) << t;
+	}
+}
+
+/* An srgan-sized output, 1x3x2000x2000 padded to 2048x2048 */
+TEST_F(test_tile, bench_tile_scaling) {
+	const tile_shape s = { 1, 3, 2000, 2000, 2048 * 4096, 4096 };
+	std::vector<uint16_t> data(s.data_size() / sizeof(uint16_t), 0x3c00);
+	std::vector<uint8_t> tile(s.tile_size());
+	const int reps = 5;
+
+	const int cpus = (int)std::max(1u, std::thread::hardware_concurrency());
+	for (int threads = 1; threads <= std::max(cpus, 4); threads *= 2) {
+		ASSERT_EQ(ane_tile_set_threads(threads), 0);
+		/* Fault everything in first */
+		ane_tile_mt(data.data(), tile.data(), s.N, s.C, s.H, s.W, s.P, s.R);
+
+		auto start = std::chrono::steady_clock::now();
+		for (int r = 0; r < reps; r++) {
+			ane_tile_mt(data.data(), tile.data(), s.N, s.C, s.H, s.W, s.P, s.R);
+		}
+		const double tile_ms = std::chrono::duration<double, std::milli>(
+			std::chrono::steady_clock::now() - start).count() / reps;
+
+		start = std::chrono::steady_clock::now();
+		for (int r = 0; r < reps; r++) {
+			ane_untile_mt(data.data(), tile.data(), s.N, s.C, s.H, s.W, s.P, s.R);
+		}
+		const double untile_ms = std::chrono::duration<double, std::milli>(
+			std::chrono::steady_clock::now() - start).count() / reps;
+
+		printf("%d thread(s) of %d CPUs: tile %7.2f ms, untile %7.2f ms\n",
+		       threads, cpus, tile_ms, untile_ms);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	for (int r = 0; r < reps; r++) {
+		ane_tile(data.data(), tile.data(), s.N, s.C, s.H, s.W, s.P, s.R);
+	}
+	printf("serial ane_tile: %7.2f ms\n", std::chrono::duration<double, std::milli>(
+		std::chrono::steady_clock::now() - start).count() / reps);
+
+	start = std::chrono::steady_clock::now();
+	for (int r = 0; r < reps; r++) {
+		ane_tile_flags(data.data(), tile.data(), s.N, s.C, s.H, s.W, s.P, s.R,
+			       ANE_TILE_NO_PAD);
+	}
+	printf("serial ane_tile, no padding: %7.2f ms\n", std::chrono::duration<double, std::milli>(
+		std::chrono::steady_clock::now() - start).count() / reps);
+}
@@ -8,7 +8,6 @@
 #include <cerrno>
 #include <cstdint>
 #include <cstring>
-#include <vector>
 
 void dump_td_v11(const struct hwx_file *hwx, const struct hwx_section *section)
 {
@@ -34,15 +33,16 @@ void dump_td_v11(const struct hwx_file *hwx, const struct hwx_section *section)
 		std::println("  trailing bytes : {}", trailing_bytes);
 	}
 
-	std::vector<std::uint8_t> buffer(entry_size);
-	if (hwx_section_read(hwx, section, 0, buffer.data(), buffer.size()) != 0) {
+	// Always decoded from a copy; mapped sections need not be aligned for TD_V11
+	ane::TD_V11 td{};
+	const void *data = hwx_section_data(hwx, section);
+	if (data) {
+		std::memcpy(&td, data, entry_size);
+	} else if (hwx_section_read(hwx, section, 0, &td, entry_size) != 0) {
 		std::println(stderr, "Failed to read __TEXT/__text: {}", std::strerror(errno));
 		return;
 	}
 
-	ane::TD_V11 td{};
-	std::memcpy(&td, buffer.data(), entry_size);
-
 	const auto &header = td.header;
 	std::println("\n  Header");
 	PRINT(header, unk_maybe_log_events, "0x{:X}");
@@ -133,7 +133,7 @@ int main(int argc, char **argv)
 	}
 
 	const std::filesystem::path path = argv[1];
-	struct hwx_file *hwx = hwx_open(path.string().c_str());
+	struct hwx_file *hwx = hwx_open_mapped(path.string().c_str());
 	if (!hwx) {
 		std::println(stderr, "Failed to load {}: {}", path.string(), std::strerror(errno));
 		return EXIT_FAILURE;
@@ -0,0 +1,269 @@
+// SPDX-License-Identifier: MIT
+
+#include "hwx.h"
+#include "td_v5.h"
+#include "td_v11.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <print>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+
+// Hints left at -1 are not touched
+struct hint_options {
+	int coeff = -1;
+	int src = -1;
+	int src_reuse = -1;
+	int src_noreuse = -1;
+	int dst = -1;
+	long td = -1;
+};
+
+static void usage(FILE *stream)
+{
+	std::println(stream, "Usage: ane-opt [options] <in.hwx> <out.hwx>");
+	std::println(stream, "Rewrites DMA cache hints of every TD, or only TD n with --td.");
+	std::println(stream, "  --td=<n>             only rewrite TD n");
+	std::println(stream, "  --coeff=<hint>       kernel (weight) DMA channels");
+	std::println(stream, "  --src=<hint>         tile source DMA");
+	std::println(stream, "  --src-reuse=<hint>   tile source DMA, reused lines");
+	std::println(stream, "  --src-noreuse=<hint> tile source DMA, single-use lines");
+	std::println(stream, "  --dst=<hint>         tile destination DMA");
+	std::println(stream, "Hints: alloc, noalloc, drop, depri or a raw value 0-15.");
+}
+
+static bool parse_hint(const char *value, int &hint)
+{
+	static const struct {
+		const char *name;
+		int value;
+	} names[] = {
+		{ "alloc", ane::cache_hint_alloc },
+		{ "noalloc", ane::cache_hint_noalloc },
+		{ "drop", ane::cache_hint_drop },
+		{ "depri", ane::cache_hint_depri },
+	};
+
+	for (const auto &entry : names) {
+		if (std::strcmp(value, entry.name) == 0) {
+			hint = entry.value;
+			return true;
+		}
+	}
+
+	char *end = nullptr;
+	const long raw = std::strtol(value, &end, 0);
+	if (end == value || *end != '\0' || raw < 0 || raw > 15) {
+		return false;
+	}
+	hint = static_cast<int>(raw);
+	return true;
+}
+
+// Returns the number of fields that changed
+template <typename Field>
+static uint32_t set_hint(Field &field, int hint)
+{
+	if (hint < 0 || static_cast<uint32_t>(field) == static_cast<uint32_t>(hint)) {
+		return 0;
+	}
+	field = static_cast<ane::U32>(hint);
+	return 1;
+}
+
+static uint32_t rewrite_td_v5(ane::TD_V5 &td, const hint_options &options)
+{
+	uint32_t changed = 0;
+
+	for (auto &config : td.kernel_dma_src.coeff_dma_config) {
+		if (static_cast<uint32_t>(config.en)) {
+			changed += set_hint(config.cache_hint, options.coeff);
+		}
+	}
+
+	auto &src = td.tile_dma_src.DMAConfig;
+	if (static_cast<uint32_t>(src.en)) {
+		changed += set_hint(src.cache_hint, options.src);
+		changed += set_hint(src.cache_hint_reuse, options.src_reuse);
+		changed += set_hint(src.cache_hint_noreuse, options.src_noreuse);
+	}
+
+	auto &dst = td.tile_dma_dst.DMAConfig;
+	if (static_cast<uint32_t>(dst.en)) {
+		changed += set_hint(dst.cache_hint, options.dst);
+	}
+
+	return changed;
+}
+
+// TDs are rewritten through a local copy; the section may not be aligned
+static int rewrite_tsk_v5(std::vector<uint8_t> &tsk, const hint_options &options)
+{
+	const size_t entry_count = tsk.size() / sizeof(ane::TD_V5);
+	if (entry_count == 0) {
+		std::println(stderr, "__TEXT/__text is smaller than a TD_V5");
+		return -1;
+	}
+	if (options.td >= static_cast<long>(entry_count)) {
+		std::println(stderr, "TD {} out of range ({} entries)", options.td, entry_count);
+		return -1;
+	}
+
+	uint32_t total = 0;
+	for (size_t i = 0; i < entry_count; ++i) {
+		if (options.td >= 0 && static_cast<size_t>(options.td) != i) {
+			continue;
+		}
+		ane::TD_V5 td;
+		std::memcpy(&td, tsk.data() + i * sizeof(td), sizeof(td));
+		const uint32_t changed = rewrite_td_v5(td, options);
+		std::memcpy(tsk.data() + i * sizeof(td), &td, sizeof(td));
+		std::println("  td[{}] : {} field(s) changed", i, changed);
+		total += changed;
+	}
+
+	std::println("  total : {} field(s) changed", total);
+	return 0;
+}
+
+static int write_image(const struct hwx_file *hwx, const struct hwx_section *tsk,
+		       const std::vector<uint8_t> &data, const std::string &path)
+{
+	// Written next to the output and renamed, so in == out is safe too
+	const std::string tmp = path + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		std::println(stderr, "Failed to create {}: {}", tmp, std::strerror(errno));
+		return -1;
+	}
+
+	const struct hwx_patch patch = { tsk, 0, data.data(), data.size() };
+	int err = hwx_write(hwx, fd, &patch, 1);
+	if (close(fd) != 0 && !err) {
+		err = -1;
+	}
+	if (!err && rename(tmp.c_str(), path.c_str()) != 0) {
+		err = -1;
+	}
+	if (err) {
+		std::println(stderr, "Failed to write {}: {}", path, std::strerror(errno));
+		unlink(tmp.c_str());
+	}
+	return err;
+}
+
+int main(int argc, char **argv)
+{
+	enum {
+		OPT_TD = 0x100,
+		OPT_COEFF,
+		OPT_SRC,
+		OPT_SRC_REUSE,
+		OPT_SRC_NOREUSE,
+		OPT_DST,
+	};
+	static const struct option long_options[] = {
+		{ "td", required_argument, nullptr, OPT_TD },
+		{ "coeff", required_argument, nullptr, OPT_COEFF },
+		{ "src", required_argument, nullptr, OPT_SRC },
+		{ "src-reuse", required_argument, nullptr, OPT_SRC_REUSE },
+		{ "src-noreuse", required_argument, nullptr, OPT_SRC_NOREUSE },
+		{ "dst", required_argument, nullptr, OPT_DST },
+		{ "help", no_argument, nullptr, 'h' },
+		{ nullptr, 0, nullptr, 0 },
+	};
+
+	hint_options options;
+	int opt;
+	while ((opt = getopt_long(argc, argv, "h", long_options, nullptr)) != -1) {
+		bool ok = true;
+		switch (opt) {
+		case OPT_TD: {
+			char *end = nullptr;
+			options.td = std::strtol(optarg, &end, 0);
+			ok = end != optarg && *end == '\0' && options.td >= 0;
+			break;
+		}
+		case OPT_COEFF:
+			ok = parse_hint(optarg, options.coeff);
+			break;
+		case OPT_SRC:
+			ok = parse_hint(optarg, options.src);
+			break;
+		case OPT_SRC_REUSE:
+			ok = parse_hint(optarg, options.src_reuse);
+			break;
+		case OPT_SRC_NOREUSE:
+			ok = parse_hint(optarg, options.src_noreuse);
+			break;
+		case OPT_DST:
+			ok = parse_hint(optarg, options.dst);
+			break;
+		case 'h':
+			usage(stdout);
+			return EXIT_SUCCESS;
+		default:
+			usage(stderr);
+			return EXIT_FAILURE;
+		}
+		if (!ok) {
+			std::println(stderr, "Invalid value for {}: {}", argv[optind - 1], optarg);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (argc - optind != 2) {
+		usage(stderr);
+		return EXIT_FAILURE;
+	}
+
+	const std::string in = argv[optind];
+	const std::string out = argv[optind + 1];
+	struct hwx_file *hwx = hwx_open_mapped(in.c_str());
+	if (!hwx) {
+		std::println(stderr, "Failed to load {}: {}", in, std::strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	const struct hwx_section *tsk = hwx_get_tsk_section(hwx);
+	if (!tsk) {
+		std::println(stderr, "No __TEXT/__text section present.");
+		hwx_close(hwx);
+		return EXIT_FAILURE;
+	}
+
+	std::vector<uint8_t> data(tsk->size);
+	if (hwx_section_read(hwx, tsk, 0, data.data(), data.size()) != 0) {
+		std::println(stderr, "Failed to read __TEXT/__text: {}", std::strerror(errno));
+		hwx_close(hwx);
+		return EXIT_FAILURE;
+	}
+
+	int err;
+	switch (hwx_td_version(hwx)) {
+	case 5:
+	case 7: // dumped with the TD_V5 layout too
+		err = rewrite_tsk_v5(data, options);
+		break;
+	default:
+		// TD_V11 does not place its coeff_dma_config[] yet
+		std::println(stderr, "Unsupported TD version: {}", hwx_td_version(hwx));
+		err = -1;
+		break;
+	}
+
+	if (!err) {
+		err = write_image(hwx, tsk, data, out);
+	}
+
+	hwx_close(hwx);
+	return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}